@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <libcsp/csp.h>
+#include <libcsp/scheduler.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The procs are spawned by csp_proc_create() with the small stacks below, so
+ * the configuration generated by cspcli isn't needed. */
+size_t csp_cpu_cores = 0;
+size_t csp_max_threads = 1024;
+size_t csp_max_procs_hint = 100000;
+size_t csp_procs_num = 1;
+size_t csp_procs_size[] = {16384};
+
+#define PROCS   50000
+#define ROUNDS  100
+
+atomic_int started = 0, done = 0;
+atomic_bool go = false;
+
+/* Every proc touches its own stack on each switch, which spreads the switches
+ * over `PROCS` stacks of 16KB, i.e. about 800MB. The switches are timed once
+ * all of them have started so that the page faults of their stacks aren't
+ * counted. */
+void spin(void *arg) {
+  atomic_fetch_add(&started, 1);
+  while (!atomic_load(&go)) {
+    csp_yield();
+  }
+  for (int i = 0; i < ROUNDS; i++) {
+    csp_yield();
+  }
+  atomic_fetch_add(&done, 1);
+}
+
+int64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+int main(void) {
+  const char *huge = getenv("LIBCSP_HUGEPAGES");
+
+  for (int i = 0; i < PROCS; i++) {
+    csp_proc_create(0, spin, NULL);
+  }
+  while (atomic_load(&started) < PROCS) {
+    usleep(1000);
+  }
+
+  int64_t start = now();
+  atomic_store(&go, true);
+  while (atomic_load(&done) < PROCS) {
+    usleep(1000);
+  }
+
+  double seconds = (double)(now() - start) / 1e9;
+  printf("Huge pages: %s, %d procs switched %d times each in %lf seconds, "
+    "%.0lf switches per second.\n", huge != NULL ? huge : "none", PROCS,
+    ROUNDS, seconds, (double)PROCS * ROUNDS / seconds
+  );
+  return 0;
+}
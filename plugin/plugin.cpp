@@ -21,6 +21,7 @@
 #include "namer.hpp"
 #include "proc.hpp"
 #include "sa.hpp"
+#include "safepoint.hpp"
 #include <iostream>
 #include <unordered_map>
 
@@ -41,12 +42,15 @@ std::unordered_map<std::string, std::pair<csp::stack_usage_t,
   /* `csp_core_proc_exit_inner` calls `csp_proc_destroy` on the thread stack,
    * so we ignore it. */
   {"csp_core_proc_exit_inner", {csp::stack_usage_t(-1, 0), {}}},
+  /* `csp_core_block_epilogue` runs the inner one on the thread stack. */
+  {"csp_core_block_epilogue", {csp::stack_usage_t(-1, 8), {}}},
   {
-    "csp_core_block_epilogue",
-    {csp::stack_usage_t(-1, 8), {"csp_core_block_epilogue_inner"}}
+    "csp_core_yield",
+    {csp::stack_usage_t(-1, 8), {"csp_core_anchor_restore"}}
   },
+  /* `csp_core_switch_to` jumps to the next proc or back to the anchor. */
   {
-    "csp_core_yield",
+    "csp_core_switch_to",
     {csp::stack_usage_t(-1, 8), {"csp_core_anchor_restore"}}
   },
 };
@@ -177,6 +181,7 @@ int plugin_init(struct plugin_name_args *plugin,
   }
 
   auto is_building_libcsp = false;
+  auto with_safepoints = false;
   auto working_dir = csp::default_working_dir;
   auto installed_prefix =csp::default_installed_prefix;
 
@@ -190,6 +195,8 @@ int plugin_init(struct plugin_name_args *plugin,
 
     if (key == "building-libcsp") {
       is_building_libcsp = val == "true";
+    } else if (key == "safepoints") {
+      with_safepoints = val == "true";
     } else if (!csp::filesystem_t::exist(val)) {
       std::cerr << csp::err_prefix << val << " doesn't exist." << std::endl;
       return EXIT_FAILURE;
@@ -205,5 +212,17 @@ int plugin_init(struct plugin_name_args *plugin,
   csp::namer.initialize(is_building_libcsp, installed_prefix, working_dir);
   csp::analyzer.set_working_dir(working_dir);
 
+  /* Safepoints are only inserted into the user code, libcsp itself is always
+   * built without them. */
+  if (with_safepoints && !is_building_libcsp) {
+    struct register_pass_info safepoint_pass_info;
+    safepoint_pass_info.pass = new csp::safepoint_pass_t(g);
+    safepoint_pass_info.reference_pass_name = "cfg";
+    safepoint_pass_info.ref_pass_instance_number = 1;
+    safepoint_pass_info.pos_op = PASS_POS_INSERT_AFTER;
+    register_callback(plugin_name, PLUGIN_PASS_MANAGER_SETUP, NULL,
+      &safepoint_pass_info);
+  }
+
   return EXIT_SUCCESS;
 }
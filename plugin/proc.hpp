@@ -192,12 +192,12 @@ public:
     };
 
     const char *pops[6] = {
+      "popq 0x18(%rdi)\n",
+      "popq 0x20(%rdi)\n",
+      "popq 0x28(%rdi)\n",
       "popq 0x30(%rdi)\n",
       "popq 0x38(%rdi)\n",
-      "popq 0x40(%rdi)\n",
-      "popq 0x48(%rdi)\n",
-      "popq 0x50(%rdi)\n",
-      "popq 0x58(%rdi)\n"
+      "popq 0x40(%rdi)\n"
     };
 
     /* Stack frame size of the wrapper function in bytes. */
@@ -236,8 +236,8 @@ public:
       "mov  %rax, %rdi\n"
 
       /* Store mxcsr register and the x87 control word. */
-      "stmxcsr 0x18(%rdi)\n"
-      "fstcw   0x1c(%rdi)\n"
+      "stmxcsr 0x00(%rdi)\n"
+      "fstcw   0x04(%rdi)\n"
     );
 
     /* Restore the stack and then store the arguments passed by registers. */
@@ -249,14 +249,14 @@ public:
     if (build_type == TYPE_TIMER_PROC) {
       if (args_len <= 6) {
         buff.insert(buff.length(), instr, sprintf(instr,
-          "mov 0x%x(%%rdi), %%rax\n", 0x30 + ((args_len - 1) << 3)
+          "mov 0x%x(%%rdi), %%rax\n", 0x18 + ((args_len - 1) << 3)
         ));
       } else {
         buff.insert(buff.length(), instr, sprintf(instr,
           "mov 0x%x(%%rsp), %%rax\n", (args_len - 5) << 3
         ));
       }
-      buff.append("mov %rax, 0x60(%rdi)\n");
+      buff.append("mov %rax, 0x90(%rdi)\n");
     }
 
     /* The reserved space in the process stack in 8-bytes. The initial one is
@@ -273,13 +273,13 @@ public:
     rsv_num += !(rsv_num & 0x01);
 
     /* Load %rbp. */
-    buff.append("mov 0x28(%rdi), %rax\n");
+    buff.append("mov 0x10(%rdi), %rax\n");
 
     /* Store %rsp. */
     buff.insert(buff.length(), instr, sprintf(instr,
       "sub $0x%x, %%rax\n", rsv_num << 3
     ));
-    buff.append("mov %rax, 0x20(%rdi)\n");
+    buff.append("mov %rax, 0x08(%rdi)\n");
 
     /* Copy arguments passed by stack from right to left if any. */
     for (int i = args_len - 6; i >= 1; i--) {
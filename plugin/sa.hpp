@@ -219,8 +219,8 @@ public:
         su.max_stack_size = size;
       }
 
-      /* The size of `csp_proc_t`. Cause we make %rbp to be 16-bytes alignment,
-       * so we add extra 8-bytes if `sizeof(csp_procs_t) % 16 != 0`. */
+      /* The size of `csp_proc_t`, which is 64-bytes aligned so %rbp is always
+       * 16-bytes aligned. */
       size_t csp_proc_t_size = 32 << 3;
 
       /* All parts of the process plus 8-bytes call instruction space. */
@@ -578,6 +578,14 @@ private:
     }
     file << "};" << std::endl;
 
+    /* The functions run by the processes, which the profiler names the
+     * processes by. */
+    file << "const char *csp_procs_name[] = {";
+    for (decltype(total) id = 0; id < total; id++) {
+      file << "\"" << wrapper_funcs.find(id)->second << "\", ";
+    }
+    file << "};" << std::endl;
+
     file.close();
   }
 
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_PLUGIN_SAFEPOINT_HPP
+#define LIBCSP_PLUGIN_SAFEPOINT_HPP
+
+#include "tree.h"
+#include "tree-pass.h"
+#include "context.h"
+#include "function.h"
+#include "basic-block.h"
+#include "tree-ssa-alias.h"
+#include "internal-fn.h"
+#include "gimple-expr.h"
+#include "gimple.h"
+#include "gimple-iterator.h"
+#include "cfghooks.h"
+#include "cfgloop.h"
+#include "cgraph.h"
+#include "varasm.h"
+#include "stringpool.h"
+#include "attribs.h"
+#include "namer.hpp"
+#include "sa.hpp"
+#include <string>
+#include <vector>
+
+namespace csp {
+
+const std::string csp_sched_safepoint         = "csp_sched_safepoint";
+const std::string csp_sched_preempt_requested = "csp_sched_preempt_requested";
+
+const pass_data safepoint_pass_data = {
+  GIMPLE_PASS,          /* type */
+  "csp_safepoint",      /* name */
+  OPTGROUP_NONE,        /* optinfo_flags */
+  TV_NONE,              /* tv_id */
+  PROP_cfg,             /* properties_required */
+  0,                    /* properties_provided */
+  0,                    /* properties_destroyed */
+  0,                    /* todo_flags_start */
+  0,                    /* todo_flags_finish */
+};
+
+/* Insert the check below at the entry and at every loop back edge of the
+ * functions, which makes the long running procs yield when the scheduler asks
+ * them to without any signal:
+ *
+ *   if (__builtin_expect(csp_sched_preempt_requested, 0)) {
+ *     csp_sched_safepoint();
+ *   }
+ *
+ * The pass runs right after the cfg is built and before the ssa form, so the
+ * flag can be loaded into a plain temporary. */
+class safepoint_pass_t: public gimple_opt_pass {
+public:
+  safepoint_pass_t(gcc::context *ctx):
+    gimple_opt_pass(safepoint_pass_data, ctx), flag(NULL_TREE),
+    safepoint(NULL_TREE)
+  {};
+
+  bool gate(function *fun) override {
+    tree decl = fun->decl;
+    std::string name(fndecl_name(decl));
+
+    /* The process entries are naked, and the functions of libcsp itself must
+     * not yield at arbitrary points(e.g. with a spinlock held). */
+    return !lookup_attribute("naked", DECL_ATTRIBUTES(decl)) &&
+      !lookup_attribute("no_instrument_function", DECL_ATTRIBUTES(decl)) &&
+      !namer.is_generated(name) &&
+      name.compare(0, 4, "csp_") != 0;
+  }
+
+  unsigned int execute(function *fun) override {
+    this->build_decls();
+
+    std::vector<edge> edges;
+    edges.push_back(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(fun)));
+
+    mark_dfs_back_edges(fun);
+    basic_block bb;
+    FOR_EACH_BB_FN(bb, fun) {
+      edge e;
+      edge_iterator ei;
+      FOR_EACH_EDGE(e, ei, bb->succs) {
+        if (e->flags & EDGE_DFS_BACK) {
+          edges.push_back(e);
+        }
+      }
+    }
+
+    for (auto e: edges) {
+      this->insert(fun, e);
+    }
+
+    /* The stack analyzer must know the extra callee. */
+    analyzer.add_call(fndecl_name(fun->decl), csp_sched_safepoint);
+
+    if (current_loops != NULL) {
+      loops_state_set(LOOPS_NEED_FIXUP);
+    }
+    return 0;
+  }
+
+  safepoint_pass_t *clone() override {
+    return this;
+  }
+
+private:
+  void build_decls(void) {
+    if (this->flag != NULL_TREE) {
+      return;
+    }
+
+    /* extern _Thread_local volatile int csp_sched_preempt_requested; */
+    this->flag = build_decl(UNKNOWN_LOCATION, VAR_DECL,
+      get_identifier(csp_sched_preempt_requested.c_str()),
+      build_qualified_type(integer_type_node, TYPE_QUAL_VOLATILE));
+    TREE_PUBLIC(this->flag) = 1;
+    DECL_EXTERNAL(this->flag) = 1;
+    TREE_THIS_VOLATILE(this->flag) = 1;
+    TREE_SIDE_EFFECTS(this->flag) = 1;
+    set_decl_tls_model(this->flag, decl_default_tls_model(this->flag));
+    varpool_node::get_create(this->flag);
+
+    /* extern void csp_sched_safepoint(void); */
+    this->safepoint = build_fn_decl(csp_sched_safepoint.c_str(),
+      build_function_type_list(void_type_node, NULL_TREE));
+    TREE_PUBLIC(this->safepoint) = 1;
+    DECL_EXTERNAL(this->safepoint) = 1;
+  }
+
+  /* Split edge `e` and put the check on it. */
+  void insert(function *fun, edge e) {
+    basic_block check_bb = split_edge(e);
+
+    tree tmp = create_tmp_var(integer_type_node, "csp_preempt");
+    gimple *load = gimple_build_assign(tmp, this->flag);
+    gimple *cond = gimple_build_cond(
+      NE_EXPR, tmp, integer_zero_node, NULL_TREE, NULL_TREE
+    );
+    gimple_stmt_iterator gsi = gsi_last_bb(check_bb);
+    gsi_insert_after(&gsi, load, GSI_NEW_STMT);
+    gsi_insert_after(&gsi, cond, GSI_NEW_STMT);
+
+    edge false_edge = split_block(check_bb, cond);
+    basic_block join_bb = false_edge->dest;
+    false_edge->flags &= ~EDGE_FALLTHRU;
+    false_edge->flags |= EDGE_FALSE_VALUE;
+
+    basic_block call_bb = create_empty_bb(check_bb);
+    gsi = gsi_start_bb(call_bb);
+    gsi_insert_after(&gsi, gimple_build_call(this->safepoint, 0), GSI_NEW_STMT);
+
+    edge true_edge = make_edge(check_bb, call_bb, EDGE_TRUE_VALUE);
+    make_single_succ_edge(call_bb, join_bb, EDGE_FALLTHRU);
+
+    true_edge->probability = profile_probability::very_unlikely();
+    false_edge->probability = true_edge->probability.invert();
+    call_bb->count = check_bb->count.apply_probability(true_edge->probability);
+
+    if (current_loops != NULL) {
+      add_bb_to_loop(call_bb, check_bb->loop_father);
+    }
+  }
+
+  tree flag;
+  tree safepoint;
+};
+
+}
+
+#endif
@@ -3,21 +3,33 @@
 #include "core.h"
 #include "scheduler.h"
 #include "proc_extra.h"
+#include "trace.h"
+#include "worker.h"
 #include <stdlib.h>
 #include <string.h>
 
 extern _Thread_local csp_core_t *csp_this_core;
+extern void csp_sched_park(pthread_mutex_t *lock, void *on, int reason);
+extern void *csp_mem_obj_alloc(size_t size);
+extern void csp_mem_obj_free(void *obj);
 
 csp_gochan_t *csp_gochan_new(size_t capacity) {
-    csp_gochan_t *ch = (csp_gochan_t *)calloc(1, sizeof(csp_gochan_t));
+    csp_gochan_t *ch = (csp_gochan_t *)csp_mem_obj_alloc(sizeof(csp_gochan_t));
     ch->capacity = capacity;
     if (capacity > 0) {
-        ch->buffer = calloc(capacity, sizeof(void *));
+        ch->buffer = (void **)csp_mem_obj_alloc(capacity * sizeof(void *));
     }
     pthread_mutex_init(&ch->lock, NULL);
     return ch;
 }
 
+void csp_gochan_free(csp_gochan_t *ch) {
+    if (ch == NULL) return;
+    pthread_mutex_destroy(&ch->lock);
+    csp_mem_obj_free(ch->buffer);
+    csp_mem_obj_free(ch);
+}
+
 void csp_gochan_close(csp_gochan_t *ch) {
     CSP_CRITICAL_START();
     pthread_mutex_lock(&ch->lock);
@@ -27,22 +39,31 @@ void csp_gochan_close(csp_gochan_t *ch) {
         return;
     }
     ch->closed = true;
-    while (ch->recv_q) {
-        csp_proc_t *p = (csp_proc_t *)ch->recv_q;
-        ch->recv_q = (struct csp_proc_s *)p->next;
-        csp_proc_extra_t *ex = (csp_proc_extra_t *)p->extra;
-        if (ex) {
-            ex->chan_ok = false;
-            ex->chan_val = NULL;
-        }
-        csp_scheduler_submit(p);
+
+    /* Wake up all the receivers and senders at once, the receivers are linked
+     * before the senders. */
+    csp_proc_t *start = NULL, *end = NULL;
+    size_t n = 0;
+    for (csp_proc_t *p = (csp_proc_t *)ch->recv_q; p; p = (csp_proc_t *)p->next) {
+        p->chan_ok = false;
+        p->chan_val = NULL;
+        end = p;
+        n++;
     }
-    while (ch->send_q) {
-        csp_proc_t *p = (csp_proc_t *)ch->send_q;
-        ch->send_q = (struct csp_proc_s *)p->next;
-        csp_scheduler_submit(p);
+    if (end) {
+        start = (csp_proc_t *)ch->recv_q;
+        end->next = ch->send_q;
+    } else {
+        start = (csp_proc_t *)ch->send_q;
     }
+    for (csp_proc_t *p = (csp_proc_t *)ch->send_q; p; p = (csp_proc_t *)p->next) {
+        end = p;
+        n++;
+    }
+    ch->recv_q = ch->send_q = NULL;
     pthread_mutex_unlock(&ch->lock);
+
+    csp_scheduler_submit_batch(start, end, n);
     CSP_CRITICAL_END();
 }
 
@@ -58,13 +79,10 @@ bool csp_gochan_send(csp_gochan_t *ch, void *val) {
     if (ch->recv_q) {
         csp_proc_t *p = (csp_proc_t *)ch->recv_q;
         ch->recv_q = (struct csp_proc_s *)p->next;
-        csp_proc_extra_t *ex = (csp_proc_extra_t *)p->extra;
-        if (ex) {
-            ex->chan_ok = true;
-            ex->chan_val = val;
-        }
+        p->chan_ok = true;
+        p->chan_val = val;
         pthread_mutex_unlock(&ch->lock);
-        csp_scheduler_submit(p);
+        csp_scheduler_submit_next(p);
         CSP_CRITICAL_END();
         return true;
     }
@@ -82,11 +100,10 @@ bool csp_gochan_send(csp_gochan_t *ch, void *val) {
     csp_proc_stat_set(self, csp_proc_stat_blocked);
     self->next = (struct csp_proc_s *)ch->send_q;
     ch->send_q = (struct csp_proc_s *)self;
-    csp_proc_extra_t *self_ex = (csp_proc_extra_t *)self->extra;
-    if (self_ex) self_ex->chan_val = val;
+    self->chan_val = val;
 
-    pthread_mutex_unlock(&ch->lock);
-    csp_core_yield(self, &csp_this_core->anchor);
+    csp_worker_stats_add(csp_stats_chan_blocks, 1);
+    csp_sched_park(&ch->lock, ch, csp_trace_reason_chan);
     CSP_CRITICAL_END();
     return true;
 }
@@ -101,12 +118,11 @@ void *csp_gochan_recv(csp_gochan_t *ch, bool *ok) {
         if (ch->send_q) {
             csp_proc_t *p = (csp_proc_t *)ch->send_q;
             ch->send_q = (struct csp_proc_s *)p->next;
-            csp_proc_extra_t *ex = (csp_proc_extra_t *)p->extra;
-            void *sval = ex ? ex->chan_val : NULL;
+            void *sval = p->chan_val;
             ch->buffer[ch->head] = sval;
             ch->head = (ch->head + 1) % ch->capacity;
             ch->size++;
-            csp_scheduler_submit(p);
+            csp_scheduler_submit_next(p);
         }
         pthread_mutex_unlock(&ch->lock);
         if (ok) *ok = true;
@@ -124,10 +140,9 @@ void *csp_gochan_recv(csp_gochan_t *ch, bool *ok) {
     if (ch->send_q && ch->capacity == 0) {
         csp_proc_t *p = (csp_proc_t *)ch->send_q;
         ch->send_q = (struct csp_proc_s *)p->next;
-        csp_proc_extra_t *ex = (csp_proc_extra_t *)p->extra;
-        void *val = ex ? ex->chan_val : NULL;
+        void *val = p->chan_val;
         pthread_mutex_unlock(&ch->lock);
-        csp_scheduler_submit(p);
+        csp_scheduler_submit_next(p);
         if (ok) *ok = true;
         CSP_CRITICAL_END();
         return val;
@@ -137,13 +152,11 @@ void *csp_gochan_recv(csp_gochan_t *ch, bool *ok) {
     csp_proc_stat_set(self, csp_proc_stat_blocked);
     self->next = (struct csp_proc_s *)ch->recv_q;
     ch->recv_q = (struct csp_proc_s *)self;
-    pthread_mutex_unlock(&ch->lock);
-
-    csp_core_yield(self, &csp_this_core->anchor);
+    csp_worker_stats_add(csp_stats_chan_blocks, 1);
+    csp_sched_park(&ch->lock, ch, csp_trace_reason_chan);
 
-    csp_proc_extra_t *self_ex = (csp_proc_extra_t *)self->extra;
-    void *val = self_ex ? self_ex->chan_val : NULL;
-    if (ok) *ok = self_ex ? self_ex->chan_ok : false;
+    void *val = self->chan_val;
+    if (ok) *ok = self->chan_ok;
     CSP_CRITICAL_END();
     return val;
 }
@@ -160,13 +173,10 @@ bool csp_gochan_try_send(csp_gochan_t *ch, void *val) {
     if (ch->recv_q) {
         csp_proc_t *p = (csp_proc_t *)ch->recv_q;
         ch->recv_q = (struct csp_proc_s *)p->next;
-        csp_proc_extra_t *ex = (csp_proc_extra_t *)p->extra;
-        if (ex) {
-            ex->chan_ok = true;
-            ex->chan_val = val;
-        }
+        p->chan_ok = true;
+        p->chan_val = val;
         pthread_mutex_unlock(&ch->lock);
-        csp_scheduler_submit(p);
+        csp_scheduler_submit_next(p);
         CSP_CRITICAL_END();
         return true;
     }
@@ -195,12 +205,11 @@ bool csp_gochan_try_recv(csp_gochan_t *ch, void **val, bool *ok) {
         if (ch->send_q) {
             csp_proc_t *p = (csp_proc_t *)ch->send_q;
             ch->send_q = (struct csp_proc_s *)p->next;
-            csp_proc_extra_t *ex = (csp_proc_extra_t *)p->extra;
-            void *sval = ex ? ex->chan_val : NULL;
+            void *sval = p->chan_val;
             ch->buffer[ch->head] = sval;
             ch->head = (ch->head + 1) % ch->capacity;
             ch->size++;
-            csp_scheduler_submit(p);
+            csp_scheduler_submit_next(p);
         }
         pthread_mutex_unlock(&ch->lock);
         if (val) *val = v;
@@ -220,10 +229,9 @@ bool csp_gochan_try_recv(csp_gochan_t *ch, void **val, bool *ok) {
     if (ch->send_q && ch->capacity == 0) {
         csp_proc_t *p = (csp_proc_t *)ch->send_q;
         ch->send_q = (struct csp_proc_s *)p->next;
-        csp_proc_extra_t *ex = (csp_proc_extra_t *)p->extra;
-        void *v = ex ? ex->chan_val : NULL;
+        void *v = p->chan_val;
         pthread_mutex_unlock(&ch->lock);
-        csp_scheduler_submit(p);
+        csp_scheduler_submit_next(p);
         if (val) *val = v;
         if (ok) *ok = true;
         CSP_CRITICAL_END();
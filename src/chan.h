@@ -25,6 +25,8 @@ typedef struct csp_gochan_s {
 } csp_gochan_t;
 
 csp_gochan_t *csp_gochan_new(size_t capacity);
+/* Free a channel no proc is using any more, it must not be freed by free(). */
+void csp_gochan_free(csp_gochan_t *ch);
 void csp_gochan_close(csp_gochan_t *ch);
 bool csp_gochan_send(csp_gochan_t *ch, void *val);
 void *csp_gochan_recv(csp_gochan_t *ch, bool *ok);
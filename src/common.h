@@ -25,6 +25,7 @@ extern "C" {
 #define csp_likely(x)     __builtin_expect(!!(x), 1)
 #define csp_unlikely(x)   __builtin_expect(!!(x), 0)
 #define csp_soft_mbarr()  __asm__ __volatile__("" ::: "memory")
+#define csp_cpu_relax()   __asm__ __volatile__("pause" ::: "memory")
 
 #define csp_swap(a, b)                                                         \
   do { typeof(a) tmp = (a); (a) = (b); (b) = tmp; } while (0)
@@ -23,21 +23,31 @@ extern "C" {
 #endif
 
 #include <stdatomic.h>
+#include "common.h"
+#include "futex.h"
 #include "timer.h"
 
 #define csp_cond_signal_none       0
 #define csp_cond_signal_proc_avail 1
 #define csp_cond_signal_deep_sleep 2
 
+/* Set by the waiter going to sleep on the futex, so that the signalers only
+ * make the syscall if someone sleeps there. */
+#define csp_cond_sleeping          (-1)
+
+/* The times the waiter checks the signal with a `pause` in between before
+ * sleeping, which is a few microseconds. */
+#define csp_cond_spins             1024
+
+/* Every wait is paired with exactly one signal from whoever took the waiter
+ * off csp_sched_starving_procs, which may come before the wait starts. */
 typedef struct {
   atomic_int stat;
-  atomic_bool waiting;
   csp_timer_time_t start;
 } csp_cond_t;
 
 #define csp_cond_init(cond) do {                                               \
   atomic_store(&(cond)->stat, csp_cond_signal_none);                           \
-  atomic_store(&(cond)->waiting, false);                                       \
   (cond)->start = 0;                                                           \
 } while (0)                                                                    \
 
@@ -45,18 +55,34 @@ typedef struct {
   (cond)->start = csp_timer_now();                                             \
 } while (0)                                                                    \
 
+/* Spin for a while and sleep on the futex then, returns the signal. */
 #define csp_cond_wait(cond) ({                                                 \
-  int signal;                                                                  \
-  while ((signal = atomic_load(&(cond)->stat)) == csp_cond_signal_none) {      \
-    atomic_store(&(cond)->waiting, true);                                      \
+  int signal = csp_cond_signal_none;                                           \
+  for (int i = 0; i < csp_cond_spins; i++) {                                   \
+    if ((signal = atomic_load_explicit(&(cond)->stat,                          \
+        memory_order_relaxed)) != csp_cond_signal_none) {                      \
+      break;                                                                   \
+    }                                                                          \
+    csp_cpu_relax();                                                           \
+  }                                                                            \
+  if (signal == csp_cond_signal_none) {                                        \
+    int none = csp_cond_signal_none;                                           \
+    if (atomic_compare_exchange_strong(&(cond)->stat, &none,                   \
+        csp_cond_sleeping)) {                                                  \
+      while (atomic_load(&(cond)->stat) == csp_cond_sleeping) {                \
+        csp_futex_wait(&(cond)->stat, csp_cond_sleeping);                      \
+      }                                                                        \
+    }                                                                          \
   }                                                                            \
-  csp_cond_init(cond);                                                         \
+  signal = atomic_exchange(&(cond)->stat, csp_cond_signal_none);               \
+  (cond)->start = 0;                                                           \
   signal;                                                                      \
 })                                                                             \
 
 #define csp_cond_signal(cond, signal) do {                                     \
-  while (!atomic_load(&(cond)->waiting));                                      \
-  atomic_store(&(cond)->stat, (signal));                                       \
+  if (atomic_exchange(&(cond)->stat, (signal)) == csp_cond_sleeping) {         \
+    csp_futex_wake(&(cond)->stat, 1);                                          \
+  }                                                                            \
 } while(0)                                                                     \
 
 #ifdef __cplusplus
@@ -2,8 +2,10 @@
 #include "scheduler.h"
 #include <stdlib.h>
 
+extern void *csp_mem_obj_alloc(size_t size);
+
 csp_context_t *csp_context_background() {
-    csp_context_t *ctx = (csp_context_t *)calloc(1, sizeof(csp_context_t));
+    csp_context_t *ctx = (csp_context_t *)csp_mem_obj_alloc(sizeof(csp_context_t));
     ctx->done = csp_gochan_new(0); // Go background context done channel is always nil/never closed
     return ctx;
 }
@@ -15,7 +17,7 @@ static void context_propagate(void *arg) {
 }
 
 csp_context_t *csp_context_with_cancel(csp_context_t *parent) {
-    csp_context_t *ctx = (csp_context_t *)calloc(1, sizeof(csp_context_t));
+    csp_context_t *ctx = (csp_context_t *)csp_mem_obj_alloc(sizeof(csp_context_t));
     ctx->done = csp_gochan_new(0);
     ctx->parent = parent;
     if (parent && parent->done) {
@@ -18,8 +18,12 @@
 #include "platform.h"
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
 #include "core.h"
 #include "csp_sched.h"
+#include "topology.h"
+#include "trace.h"
+#include "worker.h"
 
 static_assert(offsetof(csp_core_t, running) == 0x40, "csp_core_t.running offset mismatch");
 
@@ -35,11 +39,14 @@ static_assert(offsetof(csp_core_t, running) == 0x40, "csp_core_t.running offset
   "mov 0x38(%"reg"), %"p"r15\n"
 
 extern csp_proc_t *csp_sched_get(csp_core_t *this_core);
+extern bool csp_sched_handoff(csp_core_t *from, csp_core_t *to);
+extern void csp_sched_unblock(csp_core_t *this_core, csp_proc_t *proc);
 extern void csp_sched_put_proc(csp_proc_t *proc);
 extern bool csp_core_pools_get(size_t pid, csp_core_t **core);
 extern void csp_core_pools_put(csp_core_t *core);
 extern void csp_proc_restore(csp_proc_t *proc);
 extern void csp_proc_destroy(csp_proc_t *proc);
+extern void csp_proc_stacks_drain(csp_core_t *core);
 
 _Thread_local csp_core_t *csp_this_core;
 
@@ -53,6 +60,12 @@ csp_core_t *csp_core_new(size_t pid, csp_lrunq_t *lrunq, csp_grunq_t *grunq) {
   core->lrunq = lrunq;
   core->grunq = grunq;
   core->running = NULL;
+  core->worker = NULL;
+  atomic_store(&core->worker_state, csp_core_worker_owned);
+  memset(core->stacks, 0, sizeof(core->stacks));
+  atomic_store(&core->nprocs, 0);
+  csp_mutex_init(&core->live_lock);
+  core->live_procs = NULL;
 
   csp_core_state_set(core, csp_core_state_inited);
   pthread_cond_init(&core->cond, NULL);
@@ -112,10 +125,7 @@ __attribute__((noinline)) void *csp_core_run(void *data) {
 void csp_core_init_main(csp_core_t *core) {
   core->tid = pthread_self();
   csp_this_core = core;
-  cpu_set_t cpuset;
-  CPU_ZERO(&cpuset);
-  CPU_SET(0, &cpuset);
-  pthread_setaffinity_np(core->tid, sizeof(cpuset), &cpuset);
+  csp_topology_pin(core->tid, core->pid);
 }
 
 bool csp_core_start(csp_core_t *core) {
@@ -126,6 +136,7 @@ bool csp_core_start(csp_core_t *core) {
     return false;
   }
   pthread_attr_destroy(&attr);
+  csp_topology_pin(core->tid, core->pid);
   return true;
 }
 
@@ -137,26 +148,103 @@ __attribute__((naked)) void csp_core_yield(csp_proc_t *proc, void *anchor) {
   );
 }
 
+/* Save the context of `from` and restore `to` directly, or go back to the
+ * scheduling loop of the core if `to` is NULL. `lock` is released on the anchor
+ * stack once the thread has left the stack of `from`, so whoever wakes `from`
+ * up with the lock held can't run it before its context is saved. */
+__attribute__((naked))
+void csp_core_switch_to(csp_proc_t *from, csp_proc_t *to, pthread_mutex_t *lock,
+                        void *anchor) {
+  __asm__ __volatile__(
+    csp_proc_save("rdi")
+    "mov %rsi, %rbx\n"
+    "mov %rcx, %r12\n"
+    "mov 0x08(%rcx), %rsp\n"
+    "sub $8, %rsp\n"
+    "test %rdx, %rdx\n"
+    "jz 1f\n"
+    "mov %rdx, %rdi\n"
+    "call pthread_mutex_unlock@plt\n"
+    "1:\n"
+    "mov %rbx, %rdi\n"
+    "test %rdi, %rdi\n"
+    "jnz csp_proc_restore@plt\n"
+    "mov %r12, %rdi\n"
+    "jmp csp_core_anchor_restore@plt\n"
+  );
+}
+
+/* Run the core taken from the pools, its thread is created the first time and
+ * woken up from csp_core_park() afterwards. */
+bool csp_core_resume(csp_core_t *core) {
+  if (csp_core_state_get(core) == csp_core_state_inited) {
+    return csp_core_start(core);
+  }
+  csp_trace(csp_trace_unpark, NULL, -1);
+  pthread_mutex_lock(&core->mutex);
+  csp_core_state_set(core, csp_core_state_running);
+  pthread_cond_signal(&core->cond);
+  pthread_mutex_unlock(&core->mutex);
+  return true;
+}
+
+/* Put the core back to its pool and sleep until it's resumed, the stacks it
+ * cached are returned to the heap. */
+void csp_core_park(csp_core_t *core) {
+  csp_proc_stacks_drain(core);
+  csp_trace(csp_trace_park, NULL, -1);
+  pthread_mutex_lock(&core->mutex);
+  csp_core_state_set(core, csp_core_state_parked);
+  csp_core_pools_put(core);
+  while (csp_core_state_get(core) == csp_core_state_parked) {
+    pthread_cond_wait(&core->cond, &core->mutex);
+  }
+  pthread_mutex_unlock(&core->mutex);
+}
+
+/* Called before the running proc blocks the thread, a spare core of the same
+ * cpu takes over the procs queued on this one while the thread is blocked. */
 bool csp_core_block_prologue(csp_core_t *this_core) {
-  return false;
+  csp_core_t *core;
+  if (this_core->running == NULL ||
+      !csp_core_pools_get(this_core->pid, &core)) {
+    return false;
+  }
+  if (!csp_sched_handoff(this_core, core)) {
+    csp_core_pools_put(core);
+    return false;
+  }
+  if (!csp_core_resume(core)) {
+    perror("Failed to start thread.");
+    exit(EXIT_FAILURE);
+  }
+  csp_trace(csp_trace_block, this_core->running, csp_trace_reason_syscall);
+  csp_proc_wait_set(this_core->running, NULL, csp_trace_reason_syscall);
+  return true;
 }
 
+/* The thread gave its procs away in csp_core_block_prologue(), so it puts the
+ * running proc back to the scheduler and parks the core. */
 __attribute__((used))
 static void csp_core_block_epilogue_inner(csp_core_t *this_core) {
-  while (!csp_grunq_try_push(this_core->grunq, (csp_proc_t *)this_core->running));
+  csp_proc_t *proc = (csp_proc_t *)this_core->running;
   this_core->running = NULL;
-  pthread_mutex_lock(&this_core->mutex);
-  csp_core_pools_put(this_core);
-  pthread_cond_wait(&this_core->cond, &this_core->mutex);
-  pthread_mutex_unlock(&this_core->mutex);
+  atomic_signal_fence(memory_order_seq_cst);
+  csp_sched_unblock(this_core, proc);
+  csp_core_park(this_core);
   csp_core_anchor_restore(&this_core->anchor);
   __builtin_unreachable();
 }
 
+/* The rest of the epilogue runs on the thread stack, where the proc can't be
+ * preempted anymore. */
 __attribute__((naked))
 void csp_core_block_epilogue(csp_core_t *core, csp_proc_t *proc) {
   __asm__ __volatile__(
     csp_proc_save("rsi")
+    "mov 0x08(%rdi), %rsp\n"
+    "mov (%rdi), %rbp\n"
+    "sub $8, %rsp\n"
     "call csp_core_block_epilogue_inner@plt\n"
   );
 }
@@ -178,6 +266,7 @@ void csp_core_proc_exit_inner(csp_proc_t *proc, void *anchor) {
 
 void csp_core_proc_exit(void) {
   csp_proc_t *running = (csp_proc_t *)csp_this_core->running, *parent = (csp_proc_t *)running->parent;
+  csp_trace(csp_trace_exit, running, 0);
   if (parent != NULL && csp_proc_nchild_decr(parent) == 0x01) {
     csp_sched_put_proc(parent);
   }
@@ -215,7 +304,7 @@ void csp_core_destroy(csp_core_t *core) {
   }
 }
 
-extern void csp_scheduler_submit(csp_proc_t *proc);
+extern void csp_scheduler_submit_global(csp_proc_t *proc);
 extern void csp_core_anchor_restore(void *anchor);
 
 __attribute__((naked))
@@ -226,7 +315,7 @@ void csp_preempt_switch_and_submit(uintptr_t rsp, uintptr_t rbp, csp_proc_t *pro
         "sub $16, %rsp\n"
         "push %rcx\n"
         "mov %rdx, %rdi\n"
-        "call csp_scheduler_submit@plt\n"
+        "call csp_scheduler_submit_global@plt\n"
         "pop %rdi\n"
         "call csp_core_anchor_restore@plt\n"
     );
@@ -236,8 +325,10 @@ void csp_preempt_helper(uintptr_t sp) {
     csp_core_t *core = csp_this_core;
     csp_proc_t *proc = (csp_proc_t *)core->running;
 
+    csp_trace(csp_trace_preempt, proc, 0);
+    csp_worker_stats_add(csp_stats_preemptions, 1);
     proc->rsp = sp;
-    proc->is_new = 2; // Preempted
+    proc->is_new = csp_proc_is_preempt;
     __asm__ __volatile__("stmxcsr %0" : "=m"(proc->mxcsr));
     __asm__ __volatile__("fstcw %0" : "=m"(proc->x87cw));
 
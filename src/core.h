@@ -3,6 +3,7 @@
 
 #include "platform.h"
 #include "cond.h"
+#include "mutex.h"
 #include "proc.h"
 #include "runq.h"
 
@@ -24,8 +25,26 @@ extern "C" {
 typedef enum {
   csp_core_state_inited,
   csp_core_state_running,
+  csp_core_state_parked,
 } csp_core_state_t;
 
+/* Values of `worker_state` of a core. */
+typedef enum {
+  csp_core_worker_owned,
+  csp_core_worker_using,
+  csp_core_worker_lost,
+} csp_core_worker_state_t;
+
+/* Max number of stack sizes cached by a core. */
+#define csp_core_stack_classes 8
+
+/* The stacks of `size` bytes cached by a core, linked through the words where
+ * their procs are. */
+typedef struct {
+  size_t size, len;
+  void *head;
+} csp_core_stacks_t;
+
 typedef struct csp_core_s {
   /*
    * anchor saves the full callee-saved context of the scheduler thread.
@@ -61,16 +80,40 @@ typedef struct csp_core_s {
   /* NEW FIELDS FOR M:N SCHEDULER */
   void *worker;
 
+  /* It is csp_core_worker_using while the thread touches the states of its
+   * worker, and set to csp_core_worker_lost once the worker is handed off to
+   * another core, which is only allowed when it isn't in use. */
+  _Atomic csp_core_worker_state_t worker_state;
+
+  /* Stacks of the procs exited on the core, reused by the procs spawned on it
+   * without going through the heap. Only the thread of the core touches them,
+   * see csp_proc_new(). */
+  csp_core_stacks_t stacks[csp_core_stack_classes];
+
+  /* Number of procs spawned minus the ones exited on the core, which may be
+   * negative. Written by the thread of the core only. */
+  atomic_int_fast64_t nprocs;
+
+  /* The live procs spawned on the core linked by `live_next`, they are removed
+   * by the cores they exit on. See runtime_dump_procs(). */
+  csp_mutex_t live_lock;
+  struct csp_proc_s *live_procs;
+
   _Alignas(64) char _padding[64]; // Avoid false sharing
 } csp_core_t;
 
 extern _Thread_local csp_core_t *csp_this_core;
 
+bool csp_core_resume(csp_core_t *core);
+void csp_core_park(csp_core_t *core);
 bool csp_core_block_prologue(csp_core_t *core);
 void csp_core_block_epilogue(csp_core_t *core, struct csp_proc_s *proc)
 __attribute__((naked));
 
 void csp_core_yield(struct csp_proc_s *proc, void *anchor) __attribute__((naked));
+void csp_core_switch_to(struct csp_proc_s *from, struct csp_proc_s *to,
+                        pthread_mutex_t *lock, void *anchor)
+__attribute__((naked));
 
 #ifdef __cplusplus
 }
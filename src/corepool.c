@@ -42,7 +42,9 @@ csp_core_pool_new(int pid, size_t grunq_cap_exp, size_t cores_per_cpu) {
   pool->lrunq = csp_lrunq_new();
   pool->grunq = csp_grunq_new(grunq_cap_exp);
   pool->cores = (csp_core_t **)malloc(sizeof(csp_core_t *) * cores_per_cpu);
-  if (pool->lrunq == NULL || pool->grunq == NULL || pool->cores == NULL) {
+  pool->all = (csp_core_t **)malloc(sizeof(csp_core_t *) * cores_per_cpu);
+  if (pool->lrunq == NULL || pool->grunq == NULL || pool->cores == NULL ||
+    pool->all == NULL) {
     goto failed;
   }
 
@@ -52,6 +54,7 @@ csp_core_pool_new(int pid, size_t grunq_cap_exp, size_t cores_per_cpu) {
       pool->cap = i;
       goto failed;
     }
+    pool->all[i] = pool->cores[i];
   }
 
   pool->cap = pool->top = cores_per_cpu;
@@ -90,6 +93,7 @@ static void csp_core_pool_destroy(csp_core_pool_t *pool) {
   csp_lrunq_destroy(pool->lrunq);
   csp_grunq_destroy(pool->grunq);
   free(pool->cores);
+  free(pool->all);
   free(pool);
 }
 
@@ -126,6 +130,18 @@ void csp_core_pools_put(csp_core_t *core) {
   csp_core_pool_push(csp_core_pools.pools[core->pid % csp_core_pools.len], core);
 }
 
+/* Sum up the procs counted by all the cores. */
+int64_t csp_core_pools_nprocs(void) {
+  int64_t n = 0;
+  for (size_t i = 0; i < csp_core_pools.len; i++) {
+    csp_core_pool_t *pool = csp_core_pools.pools[i];
+    for (size_t j = 0; j < pool->cap; j++) {
+      n += atomic_load_explicit(&pool->all[j]->nprocs, memory_order_relaxed);
+    }
+  }
+  return n;
+}
+
 // PRODUCTION HELPER
 csp_core_t *csp_core_pool_get(size_t pid) {
     csp_core_t *core = NULL;
@@ -31,6 +31,8 @@ extern "C" {
 typedef struct {
   size_t cap, top;
   csp_core_t **cores;
+  /* All the cores of the pool including the ones taken out. */
+  csp_core_t **all;
   csp_lrunq_t *lrunq;
   csp_grunq_t *grunq;
   csp_mutex_t mutex;
@@ -20,6 +20,13 @@ extern "C" {
 #define csp_yield   csp_sched_yield
 #define csp_hangup  csp_sched_hangup
 
+/* Priority */
+#define csp_async_prio      csp_sched_async_prio
+#define csp_sync_prio       csp_sched_sync_prio
+#define csp_prio_high       csp_proc_prio_high
+#define csp_prio_normal     csp_proc_prio_normal
+#define csp_prio_low        csp_proc_prio_low
+
 /* Channel */
 #define chan_t              csp_gochan_t
 #define chan_new            csp_gochan_new
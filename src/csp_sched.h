@@ -37,6 +37,17 @@ extern "C" {
   csp_sched_yield();                                                           \
 } while (0)                                                                    \
 
+/* Run the tasks like csp_sched_async and csp_sched_sync, in the procs of the
+ * priority class `prio`(i.e. csp_proc_prio_high/normal/low). */
+#define csp_sched_async_prio(prio, tasks) csp_sched_run_prio(false, prio, tasks)
+#define csp_sched_sync_prio(prio, tasks)  csp_sched_run_prio(true, prio, tasks)
+
+#define csp_sched_run_prio(is_sync, prio, tasks) do {                          \
+  int csp_sched_prio_ = csp_sched_spawn_prio(prio);                            \
+  csp_sched_run(is_sync, tasks);                                               \
+  csp_sched_spawn_prio(csp_sched_prio_);                                       \
+} while (0)                                                                    \
+
 #define csp_sched_block(tasks) do {                                            \
   csp_core_t *this_core = csp_this_core;                                       \
   if (csp_core_block_prologue(this_core)) {                                    \
@@ -47,7 +58,13 @@ extern "C" {
   }                                                                            \
 } while (0)                                                                    \
 
+/* Set when the running proc of this thread should yield at the next safepoint
+ * inserted by the plugin with `-fplugin-arg-libcsp-safepoints=true`. */
+extern _Thread_local atomic_int csp_sched_preempt_requested;
+
 void csp_sched_yield(void);
+int csp_sched_spawn_prio(int prio);
+void csp_sched_safepoint(void);
 void csp_sched_hangup(uint64_t nanoseconds);
 void csp_sched_proc_anchor(bool need_sync) __attribute__((noinline));
 void csp_shced_atomic_incr(atomic_uint_fast64_t *cnt) __attribute__((noinline));
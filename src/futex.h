@@ -0,0 +1,28 @@
+#ifndef LIBCSP_FUTEX_H
+#define LIBCSP_FUTEX_H
+
+#include "platform.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sleep until woken by csp_futex_wake() if `*addr` still equals `val`, returns
+ * right away otherwise. Callers must recheck their condition on return since
+ * the wakeups can be spurious. */
+static inline void csp_futex_wait(atomic_int *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Wake at most `n` threads sleeping on `addr`. */
+static inline void csp_futex_wake(atomic_int *addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef LIBCSP_HIST_H
+#define LIBCSP_HIST_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A log-linear histogram of non-negative values: every power of 2 is split
+ * into 16 buckets, so a value is known within 1/16 of it. The values below 16
+ * have their own buckets and the ones from 2^40 on share the last one. */
+#define csp_hist_sub_bits   4
+#define csp_hist_sub_len    (1 << csp_hist_sub_bits)
+#define csp_hist_max_exp    40
+#define csp_hist_len                                                           \
+  ((csp_hist_max_exp - csp_hist_sub_bits + 2) * csp_hist_sub_len)
+
+/* It's written by one thread at a time and read by any, the readers see the
+ * counters as of some moment close to the read. */
+typedef struct {
+    atomic_uint_fast64_t counts[csp_hist_len];
+    atomic_int_fast64_t sum, max;
+} csp_hist_t;
+
+static inline int csp_hist_bucket(int64_t value) {
+    if (value < csp_hist_sub_len) {
+        return value < 0 ? 0 : (int)value;
+    }
+    int exp = 63 - __builtin_clzll((uint64_t)value);
+    if (exp > csp_hist_max_exp) {
+        return csp_hist_len - 1;
+    }
+    return (exp - csp_hist_sub_bits + 1) * csp_hist_sub_len +
+        (int)((value >> (exp - csp_hist_sub_bits)) & (csp_hist_sub_len - 1));
+}
+
+/* The largest value falling into the bucket. */
+static inline int64_t csp_hist_bucket_max(int bucket) {
+    if (bucket < csp_hist_sub_len) {
+        return bucket;
+    }
+    int exp = bucket / csp_hist_sub_len + csp_hist_sub_bits - 1;
+    int64_t sub = bucket % csp_hist_sub_len + csp_hist_sub_len;
+    return ((sub + 1) << (exp - csp_hist_sub_bits)) - 1;
+}
+
+/* Only the writer of the histogram may call it, there are no atomic
+ * read-modify-writes on the hot paths. */
+static inline void csp_hist_record(csp_hist_t *hist, int64_t value) {
+    atomic_uint_fast64_t *count = &hist->counts[csp_hist_bucket(value)];
+    atomic_store_explicit(count,
+        atomic_load_explicit(count, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    atomic_store_explicit(&hist->sum,
+        atomic_load_explicit(&hist->sum, memory_order_relaxed) + value,
+        memory_order_relaxed);
+    if (value > atomic_load_explicit(&hist->max, memory_order_relaxed)) {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+}
+
+/* Add the counters of `from` to `to`, which is private to the caller. */
+static inline void csp_hist_merge(csp_hist_t *to, csp_hist_t *from) {
+    for (int i = 0; i < csp_hist_len; i++) {
+        atomic_store_explicit(&to->counts[i],
+            atomic_load_explicit(&to->counts[i], memory_order_relaxed) +
+            atomic_load_explicit(&from->counts[i], memory_order_relaxed),
+            memory_order_relaxed);
+    }
+    atomic_store_explicit(&to->sum,
+        atomic_load_explicit(&to->sum, memory_order_relaxed) +
+        atomic_load_explicit(&from->sum, memory_order_relaxed),
+        memory_order_relaxed);
+    int64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    if (max > atomic_load_explicit(&to->max, memory_order_relaxed)) {
+        atomic_store_explicit(&to->max, max, memory_order_relaxed);
+    }
+}
+
+/* Clear the counters, the values recorded meanwhile may be kept. */
+static inline void csp_hist_reset(csp_hist_t *hist) {
+    for (int i = 0; i < csp_hist_len; i++) {
+        atomic_store_explicit(&hist->counts[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&hist->sum, 0, memory_order_relaxed);
+    atomic_store_explicit(&hist->max, 0, memory_order_relaxed);
+}
+
+static inline uint64_t csp_hist_count(csp_hist_t *hist) {
+    uint64_t count = 0;
+    for (int i = 0; i < csp_hist_len; i++) {
+        count += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+    }
+    return count;
+}
+
+/* The value which `quantile`(from 0 to 1) of the recorded ones are not above,
+ * reported as the largest one of its bucket but never above the maximum. */
+static inline int64_t csp_hist_quantile(csp_hist_t *hist, double quantile) {
+    uint64_t count = csp_hist_count(hist);
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * count + 0.5), seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    int64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    for (int i = 0; i < csp_hist_len; i++) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            int64_t value = csp_hist_bucket_max(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -15,15 +15,22 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <assert.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include "common.h"
 #include "core.h"
+#include "mutex.h"
+#include "proc_extra.h"
 #include "rbq.h"
 #include "rbtree.h"
+#include "topology.h"
 
 /*
  * mem.c implements a virtual memory manager.
@@ -64,6 +71,15 @@
   }                                                                            \
 } while (0)
 
+/* The pages counters of the heap are only changed with it locked, but they are
+ * read by the scavenger and the metrics without the lock. */
+#define csp_mem_heap_count_add(heap, counter, n)                               \
+  atomic_fetch_add_explicit(&(heap)->counter, (n), memory_order_relaxed)
+#define csp_mem_heap_count_sub(heap, counter, n)                               \
+  atomic_fetch_sub_explicit(&(heap)->counter, (n), memory_order_relaxed)
+#define csp_mem_heap_count_get(heap, counter)                                  \
+  atomic_load_explicit(&(heap)->counter, memory_order_relaxed)
+
 #define csp_mem_arena_size_exp    24
 #define csp_mem_arena_size        (1 << csp_mem_arena_size_exp)
 #define csp_mem_arena_npages      (csp_mem_arena_size / csp_mem_page_size)
@@ -74,10 +90,9 @@
     if ((heap)->curr >= (heap)->end) {                                         \
       exit(EXIT_FAILURE);                                                      \
     }                                                                          \
-    arena_ = mmap((void *)(heap)->curr, csp_mem_arena_size,                    \
-      PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0         \
-    );                                                                         \
+    arena_ = csp_mem_arena_map((heap)->curr);                                  \
   } while (arena_ == MAP_FAILED);                                              \
+  csp_topology_bind(arena_, csp_mem_arena_size, (heap)->node);                 \
                                                                                \
   int32_t l1_ = csp_mem_meta_l1_by_addr(heap, arena_);                         \
   if ((heap)->metas[l1_] == NULL && !csp_mem_heap_init_l1(heap, l1_)) {        \
@@ -95,6 +110,7 @@
   link_->addr = arena_;                                                        \
   link_->next = (heap)->arenas;                                                \
   (heap)->arenas = link_;                                                      \
+  csp_mem_heap_count_add(heap, mapped, csp_mem_arena_npages);                  \
                                                                                \
   arena_;                                                                      \
 })                                                                             \
@@ -178,13 +194,57 @@
 } while (0)
 #define csp_mem_span_is_free(heap, span)                                       \
   (((span) != NULL) && !csp_mem_meta_taken_bit_by_index((heap), (span)->index))
+#define csp_mem_span_released_get(span)                                        \
+  (csp_mem_span_npages_get(span) - (span)->kept)
 #define csp_mem_span_remove(heap, span, total) ({                              \
-  int npages_ = csp_mem_span_npages_get(span);                                 \
-  csp_rbtree_node_t *node_ = csp_mem_tree_node_get(heap, npages_);             \
-  (total) += npages_;                                                          \
-  csp_mem_tree_node_del_span(heap, node_, span);                               \
+  (total) += csp_mem_span_npages_get(span);                                    \
+  csp_mem_heap_del_span(heap, span);                                           \
 })                                                                             \
 
+/*
+ * The free spans of less than `csp_mem_span_nclasses` pages are kept in a list
+ * per pages number. A bit per list tells whether it has any spans and a bit
+ * per word of them tells whether the word has any bits set, so the smallest
+ * span fitting a request is found with two bit scans however fragmented the
+ * heap is. The larger spans, which are mostly the rest of fresh arenas, are
+ * kept in the red-black tree.
+ */
+#define csp_mem_span_nclasses_exp 10
+#define csp_mem_span_nclasses     (1 << csp_mem_span_nclasses_exp)
+#define csp_mem_span_nwords       (csp_mem_span_nclasses / 64)
+
+/*
+ * The scavenger returns the pages of the spans free for `csp_mem.scavenge_age`
+ * milliseconds(a minute by default) to the OS. It unlocks the heap every
+ * `csp_mem_scavenge_batch` pages released so that the cores allocating from it
+ * aren't held up for long, the larger spans are released a batch at a time(a
+ * huge page at a time in huge page mode).
+ */
+#define csp_mem_scavenge_default_age (60 * 1000)
+#define csp_mem_scavenge_batch       256
+
+/*
+ * The arenas can be backed by the huge pages of 2MB to save the TLB misses of
+ * switching among many procs, which is chosen by `LIBCSP_HUGEPAGES`(`thp` for
+ * the transparent ones and `hugetlb` for the ones reserved by the admin). The
+ * arenas are always aligned to their size, so they are made of whole huge
+ * pages. The stacks of a refill of the stack cache are carved from one span so
+ * that the procs spawned together share the huge pages, and the scavenger only
+ * releases the whole huge pages of the free spans, the edges are kept resident.
+ */
+#define csp_mem_huge_page_size_exp   21
+#define csp_mem_huge_page_size       (1 << csp_mem_huge_page_size_exp)
+#define csp_mem_huge_page_mask       ((uintptr_t)csp_mem_huge_page_size - 1)
+
+static_assert(csp_mem_arena_size % csp_mem_huge_page_size == 0,
+  "the arenas must be made of whole huge pages");
+
+typedef enum {
+  csp_mem_huge_none,
+  csp_mem_huge_thp,
+  csp_mem_huge_tlb,
+} csp_mem_huge_t;
+
 #define csp_mem_meta_index_set(index, value) do {                              \
   (index)[0] = (value)[0];                                                     \
   (index)[1] = (value)[1];                                                     \
@@ -256,9 +316,35 @@
   next_;                                                                       \
 })                                                                             \
 
+/*
+ * The small objects(e.g. the channels, the timer arguments) are carved from
+ * slabs of one page, every slab serves a size class and starts with its
+ * header. They are never page aligned unlike the spans, which tells the two
+ * apart when they are returned through the mailboxes.
+ */
+#define csp_mem_slab_nclasses     12
+#define csp_mem_slab_max          512
+#define csp_mem_slab_hdr_size     32
+#define csp_mem_slab_cap(klass)                                                \
+  ((csp_mem_page_size - csp_mem_slab_hdr_size) / csp_mem_slab_sizes[klass])
+#define csp_mem_slab_by_obj(obj)                                               \
+  ((csp_mem_slab_t *)((uintptr_t)(obj) & ~(uintptr_t)(csp_mem_page_size - 1)))
+#define csp_mem_slab_is_obj(obj)                                               \
+  (((uintptr_t)(obj) & (csp_mem_page_size - 1)) != 0)
+#define csp_mem_slab_class(size) ((size) <= 128 ?                              \
+  ((size) + 15) / 16 - ((size) > 0) : (size) <= 192 ? 8 : (size) <= 256 ? 9 :  \
+  (size) <= 384 ? 10 : 11)
+
 extern int csp_sched_np;
 extern _Thread_local csp_core_t *csp_this_core;
 
+static const uint16_t csp_mem_slab_sizes[csp_mem_slab_nclasses] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 192, 256, 384, 512
+};
+
+static_assert(csp_mem_span_nwords <= 64,
+  "the words of the span bits don't fit in one word");
+
 csp_msrbq_declare(uintptr_t, obj);
 csp_msrbq_define(uintptr_t, obj);
 
@@ -267,6 +353,13 @@ typedef uint8_t csp_mem_meta_index_t[3];
 typedef struct {
   uint8_t npages[3];
   csp_mem_meta_index_t index, mt_pre, mt_next, fp_pre, fp_next;
+
+  /* Whether the pages of the free span were returned to the OS or never
+   * touched, how many of them are kept resident though(the edges off the whole
+   * huge pages), and the millisecond of `csp_mem.clock` it was freed at. */
+  uint8_t released;
+  uint16_t kept;
+  uint32_t freed_at;
 } csp_mem_span_t;
 
 typedef struct {
@@ -274,6 +367,23 @@ typedef struct {
   uint8_t taken_bits[csp_mem_meta_l2_num / sizeof(uint8_t)];
 } csp_mem_meta_t;
 
+typedef struct csp_mem_slab_s {
+  /* The slabs of the same class with free objects. */
+  struct csp_mem_slab_s *pre, *next;
+
+  /* The objects freed, linked by their first words. */
+  void *free;
+
+  /* The objects never allocated start from this offset, so that a new slab
+   * isn't touched all at once. */
+  uint16_t unused;
+
+  uint16_t nfree, klass;
+} csp_mem_slab_t;
+
+static_assert(sizeof(csp_mem_slab_t) <= csp_mem_slab_hdr_size,
+  "csp_mem_slab_t doesn't fit in its header");
+
 typedef struct csp_mem_arena_link_t {
   void *addr;
   struct csp_mem_arena_link_t *next;
@@ -286,6 +396,14 @@ typedef struct {
   /* The pointer approaching to the end. */
   uintptr_t curr;
 
+  /* The NUMA node of the core owning this heap. */
+  int node;
+
+  /* The cores of the same cpu may run at the same time(e.g. the main thread,
+   * or a thread blocked after handing its procs off), so the heap is locked
+   * by them. Other cores return objects through the mailboxes. */
+  csp_mutex_t mutex;
+
   /* Store the mmapped arenas. */
   csp_mem_arena_link_t *arenas;
 
@@ -295,26 +413,221 @@ typedef struct {
   /* Store the objects returned from other cores. */
   csp_msrbq_t(obj) *mailboxes[csp_mem_meta_l1_num];
 
-  /* Store free pages. The key is the pages number and the value is the free
-   * span list */
+  /* The slabs with free objects of every size class. */
+  csp_mem_slab_t *slabs[csp_mem_slab_nclasses];
+
+  /* The free span lists indexed by whether the spans are released and the
+   * pages number. The resident spans are taken first, and the oldest of them
+   * are at the tails, where the scavenger starts. */
+  csp_mem_span_t *spans[2][csp_mem_span_nclasses];
+  csp_mem_span_t *tails[csp_mem_span_nclasses];
+
+  /* Whether the span lists are nonempty, and whether the words of these bits
+   * are nonzero. */
+  uint64_t span_bits[2][csp_mem_span_nwords], span_words[2];
+
+  /* The pages mapped from the OS, the free ones of them released, and the
+   * ones released by the scavenger so far. */
+  atomic_size_t mapped, released, scavenged;
+
+  /* Store the free spans of `csp_mem_span_nclasses` pages or more. The key is
+   * the pages number and the value is the free span list */
   csp_rbtree_t *tree;
 
-  /* Cache the tree nodes to speed the searching. */
-  csp_rbtree_node_t *cache_nodes[csp_mem_tree_node_num];
+  /* Cache the tree nodes to speed the searching. The key of a whole free
+   * arena is `csp_mem_tree_node_num` itself. */
+  csp_rbtree_node_t *cache_nodes[csp_mem_tree_node_num + 1];
 
   /* Store all nodes in the red-black tree temporarily. */
   csp_rbtree_node_t *all_nodes[csp_mem_tree_node_num];
 
-  /* Store all keys in the red-black tree temporarily. */
-  int all_keys[csp_mem_tree_node_num];
+  /* The keys of the tree collected by the scavenger for a batch, the nodes
+   * themselves may be moved by releasing the spans. */
+  int scavenge_keys[csp_mem_tree_node_num];
 } csp_mem_heap_t;
 
-static bool csp_mem_heap_init(csp_mem_heap_t *heap, uintptr_t start) {
+/* Where the scavenger is in a heap during a batch. It walks the tree nodes by
+ * the keys left in `heap->scavenge_keys` from the largest, then the resident
+ * lists from the largest class with `npages` set. `span` is the next span to
+ * check in the current node or list. */
+typedef struct {
+  int nkeys, npages;
+  csp_mem_span_t *span;
+} csp_mem_scavenge_cursor_t;
+
+static struct {
+  size_t len;
+  csp_mem_heap_t *heaps;
+
+  /* The milliseconds of the monitor clock, which is advanced by the scavenger
+   * only. */
+  atomic_uint_fast32_t clock;
+
+  /* The milliseconds a span stays free before it's released, and the resident
+   * pages the scavenger releases the free spans down to regardless of how long
+   * they have been free, 0 means no target. */
+  atomic_uint_fast32_t scavenge_age;
+  atomic_size_t target_rss;
+
+  /* How the arenas are backed by the huge pages. */
+  csp_mem_huge_t huge;
+} csp_mem = {.scavenge_age = csp_mem_scavenge_default_age};
+
+/* Map an arena at `addr`. The transparent huge pages are used instead if the
+ * reserved ones run out. */
+static void *csp_mem_arena_map(uintptr_t addr) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+  void *arena;
+
+  if (csp_mem.huge == csp_mem_huge_tlb) {
+    arena = mmap((void *)addr, csp_mem_arena_size, PROT_READ | PROT_WRITE,
+      flags | MAP_HUGETLB | (csp_mem_huge_page_size_exp << MAP_HUGE_SHIFT),
+      -1, 0);
+    if (arena != MAP_FAILED) {
+      return arena;
+    }
+  }
+
+  arena = mmap((void *)addr, csp_mem_arena_size, PROT_READ | PROT_WRITE, flags,
+    -1, 0);
+  if (arena != MAP_FAILED && csp_mem.huge != csp_mem_huge_none) {
+    madvise(arena, csp_mem_arena_size, MADV_HUGEPAGE);
+  }
+  return arena;
+}
+
+/* The pages of a span off the whole huge pages in it, which are kept resident
+ * when it's released in huge page mode. */
+static int csp_mem_span_huge_edges(csp_mem_heap_t *heap, csp_mem_span_t *span) {
+  int npages = csp_mem_span_npages_get(span);
+  if (csp_mem.huge == csp_mem_huge_none) {
+    return 0;
+  }
+
+  uintptr_t start = csp_mem_meta_l1l2_to_addr(heap,
+              csp_mem_meta_l1_by_index(span->index),
+              csp_mem_meta_l2_by_index(span->index)),
+            end = start + ((uintptr_t)npages << csp_mem_page_size_exp);
+  start = (start + csp_mem_huge_page_mask) & ~csp_mem_huge_page_mask;
+  end &= ~csp_mem_huge_page_mask;
+  return start < end ?
+    npages - (int)((end - start) >> csp_mem_page_size_exp) : npages;
+}
+
+/* Put a free span to the head of its list. */
+static void csp_mem_heap_put_span(csp_mem_heap_t *heap, csp_mem_span_t *span) {
+  int npages = csp_mem_span_npages_get(span);
+  if (npages >= csp_mem_span_nclasses) {
+    csp_rbtree_node_t *node = csp_rbtree_insert(heap->tree, npages);
+    csp_mem_tree_node_put_span(heap, node, span);
+    return;
+  }
+
+  int released = span->released;
+  csp_mem_span_t *next = heap->spans[released][npages];
+  csp_mem_meta_index_set_zero(span->fp_pre);
+  if (next != NULL) {
+    csp_mem_meta_index_set(span->fp_next, next->index);
+    csp_mem_meta_index_set(next->fp_pre, span->index);
+  } else {
+    csp_mem_meta_index_set_zero(span->fp_next);
+    heap->span_bits[released][npages >> 6] |= (uint64_t)1 << (npages & 63);
+    heap->span_words[released] |= (uint64_t)1 << (npages >> 6);
+    if (!released) {
+      heap->tails[npages] = span;
+    }
+  }
+  heap->spans[released][npages] = span;
+}
+
+/* Take a free span off its list, it returns the next one in the list. */
+static csp_mem_span_t *csp_mem_heap_del_span(csp_mem_heap_t *heap,
+  csp_mem_span_t *span) {
+  int npages = csp_mem_span_npages_get(span);
+  if (npages >= csp_mem_span_nclasses) {
+    csp_rbtree_node_t *node = csp_mem_tree_node_get(heap, npages);
+    return csp_mem_tree_node_del_span(heap, node, span);
+  }
+
+  int released = span->released;
+  csp_mem_span_t
+    *pre = csp_mem_meta_span_by_index(heap, span->fp_pre),
+    *next = csp_mem_meta_span_by_index(heap, span->fp_next);
+  if (pre != NULL) {
+    csp_mem_meta_index_set(pre->fp_next, span->fp_next);
+  } else {
+    heap->spans[released][npages] = next;
+  }
+  if (next != NULL) {
+    csp_mem_meta_index_set(next->fp_pre, span->fp_pre);
+  } else if (!released) {
+    heap->tails[npages] = pre;
+  }
+  csp_mem_meta_index_set_zero(span->fp_pre);
+  csp_mem_meta_index_set_zero(span->fp_next);
+
+  if (heap->spans[released][npages] == NULL) {
+    uint64_t *bits = &heap->span_bits[released][npages >> 6];
+    *bits &= ~((uint64_t)1 << (npages & 63));
+    if (*bits == 0) {
+      heap->span_words[released] &= ~((uint64_t)1 << (npages >> 6));
+    }
+  }
+  return next;
+}
+
+/* Find the smallest free span of `npages` pages at least in the lists of the
+ * resident or the released spans. */
+static csp_mem_span_t *csp_mem_heap_find_list(csp_mem_heap_t *heap,
+  int released, int npages) {
+  int word = npages >> 6;
+  uint64_t bits = heap->span_bits[released][word] &
+    (~(uint64_t)0 << (npages & 63));
+  if (bits == 0) {
+    uint64_t words = heap->span_words[released] & (~(uint64_t)1 << word);
+    if (words == 0) {
+      return NULL;
+    }
+    word = __builtin_ctzll(words);
+    bits = heap->span_bits[released][word];
+  }
+  return heap->spans[released][(word << 6) | __builtin_ctzll(bits)];
+}
+
+/* Find the smallest free span of `npages` pages at least, the resident ones
+ * are preferred to save the page faults. */
+static csp_mem_span_t *csp_mem_heap_find_span(csp_mem_heap_t *heap,
+  int npages) {
+  if (npages < csp_mem_span_nclasses) {
+    csp_mem_span_t *span = csp_mem_heap_find_list(heap, 0, npages);
+    if (span == NULL) {
+      span = csp_mem_heap_find_list(heap, 1, npages);
+    }
+    if (span != NULL) {
+      return span;
+    }
+  }
+
+  csp_rbtree_node_t *node = csp_mem_tree_node_get_gte(heap, npages);
+  return node != NULL ? (csp_mem_span_t *)node->value : NULL;
+}
+
+static bool csp_mem_heap_init(csp_mem_heap_t *heap, uintptr_t start,
+  int numa_node) {
   memset(heap->metas, 0, sizeof(heap->metas));
   memset(heap->mailboxes, 0, sizeof(heap->mailboxes));
   memset(heap->cache_nodes, 0, sizeof(heap->cache_nodes));
+  memset(heap->slabs, 0, sizeof(heap->slabs));
+  memset(heap->spans, 0, sizeof(heap->spans));
+  memset(heap->tails, 0, sizeof(heap->tails));
+  memset(heap->span_bits, 0, sizeof(heap->span_bits));
+  memset(heap->span_words, 0, sizeof(heap->span_words));
+  atomic_init(&heap->mapped, 0);
+  atomic_init(&heap->released, 0);
+  atomic_init(&heap->scavenged, 0);
 
   heap->arenas = NULL;
+  csp_mutex_init(&heap->mutex);
 
   heap->tree = csp_rbtree_new();
   if (heap->tree == NULL) {
@@ -323,6 +636,7 @@ static bool csp_mem_heap_init(csp_mem_heap_t *heap, uintptr_t start) {
 
   heap->start = start;
   heap->end = start + csp_mem_heap_size;
+  heap->node = numa_node;
 
   /* We will add `csp_mem_arena_size` to the `heap->curr` first and then mmap
    * memory from the OS in `csp_mem_arena_new`, so we need to subtract
@@ -339,88 +653,205 @@ static bool csp_mem_heap_init(csp_mem_heap_t *heap, uintptr_t start) {
     n--;
   }
 
-  csp_rbtree_node_t *node = csp_rbtree_insert(heap->tree, n);
+  /* The pages never touched are counted as released. */
   csp_mem_span_t *span = csp_mem_meta_span_by_addr(heap, mem);
   csp_mem_span_npages_set(span, n);
-  csp_mem_tree_node_put_span(heap, node, span);
+  span->released = 1;
+  span->kept = 0;
+  csp_mem_heap_count_add(heap, released, n);
+  csp_mem_heap_put_span(heap, span);
 
   return true;
 }
 
-/* Merge all adjacent spans. */
-static void csp_mem_heap_merge(csp_mem_heap_t *heap) {
-  csp_rbtree_node_t *node;
+/* Free a memory object from the heap. The span is merged with its free
+ * neighbours in the metadata list at once, thus no two free spans are ever
+ * adjacent except the pieces of a span being released by the scavenger. */
+static void csp_mem_heap_free(csp_mem_heap_t *heap, void *obj) {
+  int32_t l1 = csp_mem_meta_l1_by_addr(heap, obj);
+  int32_t l2 = csp_mem_meta_l2_by_addr(heap, obj);
+  csp_mem_meta_taken_bit_clear(heap, l1, l2);
 
-  int n = csp_rbtree_all_nodes(heap->tree, heap->all_nodes);
-  for (int i = 0; i < n; i++) {
-    node = heap->all_nodes[i];
-    heap->all_keys[i] = node->key;
-    csp_mem_tree_node_cache_set(heap, node->key, node);
+  csp_mem_span_t *span = csp_mem_meta_span_by_l1l2(heap, l1, l2);
+  int total = csp_mem_span_npages_get(span);
+  csp_mem_span_t
+    *pre = csp_mem_meta_span_by_index(heap, span->mt_pre),
+    *next = csp_mem_meta_span_by_index(heap, span->mt_next);
+
+  /* The released neighbours are counted as resident once merged, which only
+   * overestimates the resident pages until the span is released again. */
+  if (csp_mem_span_is_free(heap, pre)) {
+    if (pre->released) {
+      csp_mem_heap_count_sub(heap, released, csp_mem_span_released_get(pre));
+    }
+    csp_mem_span_remove(heap, pre, total);
+    span = pre;
   }
-
-  /* We merge the spans in the reversed order of node key(i.e. pages number)
-   * thus we won't try to merge the new merged span again. */
-  for (int i = n - 1; i >= 0; i--) {
-    node = csp_mem_tree_node_cache_get(heap, heap->all_keys[i]);
-
-    /* `NULL` means the node has beed deleted. */
-    if (node == NULL) {
-      continue;
+  if (csp_mem_span_is_free(heap, next)) {
+    if (next->released) {
+      csp_mem_heap_count_sub(heap, released, csp_mem_span_released_get(next));
     }
+    csp_mem_span_remove(heap, next, total);
+    next = csp_mem_meta_span_by_index(heap, next->mt_next);
+  }
 
-    csp_mem_span_t *span = (csp_mem_span_t *)node->value;
-    while (span != NULL) {
-      int total = 0;
-
-      csp_mem_span_t
-        *pre = csp_mem_meta_span_by_index(heap, span->mt_pre),
-        *next = csp_mem_meta_span_by_index(heap, span->mt_next),
-        *start = span, *end = span;
+  csp_mem_span_npages_set(span, total);
+  span->released = 0;
+  span->freed_at = atomic_load_explicit(&csp_mem.clock, memory_order_relaxed);
+  if (next != NULL) {
+    csp_mem_meta_index_set(span->mt_next, next->index);
+    csp_mem_meta_index_set(next->mt_pre, span->index);
+  } else {
+    csp_mem_meta_index_set_zero(span->mt_next);
+  }
+  csp_mem_heap_put_span(heap, span);
+}
 
-      while (csp_mem_span_is_free(heap, pre)) {
-        csp_mem_span_remove(heap, pre, total);
-        start = pre;
-        pre = csp_mem_meta_span_by_index(heap, pre->mt_pre);
-      }
+static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size);
 
-      while (csp_mem_span_is_free(heap, next)) {
-        csp_mem_span_remove(heap, next, total);
-        end = next;
-        next = csp_mem_meta_span_by_index(heap, next->mt_next);
-      }
+/* Put a slab with free objects to the head of its class list. */
+static void csp_mem_slab_link(csp_mem_heap_t *heap, csp_mem_slab_t *slab) {
+  csp_mem_slab_t *head = heap->slabs[slab->klass];
+  slab->pre = NULL;
+  slab->next = head;
+  if (head != NULL) {
+    head->pre = slab;
+  }
+  heap->slabs[slab->klass] = slab;
+}
 
-      if (start == end) {
-        span = csp_mem_meta_span_by_index(heap, span->fp_next);
-        continue;
-      }
+static void csp_mem_slab_unlink(csp_mem_heap_t *heap, csp_mem_slab_t *slab) {
+  if (slab->pre != NULL) {
+    slab->pre->next = slab->next;
+  } else {
+    heap->slabs[slab->klass] = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->pre = slab->pre;
+  }
+  slab->pre = slab->next = NULL;
+}
 
-      span = csp_mem_span_remove(heap, span, total);
+/* Return an object to its slab. The slab is given back to the heap once all
+ * its objects are free unless it's the last one of its class with any. */
+static void csp_mem_slab_free(csp_mem_heap_t *heap, void *obj) {
+  csp_mem_slab_t *slab = csp_mem_slab_by_obj(obj);
+  *(void **)obj = slab->free;
+  slab->free = obj;
+
+  if (slab->nfree++ == 0) {
+    csp_mem_slab_link(heap, slab);
+  } else if (slab->nfree == csp_mem_slab_cap(slab->klass) &&
+    (slab->pre != NULL || slab->next != NULL)) {
+    csp_mem_slab_unlink(heap, slab);
+    csp_mem_heap_free(heap, slab);
+  }
+}
 
-      node = csp_rbtree_insert(heap->tree, total);
-      csp_mem_span_npages_set(start, total);
-      csp_mem_tree_node_put_span(heap, node, start);
+/* Free a page span or a slab object. */
+static void csp_mem_heap_free_obj(csp_mem_heap_t *heap, void *obj) {
+  if (csp_mem_slab_is_obj(obj)) {
+    csp_mem_slab_free(heap, obj);
+  } else {
+    csp_mem_heap_free(heap, obj);
+  }
+}
 
-      if (next) {
-        csp_mem_meta_index_set(start->mt_next, next->index);
-        csp_mem_meta_index_set(next->mt_pre, start->index);
-      } else {
-        csp_mem_meta_index_set_zero(start->mt_next);
+/* Free the objects returned by other cores, it returns whether there was any.
+ */
+static bool csp_mem_heap_drain(csp_mem_heap_t *heap) {
+  bool is_freed = false;
+  for (int i = 0; i < csp_mem_meta_l1_num; i++) {
+    csp_msrbq_t(obj) *mailbox = heap->mailboxes[i];
+    if (mailbox == NULL) {
+      break;
+    }
+    size_t n;
+    uintptr_t objs[16];
+    while ((n = csp_msrbq_try_popm(obj)(mailbox, objs, 16)) > 0) {
+      is_freed = true;
+      for (size_t j = 0; j < n; j++) {
+        csp_mem_heap_free_obj(heap, (void *)objs[j]);
+      }
+      if (n < 16) {
+        break;
       }
     }
   }
+  return is_freed;
 }
 
-/* Free a memory object from the heap. */
-static void csp_mem_heap_free(csp_mem_heap_t *heap, void *obj) {
-  int32_t l1 = csp_mem_meta_l1_by_addr(heap, obj);
-  int32_t l2 = csp_mem_meta_l2_by_addr(heap, obj);
-  csp_mem_meta_taken_bit_clear(heap, l1, l2);
+/* Allocate an object of size class `klass`. */
+static void *csp_mem_slab_alloc(csp_mem_heap_t *heap, int klass) {
+  csp_mem_slab_t *slab = heap->slabs[klass];
+  if (slab == NULL && csp_mem_heap_drain(heap)) {
+    slab = heap->slabs[klass];
+  }
+  if (slab == NULL) {
+    slab = (csp_mem_slab_t *)csp_mem_heap_alloc(heap, csp_mem_page_size);
+    slab->free = NULL;
+    slab->unused = csp_mem_slab_hdr_size;
+    slab->nfree = csp_mem_slab_cap(klass);
+    slab->klass = klass;
+    csp_mem_slab_link(heap, slab);
+  }
+
+  void *obj = slab->free;
+  if (obj != NULL) {
+    slab->free = *(void **)obj;
+  } else {
+    obj = (void *)((uintptr_t)slab + slab->unused);
+    slab->unused += csp_mem_slab_sizes[klass];
+  }
+  if (--slab->nfree == 0) {
+    csp_mem_slab_unlink(heap, slab);
+  }
+  return obj;
+}
+
+/* Cut the first `npages` pages off the span and return the rest, which is free
+ * and not in any free list yet. */
+static csp_mem_span_t *csp_mem_heap_split(csp_mem_heap_t *heap,
+  csp_mem_span_t *span, int npages) {
+  int key = csp_mem_span_npages_get(span);
+  int32_t l1 = csp_mem_meta_l1_by_index(span->index);
+  int32_t l2 = csp_mem_meta_l2_by_index(span->index);
+  csp_mem_span_npages_set(span, npages);
+
+  /* Compute the index of the new span. */
+  int32_t new_l1 = l1, new_l2 = l2 + npages, overflow;
+  if (new_l2 >= csp_mem_meta_l2_num) {
+    overflow = new_l2 - csp_mem_meta_l2_num + 1;
+
+    new_l2 = overflow & csp_mem_meta_l2_num_mask;
+    new_l1 += overflow / csp_mem_meta_l2_num + (!!new_l2);
 
-  csp_mem_span_t *curr = csp_mem_meta_span_by_l1l2(heap, l1, l2);
-  csp_rbtree_node_t *node = csp_rbtree_insert(
-    heap->tree, csp_mem_span_npages_get(curr)
+    if (heap->metas[new_l1] == NULL &&
+        !csp_mem_heap_init_l1(heap, new_l1)) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Get the new span. */
+  csp_mem_span_t *new_span = csp_mem_meta_span_by_l1l2(
+    heap, new_l1, new_l2
   );
-  csp_mem_tree_node_put_span(heap, node, curr);
+  csp_mem_span_npages_set(new_span, key - npages);
+  csp_mem_meta_taken_bit_clear(heap, new_l1, new_l2);
+  new_span->released = span->released;
+  new_span->kept = span->released && span->kept != 0 ?
+    csp_mem_span_huge_edges(heap, new_span) : 0;
+  new_span->freed_at = span->freed_at;
+
+  /* Insert the new span to the metadata list. */
+  csp_mem_span_t *next = csp_mem_meta_span_by_index(heap, span->mt_next);
+  csp_mem_meta_index_set(new_span->mt_pre, span->index);
+  csp_mem_meta_index_set(new_span->mt_next, span->mt_next);
+  csp_mem_meta_index_set(span->mt_next, new_span->index);
+  if (next != NULL) {
+    csp_mem_meta_index_set(next->mt_pre, new_span->index);
+  }
+  return new_span;
 }
 
 /* Allocate n pages from the heap. `size` is guaranteed to 4KB alignment.*/
@@ -433,45 +864,23 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
   void *result;
   int npages = size >> csp_mem_page_size_exp;
 
-  csp_rbtree_node_t *node = csp_mem_tree_node_get_gte(heap, npages);
-  if (node == NULL) {
+  csp_mem_span_t *span = csp_mem_heap_find_span(heap, npages);
+  if (span == NULL) {
     /* Try to collect free pages returned by other prcessors. */
-    bool is_freed = false;
-    for (int i = 0; i < csp_mem_meta_l1_num; i++) {
-      csp_msrbq_t(obj) *mailbox = heap->mailboxes[i];
-      if (mailbox == NULL) {
-        break;
-      }
-      size_t n;
-      uintptr_t objs[16];
-      while ((n = csp_msrbq_try_popm(obj)(mailbox, objs, 16)) > 0) {
-        is_freed = true;
-        for (size_t j = 0; j < n; j++) {
-          csp_mem_heap_free(heap, (void *)objs[j]);
-        }
-        if (n < 16) {
-          break;
-        }
-      }
-    }
-    if (is_freed) {
-      node = csp_mem_tree_node_get_gte(heap, npages);
-    }
-
-    /* Try to merge adjacent free spans. */
-    if (node == NULL && npages > 1) {
-      csp_mem_heap_merge(heap);
-      node = csp_mem_tree_node_get_gte(heap, npages);
+    if (csp_mem_heap_drain(heap)) {
+      span = csp_mem_heap_find_span(heap, npages);
     }
   }
 
   /* Free pages found. */
-  if (node != NULL) {
-    int key = node->key;
-    csp_mem_span_t *span = (csp_mem_span_t *)node->value;
+  if (span != NULL) {
+    int key = csp_mem_span_npages_get(span);
 
     /* Delete it from the free list. */
-    csp_mem_tree_node_del_span(heap, node, span);
+    csp_mem_heap_del_span(heap, span);
+    if (span->released) {
+      csp_mem_heap_count_sub(heap, released, csp_mem_span_released_get(span));
+    }
 
     int32_t l1 = csp_mem_meta_l1_by_index(span->index);
     int32_t l2 = csp_mem_meta_l2_by_index(span->index);
@@ -479,45 +888,17 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
 
     result = (void *)csp_mem_meta_l1l2_to_addr(heap, l1, l2);
 
-    /* Split the span if it's larger than the request. */
+    /* Split the span if it's larger than the request, and insert the rest to
+     * the free pages list. */
     if (key > npages) {
-      csp_mem_span_npages_set(span, npages);
-
-      /* Compute the index of the new span. */
-      int32_t new_l1 = l1, new_l2 = l2 + npages, overflow;
-      if (new_l2 >= csp_mem_meta_l2_num) {
-        overflow = new_l2 - csp_mem_meta_l2_num + 1;
-
-        new_l2 = overflow & csp_mem_meta_l2_num_mask;
-        new_l1 += overflow / csp_mem_meta_l2_num + (!!new_l2);
-
-        if (heap->metas[new_l1] == NULL &&
-            !csp_mem_heap_init_l1(heap, new_l1)) {
-          exit(EXIT_FAILURE);
-        }
+      csp_mem_span_t *rest = csp_mem_heap_split(heap, span, npages);
+      if (rest->released) {
+        csp_mem_heap_count_add(heap, released, csp_mem_span_released_get(rest));
       }
-
-      /* Get the new span. */
-      csp_mem_span_t *new_span = csp_mem_meta_span_by_l1l2(
-        heap, new_l1, new_l2
-      );
-      csp_mem_span_npages_set(new_span, key - npages);
-      csp_mem_meta_taken_bit_clear(heap, new_l1, new_l2);
-
-      /* Insert the new span to the metadata list. */
-      csp_mem_span_t *next = csp_mem_meta_span_by_index(heap, span->mt_next);
-      csp_mem_meta_index_set(new_span->mt_pre, span->index);
-      csp_mem_meta_index_set(new_span->mt_next, span->mt_next);
-      csp_mem_meta_index_set(span->mt_next, new_span->index);
-      if (next != NULL) {
-        csp_mem_meta_index_set(next->mt_pre, new_span->index);
-      }
-
-      /* Insert the new span to the free pages list. */
-      node = csp_rbtree_insert(heap->tree, key - npages);
-      csp_mem_tree_node_put_span(heap, node, new_span);
+      csp_mem_heap_put_span(heap, rest);
     }
 
+    span->released = 0;
     return result;
   }
 
@@ -527,7 +908,7 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
   /* Initialize the span. */
   int32_t l1 = csp_mem_meta_l1_by_addr(heap, result);
   int32_t l2 = csp_mem_meta_l2_by_addr(heap, result);
-  csp_mem_span_t *span = csp_mem_meta_span_by_l1l2(heap, l1, l2);
+  span = csp_mem_meta_span_by_l1l2(heap, l1, l2);
   csp_mem_span_npages_set(span, npages);
   csp_mem_meta_taken_bit_set(heap, l1, l2);
 
@@ -536,19 +917,187 @@ static void *csp_mem_heap_alloc(csp_mem_heap_t *heap, size_t size) {
     uintptr_t addr = (uintptr_t)result + size;
     csp_mem_span_t *new_span = csp_mem_meta_span_by_addr(heap, addr);
     csp_mem_span_npages_set(new_span, csp_mem_arena_npages - npages);
+    new_span->released = 1;
+    new_span->kept = 0;
+    csp_mem_heap_count_add(heap, released, csp_mem_arena_npages - npages);
 
     /* Link the two parts in metadata list. */
     csp_mem_meta_index_set(span->mt_next, new_span->index);
     csp_mem_meta_index_set(new_span->mt_pre, span->index);
 
     /* Put to the free pages list. */
-    node = csp_rbtree_insert(heap->tree, csp_mem_arena_npages - npages);
-    csp_mem_tree_node_put_span(heap, node, new_span);
+    csp_mem_heap_put_span(heap, new_span);
   }
 
   return result;
 }
 
+/* The largest class below `npages` of the resident lists with any spans, or
+ * 0 if there is none. */
+static int csp_mem_heap_class_below(csp_mem_heap_t *heap, int npages) {
+  if (--npages <= 0) {
+    return 0;
+  }
+  int word = npages >> 6;
+  uint64_t bits = heap->span_bits[0][word] &
+    (((uint64_t)2 << (npages & 63)) - 1);
+  if (bits == 0) {
+    uint64_t words = heap->span_words[0] & (((uint64_t)1 << word) - 1);
+    if (words == 0) {
+      return 0;
+    }
+    word = 63 - __builtin_clzll(words);
+    bits = heap->span_bits[0][word];
+  }
+  return (word << 6) | (63 - __builtin_clzll(bits));
+}
+
+/* Start a batch of the scavenger in the heap. */
+static void csp_mem_heap_scavenge_start(csp_mem_heap_t *heap,
+  csp_mem_scavenge_cursor_t *cursor) {
+  int n = csp_rbtree_all_nodes(heap->tree, heap->all_nodes);
+  for (int i = 0; i < n; i++) {
+    heap->scavenge_keys[i] = heap->all_nodes[i]->key;
+  }
+  cursor->nkeys = n;
+  cursor->npages = 0;
+  cursor->span = NULL;
+}
+
+/* The resident free span to release next. It's one free for `age` milliseconds
+ * or any one if `force` is set, the large spans first. It resumes from where
+ * the last call of the batch stopped, the spans released since are never met
+ * again. */
+static csp_mem_span_t *csp_mem_heap_scavenge_next(csp_mem_heap_t *heap,
+  csp_mem_scavenge_cursor_t *cursor, uint32_t now, uint32_t age, bool force) {
+  csp_mem_span_t *span = cursor->span, *next;
+  while (cursor->npages == 0) {
+    for (; span != NULL; span = next) {
+      next = csp_mem_meta_span_by_index(heap, span->fp_next);
+      if (!span->released && (force || now - span->freed_at >= age)) {
+        cursor->span = next;
+        return span;
+      }
+    }
+    if (cursor->nkeys == 0) {
+      cursor->npages = csp_mem_span_nclasses;
+      break;
+    }
+    csp_rbtree_node_t *node = csp_mem_tree_node_get(heap,
+      heap->scavenge_keys[--cursor->nkeys]);
+    span = node != NULL ? (csp_mem_span_t *)node->value : NULL;
+  }
+
+  /* The tail of a list is the oldest of it. In huge page mode the spans of a
+   * list have whole huge pages or not depending on where they start, and the
+   * ones smaller than a huge page never have. */
+  int min = csp_mem.huge != csp_mem_huge_none ?
+    csp_mem_huge_page_size >> csp_mem_page_size_exp : 1;
+  for (;;) {
+    while (span != NULL && (force || now - span->freed_at >= age)) {
+      next = csp_mem_meta_span_by_index(heap, span->fp_pre);
+      if (csp_mem_span_huge_edges(heap, span) < cursor->npages) {
+        cursor->span = next;
+        return span;
+      }
+      span = next;
+    }
+    cursor->npages = csp_mem_heap_class_below(heap, cursor->npages);
+    if (cursor->npages < min) {
+      cursor->npages = 1;
+      cursor->span = NULL;
+      return NULL;
+    }
+    span = heap->tails[cursor->npages];
+  }
+}
+
+/* Return the pages of a free span to the OS and the number of them. They are
+ * zeroed on the next touch like the ones freshly mapped. A large span is cut
+ * and only its first `csp_mem_scavenge_batch` pages are released, or its first
+ * whole huge page in huge page mode, the rest is put back resident for the next
+ * batches. */
+static int csp_mem_heap_release(csp_mem_heap_t *heap, csp_mem_span_t *span) {
+  int npages = csp_mem_span_npages_get(span);
+  int32_t l1 = csp_mem_meta_l1_by_index(span->index);
+  int32_t l2 = csp_mem_meta_l2_by_index(span->index);
+
+  uintptr_t start = csp_mem_meta_l1l2_to_addr(heap, l1, l2),
+            end = start + ((uintptr_t)npages << csp_mem_page_size_exp),
+            cut = csp_mem.huge == csp_mem_huge_none ?
+              start + ((uintptr_t)csp_mem_scavenge_batch <<
+                csp_mem_page_size_exp) :
+              ((start + csp_mem_huge_page_mask) & ~csp_mem_huge_page_mask) +
+                csp_mem_huge_page_size;
+
+  csp_mem_heap_del_span(heap, span);
+  if (cut < end) {
+    npages = (cut - start) >> csp_mem_page_size_exp;
+    csp_mem_heap_put_span(heap, csp_mem_heap_split(heap, span, npages));
+    end = cut;
+  }
+
+  /* Only the whole huge pages are released, the edges are kept resident. */
+  if (csp_mem.huge != csp_mem_huge_none) {
+    start = (start + csp_mem_huge_page_mask) & ~csp_mem_huge_page_mask;
+    end &= ~csp_mem_huge_page_mask;
+  }
+
+  if (start < end) {
+    madvise((void *)start, end - start, MADV_DONTNEED);
+  }
+  span->released = 1;
+  span->kept = npages -
+    (start < end ? (int)((end - start) >> csp_mem_page_size_exp) : 0);
+  int n = npages - span->kept;
+
+  /* Merge it with the piece released before, so that the span is whole again
+   * once all of it is released. */
+  csp_mem_span_t *pre = csp_mem_meta_span_by_index(heap, span->mt_pre);
+  if (csp_mem_span_is_free(heap, pre) && pre->released) {
+    csp_mem_heap_del_span(heap, pre);
+    csp_mem_span_npages_set(pre, csp_mem_span_npages_get(pre) + npages);
+    pre->kept += span->kept;
+    csp_mem_span_t *next = csp_mem_meta_span_by_index(heap, span->mt_next);
+    if (next != NULL) {
+      csp_mem_meta_index_set(pre->mt_next, next->index);
+      csp_mem_meta_index_set(next->mt_pre, pre->index);
+    } else {
+      csp_mem_meta_index_set_zero(pre->mt_next);
+    }
+    span = pre;
+  }
+  csp_mem_heap_put_span(heap, span);
+
+  csp_mem_heap_count_add(heap, released, n);
+  csp_mem_heap_count_add(heap, scavenged, n);
+  return n;
+}
+
+/* Release the spans of the heap free for `age` milliseconds, and the others
+ * too while the process is `*over` pages above the target. The objects in the
+ * mailboxes are freed first, they may stay there for long otherwise. */
+static void csp_mem_heap_scavenge(csp_mem_heap_t *heap, uint32_t now,
+  uint32_t age, size_t *over) {
+  csp_mem_span_t *span;
+  csp_mutex_lock(&heap->mutex);
+  csp_mem_heap_drain(heap);
+  csp_mutex_unlock(&heap->mutex);
+  do {
+    size_t n = 0;
+    csp_mem_scavenge_cursor_t cursor;
+    csp_mutex_lock(&heap->mutex);
+    csp_mem_heap_scavenge_start(heap, &cursor);
+    while (n < csp_mem_scavenge_batch && (span = csp_mem_heap_scavenge_next(
+        heap, &cursor, now, age, *over > 0)) != NULL) {
+      size_t npages = csp_mem_heap_release(heap, span);
+      n += npages;
+      *over -= npages < *over ? npages : *over;
+    }
+    csp_mutex_unlock(&heap->mutex);
+  } while (span != NULL);
+}
+
 static void csp_mem_heap_destroy(csp_mem_heap_t *heap) {
   for (int i = 0; i < csp_mem_meta_l1_num; i++) {
     csp_mem_heap_destroy_l1(heap, i);
@@ -565,9 +1114,20 @@ static void csp_mem_heap_destroy(csp_mem_heap_t *heap) {
   csp_rbtree_destroy(heap->tree, heap->all_nodes);
 }
 
-static struct { size_t len; csp_mem_heap_t *heaps; } csp_mem;
 
 bool csp_mem_init(void) {
+  const char *huge = getenv("LIBCSP_HUGEPAGES");
+  if (huge == NULL || strcmp(huge, "none") == 0) {
+    csp_mem.huge = csp_mem_huge_none;
+  } else if (strcmp(huge, "thp") == 0) {
+    csp_mem.huge = csp_mem_huge_thp;
+  } else if (strcmp(huge, "hugetlb") == 0) {
+    csp_mem.huge = csp_mem_huge_tlb;
+  } else {
+    fprintf(stderr, "libcsp: unknown LIBCSP_HUGEPAGES %s.\n", huge);
+    return false;
+  }
+
   csp_mem.heaps = (csp_mem_heap_t *)malloc(
     sizeof(csp_mem_heap_t) * csp_sched_np
   );
@@ -577,7 +1137,8 @@ bool csp_mem_init(void) {
 
   for (int i = 0; i < csp_sched_np; i++) {
     uintptr_t start = (uintptr_t)(i + 1) << csp_mem_heap_size_exp;
-    if (!csp_mem_heap_init(&csp_mem.heaps[i], start)) {
+    if (!csp_mem_heap_init(&csp_mem.heaps[i], start,
+      csp_topology_node(i))) {
       csp_mem.len = i;
       return false;
     }
@@ -588,11 +1149,55 @@ bool csp_mem_init(void) {
 }
 
 void *csp_mem_alloc(size_t pid, size_t size) {
-  return csp_mem_heap_alloc(&csp_mem.heaps[pid], size);
+  csp_mem_heap_t *heap = &csp_mem.heaps[pid];
+  csp_mutex_lock(&heap->mutex);
+  void *obj = csp_mem_heap_alloc(heap, size);
+  csp_mutex_unlock(&heap->mutex);
+  return obj;
 }
 
-void csp_mem_free(size_t pid, void *obj) {
+/* Allocate `n` objects of `size` bytes from the heap at once. They are carved
+ * from one span to share the huge pages if they fit in one. The ones the heap
+ * fails to allocate are NULL. */
+void csp_mem_allocm(size_t pid, size_t size, void **objs, size_t n) {
   csp_mem_heap_t *heap = &csp_mem.heaps[pid];
+  csp_mutex_lock(&heap->mutex);
+  if (csp_mem.huge != csp_mem_huge_none && n > 1 &&
+      size * n <= csp_mem_huge_page_size) {
+    objs[0] = csp_mem_heap_alloc(heap, size * n);
+    if (objs[0] == NULL) {
+      memset(objs, 0, sizeof(void *) * n);
+      csp_mutex_unlock(&heap->mutex);
+      return;
+    }
+    csp_mem_span_t *span = csp_mem_meta_span_by_addr(heap, objs[0]);
+    for (size_t i = 1; i < n; i++) {
+      span = csp_mem_heap_split(heap, span, size >> csp_mem_page_size_exp);
+      csp_mem_meta_taken_bit_set(heap,
+        csp_mem_meta_l1_by_index(span->index),
+        csp_mem_meta_l2_by_index(span->index));
+      objs[i] = (void *)((uintptr_t)objs[i - 1] + size);
+    }
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      objs[i] = csp_mem_heap_alloc(heap, size);
+    }
+  }
+  csp_mutex_unlock(&heap->mutex);
+}
+
+/* The heap an object belongs to, which is the one of the cpu it was allocated
+ * on. */
+#define csp_mem_heap_by_addr(obj)                                              \
+  (&csp_mem.heaps[((uintptr_t)(obj) >> csp_mem_heap_size_exp) - 1])
+
+static inline bool csp_mem_is_remote(csp_mem_heap_t *heap) {
+  return csp_this_core == NULL ||
+    &csp_mem.heaps[csp_this_core->pid] != heap;
+}
+
+void csp_mem_free(void *obj) {
+  csp_mem_heap_t *heap = csp_mem_heap_by_addr(obj);
 
   /*
    * The condition check `csp_this_core == NULL` matters here cause it may be
@@ -607,12 +1212,164 @@ void csp_mem_free(size_t pid, void *obj) {
    *  csp_proc_destroy()
    *  csp_mem_free()
    */
-  if (csp_this_core == NULL || csp_this_core->pid != pid) {
+  if (csp_mem_is_remote(heap)) {
     csp_msrbq_push(obj)(
       heap->mailboxes[csp_mem_meta_l1_by_addr(heap, obj)], (uintptr_t)obj
     );
   } else {
+    csp_mutex_lock(&heap->mutex);
     csp_mem_heap_free(heap, obj);
+    csp_mutex_unlock(&heap->mutex);
+  }
+}
+
+/* Free `n` objects at once, the local ones with the heap locked only once. */
+void csp_mem_freem(void **objs, size_t n) {
+  csp_mem_heap_t *locked = NULL;
+  for (size_t i = 0; i < n; i++) {
+    csp_mem_heap_t *heap = csp_mem_heap_by_addr(objs[i]);
+    if (csp_mem_is_remote(heap)) {
+      csp_msrbq_push(obj)(
+        heap->mailboxes[csp_mem_meta_l1_by_addr(heap, objs[i])],
+        (uintptr_t)objs[i]
+      );
+      continue;
+    }
+    if (locked == NULL) {
+      csp_mutex_lock(&heap->mutex);
+      locked = heap;
+    }
+    csp_mem_heap_free(heap, objs[i]);
+  }
+  if (locked != NULL) {
+    csp_mutex_unlock(&locked->mutex);
+  }
+}
+
+#ifdef csp_with_sysmalloc
+void *csp_mem_obj_alloc(size_t size) {
+  void *obj = calloc(1, size);
+  if (obj == NULL) {
+    exit(EXIT_FAILURE);
+  }
+  return obj;
+}
+
+void csp_mem_obj_free(void *obj) {
+  free(obj);
+}
+#else
+/* Allocate a zeroed object from the heap of the current cpu, like calloc. The
+ * small objects are carved from the slabs and the others take whole pages. The
+ * running proc mustn't be preempted with the heap locked. */
+void *csp_mem_obj_alloc(size_t size) {
+  if (csp_unlikely(csp_mem.heaps == NULL)) {
+    void *obj = calloc(1, size);
+    if (obj == NULL) {
+      exit(EXIT_FAILURE);
+    }
+    return obj;
+  }
+
+  CSP_CRITICAL_START();
+  csp_core_t *core = csp_this_core;
+  csp_mem_heap_t *heap = &csp_mem.heaps[core != NULL ? core->pid : 0];
+  void *obj;
+  csp_mutex_lock(&heap->mutex);
+  if (csp_likely(size <= csp_mem_slab_max)) {
+    obj = csp_mem_slab_alloc(heap, csp_mem_slab_class(size));
+  } else {
+    obj = csp_mem_heap_alloc(heap,
+      (size + csp_mem_page_size - 1) & ~(size_t)(csp_mem_page_size - 1));
+  }
+  csp_mutex_unlock(&heap->mutex);
+  CSP_CRITICAL_END();
+
+  memset(obj, 0, size);
+  return obj;
+}
+
+/* Free an object from csp_mem_obj_alloc(). The ones of other cpus are returned
+ * through the mailboxes, or with their heaps locked once the mailboxes fill
+ * up. */
+void csp_mem_obj_free(void *obj) {
+  if (obj == NULL) {
+    return;
+  }
+  if (csp_unlikely(csp_mem.heaps == NULL)) {
+    free(obj);
+    return;
+  }
+
+  CSP_CRITICAL_START();
+  csp_mem_heap_t *heap = csp_mem_heap_by_addr(obj);
+  if (!csp_mem_is_remote(heap) || !csp_msrbq_try_push(obj)(
+      heap->mailboxes[csp_mem_meta_l1_by_addr(heap, obj)], (uintptr_t)obj)) {
+    csp_mutex_lock(&heap->mutex);
+    csp_mem_heap_free_obj(heap, obj);
+    csp_mutex_unlock(&heap->mutex);
+  }
+  CSP_CRITICAL_END();
+}
+#endif
+
+/* Called by the monitor about every second, `now` is the monotonic time in
+ * nanoseconds. */
+void csp_mem_scavenge(int64_t now) {
+  uint32_t clock = (uint32_t)(now / 1000000);
+  atomic_store_explicit(&csp_mem.clock, clock, memory_order_relaxed);
+  if (csp_mem.heaps == NULL) {
+    return;
+  }
+
+  size_t target = (atomic_load(&csp_mem.target_rss) + csp_mem_page_size - 1) >>
+    csp_mem_page_size_exp, resident = 0, over = 0;
+  for (int i = 0; i < csp_mem.len; i++) {
+    csp_mem_heap_t *heap = &csp_mem.heaps[i];
+    resident += csp_mem_heap_count_get(heap, mapped) -
+      csp_mem_heap_count_get(heap, released);
+  }
+  if (target > 0 && resident > target) {
+    over = resident - target;
+  }
+
+  uint32_t age = atomic_load(&csp_mem.scavenge_age);
+  for (int i = 0; i < csp_mem.len; i++) {
+    csp_mem_heap_scavenge(&csp_mem.heaps[i], clock, age, &over);
+  }
+}
+
+/* Set how long a span stays free before it's released, a negative value
+ * restores the default. */
+void csp_mem_set_scavenge_age(int64_t nanoseconds) {
+  int64_t age = nanoseconds / 1000000;
+  if (nanoseconds < 0) {
+    age = csp_mem_scavenge_default_age;
+  } else if (age > UINT32_MAX / 2) {
+    age = UINT32_MAX / 2;
+  }
+  atomic_store(&csp_mem.scavenge_age, (uint32_t)age);
+}
+
+int64_t csp_mem_scavenge_age(void) {
+  return (int64_t)atomic_load(&csp_mem.scavenge_age) * 1000000;
+}
+
+void csp_mem_set_target_rss(size_t bytes) {
+  atomic_store(&csp_mem.target_rss, bytes);
+}
+
+/* The bytes mapped for the heaps, the bytes of them released(or never
+ * touched) and the bytes released by the scavenger so far. */
+void csp_mem_stats(size_t *mapped, size_t *released, size_t *scavenged) {
+  *mapped = *released = *scavenged = 0;
+  for (int i = 0; i < csp_mem.len; i++) {
+    csp_mem_heap_t *heap = &csp_mem.heaps[i];
+    *mapped += csp_mem_heap_count_get(heap, mapped) << csp_mem_page_size_exp;
+    *released +=
+      csp_mem_heap_count_get(heap, released) << csp_mem_page_size_exp;
+    *scavenged +=
+      csp_mem_heap_count_get(heap, scavenged) << csp_mem_page_size_exp;
   }
 }
 
@@ -16,6 +16,7 @@
  */
 
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include "core.h"
@@ -25,6 +26,7 @@
 #include "rand.h"
 #include "timer.h"
 #include "scheduler.h"
+#include "runtime.h"
 
 extern csp_scheduler_t *csp_global_scheduler;
 
@@ -57,11 +59,27 @@ extern int csp_sched_np;
 extern csp_mmrbq_t(core) *csp_sched_starving_threads, *csp_sched_starving_procs;
 extern int csp_netpoll_poll(csp_proc_t **start, csp_proc_t **end);
 extern int csp_timer_poll(csp_proc_t **start, csp_proc_t **end);
+extern void csp_mem_scavenge(int64_t now);
 
 static csp_rand_t csp_monitor_rand;
 static csp_proc_t *csp_monitor_procs[csp_monitor_procs_len];
 static csp_core_t *csp_monitor_cores[csp_monitor_cores_len];
 
+/* Set once SIGQUIT is received, the monitor dumps the procs then. */
+static atomic_bool csp_monitor_quit;
+
+static void csp_monitor_on_quit(int sig) {
+  atomic_store(&csp_monitor_quit, true);
+}
+
+/* Print every proc to stderr like Go does on SIGQUIT, and quit with the
+ * default action of it. */
+static void csp_monitor_dump_and_quit(void) {
+  runtime_dump_procs(STDERR_FILENO);
+  signal(SIGQUIT, SIG_DFL);
+  raise(SIGQUIT);
+}
+
 bool csp_monitor_poll(int (*poll)(csp_proc_t **, csp_proc_t **)) {
   csp_proc_t *start, *end;
 
@@ -71,14 +89,7 @@ bool csp_monitor_poll(int (*poll)(csp_proc_t **, csp_proc_t **)) {
   }
 
   if (csp_global_scheduler) {
-      csp_proc_t *p = start;
-      while (p) {
-          csp_proc_t *next = (csp_proc_t *)p->next;
-          p->next = p->pre = NULL;
-          csp_scheduler_submit(p);
-          if (p == end) break;
-          p = next;
-      }
+      csp_scheduler_submit_batch(start, end, n);
       return true;
   }
 
@@ -120,7 +131,14 @@ bool csp_monitor_poll(int (*poll)(csp_proc_t **, csp_proc_t **)) {
 
 void *csp_monitor(void *data) {
   int64_t duration = 1, since_last_checked = 0;
+  csp_timer_time_t scaled_at = 0, scavenged_at = 0;
   while (true) {
+    csp_timer_time_t now = csp_timer_now();
+    atomic_store_explicit(&csp_timer_coarse, now, memory_order_relaxed);
+    if (atomic_load(&csp_monitor_quit)) {
+      csp_monitor_dump_and_quit();
+    }
+
     if (!csp_monitor_poll(csp_netpoll_poll) &&
         !csp_monitor_poll(csp_timer_poll)) {
       since_last_checked += duration;
@@ -137,6 +155,24 @@ void *csp_monitor(void *data) {
       since_last_checked += csp_monitor_max_sleep_microsecs;
     }
 
+    /* Adjust the active workers and look for the ones blocked in syscalls
+     * about every millisecond, the scheduler is ready once they are. */
+    if (csp_global_scheduler &&
+        atomic_load(&csp_global_scheduler->nactive) > 0) {
+      now = csp_timer_now();
+      if (now - scaled_at >= csp_timer_millisecond) {
+        csp_scheduler_scale(now);
+        csp_scheduler_sysmon(now);
+        scaled_at = now;
+      }
+    }
+
+    /* Return the memory free for long to the OS about every second. */
+    if (now - scavenged_at >= csp_timer_second) {
+      csp_mem_scavenge(now);
+      scavenged_at = now;
+    }
+
     if (since_last_checked < csp_timer_second / 1000) {
       continue;
     }
@@ -146,7 +182,7 @@ void *csp_monitor(void *data) {
     ), len = 0;
 
     if (n > 0) {
-      csp_timer_time_t now = csp_timer_now();
+      now = csp_timer_now();
       for (size_t i = 0; i < n; i++) {
         csp_core_t *core = csp_monitor_cores[i];
         if (now - core->pcond.start > csp_timer_second) {
@@ -176,6 +212,15 @@ bool csp_monitor_init(void) {
   }
   pthread_attr_destroy(&attr);
 
+  /* The handler of the program itself is kept. */
+  struct sigaction sa;
+  if (sigaction(SIGQUIT, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+    sa.sa_handler = csp_monitor_on_quit;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGQUIT, &sa, NULL);
+  }
+
   csp_rand_init(&csp_monitor_rand);
   return true;
 }
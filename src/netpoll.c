@@ -28,6 +28,8 @@
 #include "proc.h"
 #include "runq.h"
 #include "timer.h"
+#include "trace.h"
+#include "worker.h"
 
 #define csp_netpoll_waiter_proc_get(w)    atomic_load(&(w)->proc)
 #define csp_netpoll_waiter_proc_set(w, p) atomic_store(&(w)->proc, (p))
@@ -56,6 +58,8 @@
                                                                                \
   /* Set this_core->running to NULL to prevent this process being scheduled    \
    * twice. */                                                                 \
+  csp_trace(csp_trace_block, running, csp_trace_reason_netpoll);               \
+  csp_proc_wait_set(running, (intptr_t)(fd), csp_trace_reason_netpoll);        \
   this_core->running = NULL;                                                   \
   csp_core_yield(running, &this_core->anchor);                                 \
                                                                                \
@@ -195,10 +199,10 @@ int csp_netpoll_poll(csp_proc_t **start, csp_proc_t **end) {
       len++;
     }
   }
-
   if (len > 0) {
     *start = head;
     *end = tail;
+    csp_worker_stats_add(csp_stats_netpoll_wakes, len);
   }
 
   return len;
@@ -20,13 +20,25 @@
 #include <stddef.h>
 #include "core.h"
 #include "proc.h"
+#include "proc_extra.h"
 #include "scheduler.h"
 
-static_assert(offsetof(csp_proc_t, mxcsr) == 0x18, "csp_proc_t.mxcsr offset mismatch");
-static_assert(offsetof(csp_proc_t, rsp) == 0x20, "csp_proc_t.rsp offset mismatch");
-static_assert(offsetof(csp_proc_t, rbp) == 0x28, "csp_proc_t.rbp offset mismatch");
-static_assert(offsetof(csp_proc_t, registers.callee_saved.rbx) == 0x30, "csp_proc_t.rbx offset mismatch");
-static_assert(offsetof(csp_proc_t, registers.caller_saved.rdi) == 0x30, "csp_proc_t.rdi offset mismatch");
+static_assert(offsetof(csp_proc_t, mxcsr) == 0x00, "csp_proc_t.mxcsr offset mismatch");
+static_assert(offsetof(csp_proc_t, x87cw) == 0x04, "csp_proc_t.x87cw offset mismatch");
+static_assert(offsetof(csp_proc_t, is_new) == 0x06, "csp_proc_t.is_new offset mismatch");
+static_assert(offsetof(csp_proc_t, rsp) == 0x08, "csp_proc_t.rsp offset mismatch");
+static_assert(offsetof(csp_proc_t, rbp) == 0x10, "csp_proc_t.rbp offset mismatch");
+static_assert(offsetof(csp_proc_t, registers.callee_saved.rbx) == 0x18, "csp_proc_t.rbx offset mismatch");
+static_assert(offsetof(csp_proc_t, registers.callee_saved.r15) == 0x38, "csp_proc_t.r15 offset mismatch");
+static_assert(offsetof(csp_proc_t, registers.caller_saved.rdi) == 0x18, "csp_proc_t.rdi offset mismatch");
+static_assert(offsetof(csp_proc_t, registers.caller_saved.r9) == 0x40, "csp_proc_t.r9 offset mismatch");
+static_assert(offsetof(csp_proc_t, stat) == 0x48, "csp_proc_t.stat offset mismatch");
+static_assert(offsetof(csp_proc_t, base) == 0x80, "csp_proc_t.base offset mismatch");
+static_assert(offsetof(csp_proc_t, timer.when) == 0x90, "csp_proc_t.timer.when offset mismatch");
+static_assert(offsetof(csp_proc_t, runnable_at) == 0xb0, "csp_proc_t.runnable_at offset mismatch");
+static_assert(offsetof(csp_proc_t, live_pre) == 0xc0, "csp_proc_t.live_pre offset mismatch");
+/* The plugin reserves 256 bytes for the proc in every stack. */
+static_assert(sizeof(csp_proc_t) == 0x100, "csp_proc_t size mismatch");
 
 /* Total processes generated by libcsp plugin. */
 extern size_t csp_procs_num;
@@ -38,17 +50,182 @@ extern _Thread_local csp_core_t *csp_this_core;
 
 #ifndef csp_with_sysmalloc
 extern void *csp_mem_alloc(size_t pid, size_t size);
-extern void csp_mem_free(size_t pid, void *obj);
+extern void csp_mem_allocm(size_t pid, size_t size, void **objs, size_t n);
+extern void csp_mem_free(void *obj);
+extern void csp_mem_freem(void **objs, size_t n);
+
+/* The stacks cached by a core for each size are bounded by both the number and
+ * the bytes, they are taken from or returned to the heap a quarter at a time. */
+#define csp_proc_stack_cache_max    64
+#define csp_proc_stack_cache_min    4
+#define csp_proc_stack_cache_bytes  (4 << 20)
+
+/* The link of a cached stack is put where `base` of its proc lives, which is
+ * out of the context of the switch. */
+#define csp_proc_stack_next(stack, size)                                       \
+  (*(void **)((uintptr_t)(stack) + (size) - sizeof(csp_proc_t) +               \
+    offsetof(csp_proc_t, base)))                                               \
+
+static inline size_t csp_proc_stack_cap(size_t size) {
+  size_t cap = csp_proc_stack_cache_bytes / size;
+  if (cap > csp_proc_stack_cache_max) {
+    return csp_proc_stack_cache_max;
+  }
+  return cap < csp_proc_stack_cache_min ? csp_proc_stack_cache_min : cap;
+}
+
+/* The cache of the stacks of `size` bytes, the first free class is taken by a
+ * new size. NULL is returned if all of them are taken by other sizes. */
+static inline csp_core_stacks_t *csp_proc_stacks(csp_core_t *core,
+  size_t size) {
+  for (int i = 0; i < csp_core_stack_classes; i++) {
+    csp_core_stacks_t *stacks = &core->stacks[i];
+    if (stacks->size == size) {
+      return stacks;
+    }
+    if (stacks->size == 0) {
+      stacks->size = size;
+      return stacks;
+    }
+  }
+  return NULL;
+}
+
+static void *csp_proc_stack_get(csp_core_t *core, size_t size) {
+  csp_core_stacks_t *stacks = csp_proc_stacks(core, size);
+  if (stacks == NULL) {
+    return csp_mem_alloc(core->pid, size);
+  }
+
+  void *base = stacks->head;
+  if (base != NULL) {
+    stacks->head = csp_proc_stack_next(base, size);
+    stacks->len--;
+    return base;
+  }
+
+  /* Refill the cache from the heap, with the stacks got if it runs out. */
+  void *objs[csp_proc_stack_cache_max / 4];
+  size_t n = csp_proc_stack_cap(size) / 4, got = 0;
+  csp_mem_allocm(core->pid, size, objs, n);
+  for (size_t i = 0; i < n; i++) {
+    if (objs[i] != NULL) {
+      objs[got++] = objs[i];
+    }
+  }
+  if (got == 0) {
+    return NULL;
+  }
+  n = got;
+  for (size_t i = 1; i < n; i++) {
+    csp_proc_stack_next(objs[i], size) = stacks->head;
+    stacks->head = objs[i];
+  }
+  stacks->len = n - 1;
+  return objs[0];
+}
+
+static void csp_proc_stack_put(csp_core_t *core, void *base, size_t size) {
+  csp_core_stacks_t *stacks;
+
+  /* It may be the monitor thread, which has no core. */
+  if (core == NULL || (stacks = csp_proc_stacks(core, size)) == NULL) {
+    csp_mem_free(base);
+    return;
+  }
+
+  /* Return a quarter of them to the heap once the cache is full. */
+  size_t cap = csp_proc_stack_cap(size);
+  if (stacks->len == cap) {
+    void *objs[csp_proc_stack_cache_max / 4];
+    size_t n = cap / 4;
+    for (size_t i = 0; i < n; i++) {
+      objs[i] = stacks->head;
+      stacks->head = csp_proc_stack_next(objs[i], size);
+    }
+    stacks->len -= n;
+    csp_mem_freem(objs, n);
+  }
+
+  csp_proc_stack_next(base, size) = stacks->head;
+  stacks->head = base;
+  stacks->len++;
+}
 #endif
 
+/* Count the procs on the core without any atomic RMW, the ones exited on the
+ * threads without cores are counted globally. */
+static inline void csp_proc_count(csp_core_t *core, int delta) {
+  if (core != NULL) {
+    atomic_store_explicit(&core->nprocs,
+      atomic_load_explicit(&core->nprocs, memory_order_relaxed) + delta,
+      memory_order_relaxed);
+  } else if (csp_global_scheduler) {
+    atomic_fetch_add(&csp_global_scheduler->num_procs, delta);
+  }
+}
+
+/* Return all the stacks cached by the core to the heap. */
+void csp_proc_stacks_drain(csp_core_t *core) {
+#ifndef csp_with_sysmalloc
+  for (int i = 0; i < csp_core_stack_classes; i++) {
+    csp_core_stacks_t *stacks = &core->stacks[i];
+    while (stacks->head != NULL) {
+      void *base = stacks->head;
+      stacks->head = csp_proc_stack_next(base, stacks->size);
+      csp_mem_free(base);
+    }
+    stacks->len = 0;
+  }
+#endif
+}
+
+/* The registry lock is a spinlock, its holder must not be preempted. */
+static void csp_proc_live_add(csp_core_t *core, csp_proc_t *proc) {
+  csp_scheduler_nopreempt++;
+  csp_soft_mbarr();
+  csp_mutex_lock(&core->live_lock);
+  proc->live_core = core;
+  proc->live_pre = NULL;
+  proc->live_next = core->live_procs;
+  if (core->live_procs != NULL) {
+    core->live_procs->live_pre = proc;
+  }
+  core->live_procs = proc;
+  csp_mutex_unlock(&core->live_lock);
+  csp_soft_mbarr();
+  csp_scheduler_nopreempt--;
+}
+
+static void csp_proc_live_del(csp_proc_t *proc) {
+  csp_core_t *core = proc->live_core;
+  csp_scheduler_nopreempt++;
+  csp_soft_mbarr();
+  csp_mutex_lock(&core->live_lock);
+  if (proc->live_pre != NULL) {
+    proc->live_pre->live_next = proc->live_next;
+  } else {
+    core->live_procs = proc->live_next;
+  }
+  if (proc->live_next != NULL) {
+    proc->live_next->live_pre = proc->live_pre;
+  }
+  csp_mutex_unlock(&core->live_lock);
+  csp_soft_mbarr();
+  csp_scheduler_nopreempt--;
+}
+
 csp_proc_t *csp_proc_new(int id, bool waited_by_parent) {
+  /* The stack cache and the heap lock belong to the core, the proc must not
+   * be preempted off it until it is done with them. */
+  CSP_CRITICAL_START();
   csp_core_t *this_core = csp_this_core;
   size_t size = csp_procs_size[id];
 
 #ifdef csp_with_sysmalloc
   uintptr_t base = (uintptr_t)malloc(size);
 #else
-  uintptr_t base = (uintptr_t)csp_mem_alloc(this_core->pid, size);
+  uintptr_t base = (uintptr_t)csp_proc_stack_get(this_core, size);
 #endif
 
   if (base == (uintptr_t)NULL) {
@@ -58,7 +235,19 @@ csp_proc_t *csp_proc_new(int id, bool waited_by_parent) {
 
   csp_proc_t *proc = (csp_proc_t *)(base + size - sizeof(csp_proc_t));
   proc->base = base;
-  proc->is_new = true;
+  /* The generated entries save the ones of the caller anyway. */
+  proc->mxcsr = csp_proc_default_mxcsr;
+  proc->x87cw = csp_proc_default_x87cw;
+  proc->is_new = csp_proc_is_new;
+  proc->nopreempt = 0;
+  proc->preemptible = false;
+  proc->chan_val = NULL;
+  proc->chan_ok = false;
+  proc->runnable_at = 0;
+  proc->wait_on = NULL;
+  proc->wait_reason = -1;
+  proc->site = id;
+  proc->func = NULL;
   proc->borned_pid = this_core->pid;
   atomic_store(&proc->stat, csp_proc_stat_none);
 
@@ -73,14 +262,18 @@ csp_proc_t *csp_proc_new(int id, bool waited_by_parent) {
   }
   proc->pre = proc->next = NULL;
 
+  csp_proc_t *running = (csp_proc_t *)this_core->running;
+  proc->prio = running != NULL ? running->spawn_prio : csp_proc_prio_normal;
+  proc->spawn_prio = proc->prio;
+
 #ifdef csp_enable_valgrind
   proc->valgrind_stack = VALGRIND_STACK_REGISTER(proc->base, proc);
 #endif
 
-  if (csp_global_scheduler) {
-    atomic_fetch_add(&csp_global_scheduler->num_procs, 1);
-  }
+  csp_proc_count(this_core, 1);
+  csp_proc_live_add(this_core, proc);
 
+  CSP_CRITICAL_END();
   return proc;
 }
 
@@ -90,43 +283,43 @@ __attribute__((noinline,used)) void csp_proc_nchild_set(size_t nchild) {
 
 __attribute__((naked)) void csp_proc_restore(csp_proc_t *proc) {
   __asm__ __volatile__(
-    "ldmxcsr 0x18(%rdi)\n"
-    "fldcw   0x1c(%rdi)\n"
+    "ldmxcsr 0x00(%rdi)\n"
+    "fldcw   0x04(%rdi)\n"
 
     /* Load `is_new` and check it. */
-    "mov  0x10(%rdi), %rax\n"
-    "test %rax, %rax\n"
+    "movzwl 0x06(%rdi), %eax\n"
+    "test %eax, %eax\n"
     "jz  normal_restore@plt\n"
-    "cmp $1, %rax\n"
+    "cmp $1, %eax\n"
     "je  new_restore@plt\n"
-    "cmp $2, %rax\n"
+    "cmp $2, %eax\n"
     "je  preempt_restore@plt\n"
 
     "normal_restore:\n"
-    "mov     0x20(%rdi), %rsp\n"
-    "mov     0x28(%rdi), %rbp\n"
-    "mov 0x30(%rdi), %rbx\n"
-    "mov 0x38(%rdi), %r12\n"
-    "mov 0x40(%rdi), %r13\n"
-    "mov 0x48(%rdi), %r14\n"
-    "mov 0x50(%rdi), %r15\n"
+    "mov     0x08(%rdi), %rsp\n"
+    "mov     0x10(%rdi), %rbp\n"
+    "mov 0x18(%rdi), %rbx\n"
+    "mov 0x20(%rdi), %r12\n"
+    "mov 0x28(%rdi), %r13\n"
+    "mov 0x30(%rdi), %r14\n"
+    "mov 0x38(%rdi), %r15\n"
     "retq\n"
 
     "new_restore:\n"
-    "movq $0, 0x10(%rdi)\n" // Set `is_new` to 0.
-    "mov     0x20(%rdi), %rsp\n"
-    "mov     0x28(%rdi), %rbp\n"
-    "mov 0x38(%rdi), %rsi\n"
-    "mov 0x40(%rdi), %rdx\n"
-    "mov 0x48(%rdi), %rcx\n"
-    "mov 0x50(%rdi), %r8\n"
-    "mov 0x58(%rdi), %r9\n"
-    "mov 0x30(%rdi), %rdi\n" // Restore %rdi at the last step.
+    "movw $0, 0x06(%rdi)\n" // Set `is_new` to 0.
+    "mov     0x08(%rdi), %rsp\n"
+    "mov     0x10(%rdi), %rbp\n"
+    "mov 0x20(%rdi), %rsi\n"
+    "mov 0x28(%rdi), %rdx\n"
+    "mov 0x30(%rdi), %rcx\n"
+    "mov 0x38(%rdi), %r8\n"
+    "mov 0x40(%rdi), %r9\n"
+    "mov 0x18(%rdi), %rdi\n" // Restore %rdi at the last step.
     "retq\n"
 
     "preempt_restore:\n"
-    "movq $0, 0x10(%rdi)\n" // Set `is_new` to 0.
-    "mov     0x20(%rdi), %rsp\n"
+    "movw $0, 0x06(%rdi)\n" // Set `is_new` to 0.
+    "mov     0x08(%rdi), %rsp\n"
     "pop %r15\n"
     "pop %r14\n"
     "pop %r13\n"
@@ -172,9 +365,14 @@ __attribute__((naked)) void csp_async_preempt(void) {
 }
 
 __attribute__((noinline)) void csp_proc_destroy(csp_proc_t *proc) {
-  if (csp_global_scheduler) {
-      atomic_fetch_sub(&csp_global_scheduler->num_procs, 1);
-  }
+  /* The stack goes back to the cache of the core, see csp_proc_new(). It may
+   * run on the anchor stack on exit, where the deferred preemption must not
+   * be taken, so the counter is bumped by hand. */
+  csp_scheduler_nopreempt++;
+  csp_soft_mbarr();
+  csp_core_t *this_core = csp_this_core;
+  csp_proc_count(this_core, -1);
+  csp_proc_live_del(proc);
 
 #ifdef csp_enable_valgrind
   VALGRIND_STACK_DEREGISTER(proc->valgrind_stack);
@@ -183,6 +381,9 @@ __attribute__((noinline)) void csp_proc_destroy(csp_proc_t *proc) {
 #ifdef csp_with_sysmalloc
   free((void *)proc->base);
 #else
-  csp_mem_free(proc->borned_pid, (void *)proc->base);
+  csp_proc_stack_put(this_core, (void *)proc->base,
+    (uintptr_t)proc + sizeof(csp_proc_t) - proc->base);
 #endif
+  csp_soft_mbarr();
+  csp_scheduler_nopreempt--;
 }
@@ -55,45 +55,101 @@ extern "C" {
   atomic_compare_exchange_weak_explicit(&(proc)->stat, &(oval), nval,          \
                                         memory_order_acq_rel, memory_order_acquire)
 
+/* The priority classes, the scheduler dispatches them by weight and each of
+ * them has its own run queue. */
+#define csp_proc_prio_high              0
+#define csp_proc_prio_normal            1
+#define csp_proc_prio_low               2
+#define csp_proc_prio_num               3
+#define csp_proc_prio_valid(prio)       ((prio) >= 0 && (prio) < csp_proc_prio_num)
+
 #define csp_proc_is_normal   0
 #define csp_proc_is_new      1
 #define csp_proc_is_preempt  2
 
+/* The control words of SSE and x87 FPU after the reset. */
+#define csp_proc_default_mxcsr 0x1f80
+#define csp_proc_default_x87cw 0x037f
+
 #define csp_proc_save(reg)                                                     \
-  "stmxcsr   0x18(%"reg")\n"                                                   \
-  "fstcw     0x1c(%"reg")\n"                                                   \
-  "mov %rsp, 0x20(%"reg")\n"                                                   \
-  "mov %rbp, 0x28(%"reg")\n"                                                   \
-  "mov %rbx, 0x30(%"reg")\n"                                                   \
-  "mov %r12, 0x38(%"reg")\n"                                                   \
-  "mov %r13, 0x40(%"reg")\n"                                                   \
-  "mov %r14, 0x48(%"reg")\n"                                                   \
-  "mov %r15, 0x50(%"reg")\n"                                                   \
+  "stmxcsr   0x00(%"reg")\n"                                                   \
+  "fstcw     0x04(%"reg")\n"                                                   \
+  "mov %rsp, 0x08(%"reg")\n"                                                   \
+  "mov %rbp, 0x10(%"reg")\n"                                                   \
+  "mov %rbx, 0x18(%"reg")\n"                                                   \
+  "mov %r12, 0x20(%"reg")\n"                                                   \
+  "mov %r13, 0x28(%"reg")\n"                                                   \
+  "mov %r14, 0x30(%"reg")\n"                                                   \
+  "mov %r15, 0x38(%"reg")\n"                                                   \
 
+/* The proc is put at the top of its stack region, which is 64-bytes aligned.
+ * The offsets used by the asm code are checked in proc.c. */
 typedef struct csp_proc_s {
-  uint64_t base;
-  uint64_t borned_pid;
-  uint64_t is_new;
-  uint32_t mxcsr;
-  uint32_t x87cw;
+  /* The context saved and restored on every switch fills the first cache line
+   * exactly. The registers of the arguments are only used by the new procs.
+   * Offset: 0x00 */
+  _Alignas(64) uint32_t mxcsr;
+  uint16_t x87cw;
+  uint16_t is_new;
   uint64_t rsp;
   uint64_t rbp;
   union {
     struct { uint64_t rbx, r12, r13, r14, r15; } callee_saved;
     struct { uint64_t rdi, rsi, rdx, rcx, r8, r9; } caller_saved;
   } registers;
-  struct { int64_t when, idx; atomic_int_fast64_t token; } timer;
-  struct csp_proc_s *parent;
+
+  /* The states touched by the scheduler and the channels around a switch.
+   * Offset: 0x48 */
+  atomic_uint_fast64_t stat;
   struct csp_proc_s *pre, *next;
+  /* The priority class of the proc and the one of the procs it spawns, which
+   * inherit it by default. */
+  int32_t prio, spawn_prio;
+  /* The csp_scheduler_nopreempt of the proc while it is switched out. */
+  int32_t nopreempt;
+  bool preemptible;
+  /* The value and the result of the blocking channel operation. */
+  bool chan_ok;
+  void *chan_val;
+  struct csp_proc_s *parent;
+
+  /* The cold ones. Offset: 0x80 */
+  uint64_t base;
+  uint64_t borned_pid;
+  struct { int64_t when, idx; atomic_int_fast64_t token; } timer;
   atomic_uint_fast64_t nchild;
-  atomic_uint_fast64_t stat;
+  /* When the proc was put to a runq if it's timed for runtime_sched_latency(),
+   * otherwise 0. */
+  int64_t runnable_at;
 #ifdef csp_enable_valgrind
   uint64_t valgrind_stack;
 #endif
-  void *extra;
-  char _padding[64]; // Avoid false sharing
+
+  /* The registry of the live procs, touched when the proc is spawned, exits
+   * and blocks, see runtime_dump_procs(). Offset: 0xc0 */
+  _Alignas(64) struct csp_proc_s *live_pre;
+  struct csp_proc_s *live_next;
+  /* The core whose registry the proc is in. */
+  struct csp_core_s *live_core;
+  /* What the proc is blocked on(e.g. the channel, the mutex, the fd) and since
+   * when, `wait_reason` is one of csp_trace_reason_t or -1. */
+  void *wait_on;
+  int64_t wait_since;
+  int32_t wait_reason;
+  /* The stack id the proc was spawned with, which the plugin numbers the
+   * functions run by procs with. */
+  int32_t site;
+  /* The function the proc runs if it's spawned by csp_proc_create(). */
+  void *func;
 } csp_proc_t;
 
+/* Record what the running proc is going to block on. */
+#define csp_proc_wait_set(proc, on, reason) do {                               \
+  (proc)->wait_on = (void *)(on);                                              \
+  (proc)->wait_reason = (reason);                                              \
+  (proc)->wait_since = csp_timer_coarse_now();                                 \
+} while (0)
+
 void csp_proc_nchild_set(size_t nchild);
 
 #ifdef __cplusplus
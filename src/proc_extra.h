@@ -3,33 +3,31 @@
 
 #include <stdbool.h>
 #include <stdatomic.h>
-#include <stdlib.h>
-
-typedef struct {
-    bool preemptible;
-    atomic_int in_critical_section;
-    void *chan_val; // For returning values from blocking channel operations
-    bool chan_ok;
-} csp_proc_extra_t;
 
 extern _Thread_local struct csp_core_s *csp_this_core;
 
+/* Depth of the regions the running thread can't be preempted in. It is thread
+ * local so entering and leaving them costs no syscall, and is saved to and
+ * restored from the proc when it is switched. */
+extern _Thread_local int csp_scheduler_nopreempt;
+
+/* Set by the preemption handler when it arrived inside such a region, the
+ * preemption then happens when the region is left. */
+extern _Thread_local bool csp_scheduler_preempt_deferred;
+
+extern void csp_scheduler_preempt_deferred_yield(void);
+
 #define CSP_CRITICAL_START() do { \
-    if (csp_this_core && csp_this_core->running) { \
-        csp_proc_t *_p = (csp_proc_t *)csp_this_core->running; \
-        if (_p->extra) ((csp_proc_extra_t *)_p->extra)->in_critical_section++; \
-    } \
+    csp_scheduler_nopreempt++; \
+    __asm__ __volatile__("" ::: "memory"); \
 } while(0)
 
 #define CSP_CRITICAL_END() do { \
-    if (csp_this_core && csp_this_core->running) { \
-        csp_proc_t *_p = (csp_proc_t *)csp_this_core->running; \
-        if (_p->extra) ((csp_proc_extra_t *)_p->extra)->in_critical_section--; \
+    __asm__ __volatile__("" ::: "memory"); \
+    if (--csp_scheduler_nopreempt == 0 && \
+        __builtin_expect(csp_scheduler_preempt_deferred, 0)) { \
+        csp_scheduler_preempt_deferred_yield(); \
     } \
 } while(0)
 
-static inline csp_proc_extra_t *csp_proc_extra_new() {
-    return (csp_proc_extra_t *)calloc(1, sizeof(csp_proc_extra_t));
-}
-
 #endif
@@ -0,0 +1,450 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "prof.h"
+#include "core.h"
+#include "proc.h"
+#include "scheduler.h"
+#include "worker.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+/* Frames kept of every sample, the outermost ones are cut off. */
+#define csp_prof_max_depth      32
+
+/* Distinct stacks kept by every worker, a power of 2. The samples of the ones
+ * which don't fit in are counted as lost. */
+#define csp_prof_table_len      2048
+
+/* Slots tried for a stack before it's given up. */
+#define csp_prof_probes         16
+
+/* The site of the samples taken outside the procs, e.g. in the scheduler. */
+#define csp_prof_no_site        (-1)
+
+/* The rate of the legacy profile if the profiler was never started. */
+#define csp_prof_default_hz     100
+
+typedef struct {
+    uint64_t count, hash;
+    /* The proc type, see csp_proc_t.site and csp_proc_t.func. */
+    void *func;
+    int32_t site;
+    int32_t depth;
+    /* The pc interrupted and the return addresses of the frames above it. */
+    uintptr_t pcs[csp_prof_max_depth];
+} csp_prof_entry_t;
+
+/* The samples of a worker, written by the handler on the thread owning it.
+ * The lock keeps the readers away, and the thread the worker is being handed
+ * off from. The handler drops the sample rather than waiting for it. */
+typedef struct {
+    atomic_flag lock;
+    atomic_uint_fast64_t lost;
+    csp_prof_entry_t entries[csp_prof_table_len];
+} csp_prof_table_t;
+
+static struct {
+    pthread_mutex_t mutex;
+    /* One for every worker, the last one is shared by the threads owning none
+     * (e.g. the monitor, the ones blocked in syscalls). They are never freed
+     * since the handler may be using them. */
+    csp_prof_table_t **_Atomic tables;
+    int ntables;
+    int hz, last_hz;
+} csp_prof = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+extern size_t csp_procs_num;
+
+/* Generated by the plugin, it's not there in the programs built without it. */
+extern const char *csp_procs_name[] __attribute__((weak));
+
+static uint64_t csp_prof_hash(csp_prof_entry_t *sample) {
+    uint64_t hash = 14695981039346656037ULL;
+    hash = (hash ^ (uint64_t)(uintptr_t)sample->func) * 1099511628211ULL;
+    hash = (hash ^ (uint64_t)(uint32_t)sample->site) * 1099511628211ULL;
+    for (int i = 0; i < sample->depth; i++) {
+        hash = (hash ^ sample->pcs[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool csp_prof_same(csp_prof_entry_t *a, csp_prof_entry_t *b) {
+    return a->hash == b->hash && a->func == b->func && a->site == b->site &&
+        a->depth == b->depth &&
+        memcmp(a->pcs, b->pcs, sizeof(uintptr_t) * a->depth) == 0;
+}
+
+/* Follow the frame pointers from `fp` within [lo, hi), every frame must be
+ * above the last one. The functions built without the frame pointer end the
+ * walk, possibly after a few bogus frames, but never outside the range. */
+static void csp_prof_walk(csp_prof_entry_t *sample, uintptr_t lo,
+                          uintptr_t fp, uintptr_t hi) {
+    while (sample->depth < csp_prof_max_depth && fp >= lo &&
+           fp + 2 * sizeof(uintptr_t) <= hi && fp % sizeof(uintptr_t) == 0) {
+        uintptr_t *frame = (uintptr_t *)fp;
+        if (frame[1] == 0) {
+            break;
+        }
+        sample->pcs[sample->depth++] = frame[1];
+        if (frame[0] <= fp) {
+            break;
+        }
+        fp = frame[0];
+    }
+}
+
+static void csp_prof_record(csp_prof_table_t *table,
+                            csp_prof_entry_t *sample) {
+    if (atomic_flag_test_and_set_explicit(&table->lock, memory_order_acquire)) {
+        atomic_fetch_add_explicit(&table->lost, 1, memory_order_relaxed);
+        return;
+    }
+    sample->hash = csp_prof_hash(sample);
+    bool found = false;
+    for (int i = 0; i < csp_prof_probes && !found; i++) {
+        csp_prof_entry_t *entry = &table->entries[
+            (sample->hash + i) & (csp_prof_table_len - 1)];
+        if (entry->count == 0) {
+            memcpy(entry, sample, offsetof(csp_prof_entry_t, pcs) +
+                   sizeof(uintptr_t) * sample->depth);
+            entry->count = 1;
+            found = true;
+        } else if (csp_prof_same(entry, sample)) {
+            entry->count++;
+            found = true;
+        }
+    }
+    if (!found) {
+        atomic_fetch_add_explicit(&table->lost, 1, memory_order_relaxed);
+    }
+    atomic_flag_clear_explicit(&table->lock, memory_order_release);
+}
+
+static void csp_prof_handler(int sig, siginfo_t *si, void *uc) {
+    csp_prof_table_t **tables = atomic_load_explicit(&csp_prof.tables,
+                                                     memory_order_acquire);
+    if (tables == NULL) {
+        return;
+    }
+    int saved_errno = errno;
+    mcontext_t *mctx = &((ucontext_t *)uc)->uc_mcontext;
+    uintptr_t sp = (uintptr_t)mctx->gregs[REG_RSP];
+
+    csp_prof_entry_t sample;
+    sample.func = NULL;
+    sample.site = csp_prof_no_site;
+    sample.depth = 1;
+    sample.pcs[0] = (uintptr_t)mctx->gregs[REG_RIP];
+    csp_prof_table_t *table = tables[csp_prof.ntables - 1];
+
+    csp_core_t *core = csp_this_core;
+    if (core != NULL) {
+        csp_worker_t *w = (csp_worker_t *)core->worker;
+        if (w != NULL && w->id < csp_prof.ntables - 1 &&
+            atomic_load_explicit(&w->core, memory_order_relaxed) == core) {
+            table = tables[w->id];
+        }
+        /* Only the stack of the proc is walked, the scheduler runs on the
+         * anchor stack with `running` not updated yet. */
+        csp_proc_t *proc = (csp_proc_t *)core->running;
+        if (proc != NULL && sp > proc->base && sp < (uintptr_t)proc) {
+            sample.func = proc->func;
+            sample.site = proc->site;
+            csp_prof_walk(&sample, sp, (uintptr_t)mctx->gregs[REG_RBP],
+                          (uintptr_t)proc);
+        }
+    }
+    csp_prof_record(table, &sample);
+    errno = saved_errno;
+}
+
+static bool csp_prof_init(void) {
+    int n = (csp_global_scheduler ? csp_global_scheduler->num_workers : 0) + 1;
+    csp_prof_table_t **tables = (csp_prof_table_t **)calloc(n, sizeof(*tables));
+    if (tables == NULL) {
+        return false;
+    }
+    for (int i = 0; i < n; i++) {
+        if ((tables[i] = (csp_prof_table_t *)calloc(1, sizeof(**tables))) ==
+            NULL) {
+            while (i-- > 0) {
+                free(tables[i]);
+            }
+            free(tables);
+            return false;
+        }
+        atomic_flag_clear(&tables[i]->lock);
+    }
+    csp_prof.ntables = n;
+    atomic_store_explicit(&csp_prof.tables, tables, memory_order_release);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sa.sa_sigaction = csp_prof_handler;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(SIGPROF, &sa, NULL) == 0;
+}
+
+/* Sample `hz` times per second of cpu time, 0 stops sampling. The samples are
+ * kept until csp_prof_reset(). */
+bool csp_prof_set_rate(int hz) {
+    pthread_mutex_lock(&csp_prof.mutex);
+    bool ok = true;
+    if (hz > 0 && atomic_load(&csp_prof.tables) == NULL) {
+        ok = csp_prof_init();
+    }
+    if (ok) {
+        struct itimerval it;
+        memset(&it, 0, sizeof(it));
+        if (hz > 0) {
+            it.it_interval.tv_usec = hz < 1000000 ? 1000000 / hz : 1;
+            it.it_value = it.it_interval;
+        }
+        ok = setitimer(ITIMER_PROF, &it, NULL) == 0;
+    }
+    if (ok) {
+        csp_prof.hz = hz > 0 ? hz : 0;
+        if (hz > 0) {
+            csp_prof.last_hz = hz;
+        }
+    }
+    pthread_mutex_unlock(&csp_prof.mutex);
+    return ok;
+}
+
+int csp_prof_rate(void) {
+    pthread_mutex_lock(&csp_prof.mutex);
+    int hz = csp_prof.hz;
+    pthread_mutex_unlock(&csp_prof.mutex);
+    return hz;
+}
+
+static void csp_prof_lock(csp_prof_table_t *table) {
+    while (atomic_flag_test_and_set_explicit(&table->lock,
+                                             memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+void csp_prof_reset(void) {
+    pthread_mutex_lock(&csp_prof.mutex);
+    csp_prof_table_t **tables = atomic_load(&csp_prof.tables);
+    for (int i = 0; tables != NULL && i < csp_prof.ntables; i++) {
+        csp_prof_lock(tables[i]);
+        memset(tables[i]->entries, 0, sizeof(tables[i]->entries));
+        atomic_store(&tables[i]->lost, 0);
+        atomic_flag_clear_explicit(&tables[i]->lock, memory_order_release);
+    }
+    pthread_mutex_unlock(&csp_prof.mutex);
+}
+
+/* Copy the table so that the handler is blocked for the copy only, not for
+ * the writes. */
+static csp_prof_table_t *csp_prof_snapshot(csp_prof_table_t *table) {
+    csp_prof_table_t *copy = (csp_prof_table_t *)malloc(sizeof(*copy));
+    if (copy != NULL) {
+        csp_prof_lock(table);
+        memcpy(copy->entries, table->entries, sizeof(table->entries));
+        atomic_flag_clear_explicit(&table->lock, memory_order_release);
+        atomic_store(&copy->lost, atomic_load(&table->lost));
+    }
+    return copy;
+}
+
+/* The function `pc` is in, or the object and the offset in it for the ones
+ * without a dynamic symbol(e.g. the static ones, the executables linked
+ * without -rdynamic). */
+static void csp_prof_write_frame(FILE *f, uintptr_t pc) {
+    Dl_info info;
+    if (dladdr((void *)pc, &info) == 0) {
+        fprintf(f, ";%#lx", (unsigned long)pc);
+    } else if (info.dli_sname != NULL) {
+        fprintf(f, ";%s", info.dli_sname);
+    } else if (info.dli_fname != NULL && info.dli_fbase != NULL) {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(f, ";%s+%#lx", name != NULL ? name + 1 : info.dli_fname,
+                (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+    } else {
+        fprintf(f, ";%#lx", (unsigned long)pc);
+    }
+}
+
+static void csp_prof_write_type(FILE *f, csp_prof_entry_t *entry) {
+    Dl_info info;
+    if (entry->site == csp_prof_no_site) {
+        fprintf(f, ";scheduler");
+    } else if (entry->func != NULL && dladdr(entry->func, &info) != 0 &&
+               info.dli_sname != NULL) {
+        fprintf(f, ";proc %s", info.dli_sname);
+    } else if (csp_procs_name != NULL && (size_t)entry->site < csp_procs_num &&
+               csp_procs_name[entry->site] != NULL) {
+        fprintf(f, ";proc %s", csp_procs_name[entry->site]);
+    } else {
+        fprintf(f, ";proc site %d", entry->site);
+    }
+}
+
+static void csp_prof_write_worker(FILE *f, int id) {
+    if (id < csp_prof.ntables - 1) {
+        fprintf(f, "worker %d", id);
+    } else {
+        fprintf(f, "no worker");
+    }
+}
+
+typedef struct {
+    char *stack;
+    uint64_t count;
+} csp_prof_line_t;
+
+static int csp_prof_line_cmp(const void *a, const void *b) {
+    return strcmp(((const csp_prof_line_t *)a)->stack,
+                  ((const csp_prof_line_t *)b)->stack);
+}
+
+/* Render the stacks of `table` into `lines`, the ones of the lost samples too.
+ * It returns the new number of the lines or -1 if it's out of memory. */
+static ssize_t csp_prof_render(csp_prof_table_t *table, int id,
+                               csp_prof_line_t **lines, size_t n,
+                               size_t *cap) {
+    uint64_t lost = atomic_load(&table->lost);
+    for (int j = 0; j <= csp_prof_table_len; j++) {
+        csp_prof_entry_t *entry = j < csp_prof_table_len ?
+            &table->entries[j] : NULL;
+        if (entry != NULL ? entry->count == 0 : lost == 0) {
+            continue;
+        }
+        if (n == *cap) {
+            size_t more = *cap > 0 ? *cap * 2 : 256;
+            csp_prof_line_t *grown = (csp_prof_line_t *)realloc(*lines,
+                more * sizeof(csp_prof_line_t));
+            if (grown == NULL) {
+                return -1;
+            }
+            *lines = grown;
+            *cap = more;
+        }
+        size_t len;
+        csp_prof_line_t *line = &(*lines)[n];
+        FILE *f = open_memstream(&line->stack, &len);
+        if (f == NULL) {
+            return -1;
+        }
+        csp_prof_write_worker(f, id);
+        if (entry != NULL) {
+            csp_prof_write_type(f, entry);
+            for (int k = entry->depth - 1; k >= 0; k--) {
+                /* The return addresses are the ones after the calls. */
+                csp_prof_write_frame(f, k > 0 ? entry->pcs[k] - 1 :
+                                     entry->pcs[k]);
+            }
+        } else {
+            fprintf(f, ";(lost)");
+        }
+        if (fclose(f) != 0) {
+            free(line->stack);
+            return -1;
+        }
+        line->count = entry != NULL ? entry->count : lost;
+        n++;
+    }
+    return (ssize_t)n;
+}
+
+/* Write a line of `worker;type;outermost frame;...;innermost frame count` for
+ * every stack, which flamegraph.pl and speedscope read. The stacks differing
+ * in the pcs within the same functions only are merged, and the lost samples
+ * are written as a frame of their own. */
+bool csp_prof_write_folded(FILE *f) {
+    csp_prof_line_t *lines = NULL;
+    size_t n = 0, cap = 0;
+    bool ok = true;
+
+    pthread_mutex_lock(&csp_prof.mutex);
+    csp_prof_table_t **tables = atomic_load(&csp_prof.tables);
+    for (int i = 0; tables != NULL && i < csp_prof.ntables && ok; i++) {
+        csp_prof_table_t *table = csp_prof_snapshot(tables[i]);
+        ssize_t rendered = table != NULL ?
+            csp_prof_render(table, i, &lines, n, &cap) : -1;
+        if (rendered < 0) {
+            ok = false;
+        } else {
+            n = (size_t)rendered;
+        }
+        free(table);
+    }
+    pthread_mutex_unlock(&csp_prof.mutex);
+
+    if (n > 0) {
+        qsort(lines, n, sizeof(csp_prof_line_t), csp_prof_line_cmp);
+    }
+    for (size_t i = 0; i < n;) {
+        size_t j = i;
+        uint64_t count = 0;
+        for (; j < n && strcmp(lines[i].stack, lines[j].stack) == 0; j++) {
+            count += lines[j].count;
+        }
+        if (ok) {
+            fprintf(f, "%s %llu\n", lines[i].stack, (unsigned long long)count);
+        }
+        for (; i < j; i++) {
+            free(lines[i].stack);
+        }
+    }
+    free(lines);
+    return ok && !ferror(f);
+}
+
+/* Write the samples in the legacy cpu profile format of gperftools followed
+ * by the memory map, which pprof symbolizes with the binaries. The workers and
+ * the proc types are only kept in the folded stacks. */
+bool csp_prof_write_pprof(FILE *f) {
+    pthread_mutex_lock(&csp_prof.mutex);
+    int hz = csp_prof.last_hz > 0 ? csp_prof.last_hz : csp_prof_default_hz;
+    uintptr_t header[] = {0, 3, 0, 1000000 / hz, 0};
+    fwrite(header, sizeof(header), 1, f);
+
+    csp_prof_table_t **tables = atomic_load(&csp_prof.tables);
+    bool ok = true;
+    for (int i = 0; tables != NULL && i < csp_prof.ntables && ok; i++) {
+        csp_prof_table_t *table = csp_prof_snapshot(tables[i]);
+        if (table == NULL) {
+            ok = false;
+            break;
+        }
+        for (int j = 0; j < csp_prof_table_len; j++) {
+            csp_prof_entry_t *entry = &table->entries[j];
+            if (entry->count == 0) {
+                continue;
+            }
+            uintptr_t record[] = {entry->count, entry->depth};
+            fwrite(record, sizeof(record), 1, f);
+            fwrite(entry->pcs, sizeof(uintptr_t), entry->depth, f);
+        }
+        free(table);
+    }
+    pthread_mutex_unlock(&csp_prof.mutex);
+
+    uintptr_t trailer[] = {0, 1, 0};
+    fwrite(trailer, sizeof(trailer), 1, f);
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL) {
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), maps)) > 0) {
+            fwrite(buf, 1, n, f);
+        }
+        fclose(maps);
+    } else {
+        ok = false;
+    }
+    return ok && !ferror(f);
+}
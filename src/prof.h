@@ -0,0 +1,24 @@
+#ifndef LIBCSP_PROF_H
+#define LIBCSP_PROF_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The cpu profiler. SIGPROF interrupts the threads `hz` times per second of
+ * the cpu time they consume, and the handler adds the interrupted proc's type
+ * and stack to the table of the worker running it. */
+bool csp_prof_set_rate(int hz);
+int csp_prof_rate(void);
+void csp_prof_reset(void);
+bool csp_prof_write_folded(FILE *f);
+bool csp_prof_write_pprof(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
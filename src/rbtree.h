@@ -389,6 +389,10 @@ csp_rbtree_node_t *csp_rbtree_delete(csp_rbtree_t *tree,
     }
     return ret;
   }
+
+  /* The underflow is propagated to the root, the height of the tree is
+   * decreased by one. */
+  return ret;
 }
 
 /* Get all nodes in the tree in in-order and return the number of nodes. */
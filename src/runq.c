@@ -21,6 +21,82 @@
 
 csp_mmrbq_define(csp_proc_t *, proc);
 
+csp_wrunq_t *csp_wrunq_new(void) {
+  csp_wrunq_t *wrunq = (csp_wrunq_t *)aligned_alloc(64, sizeof(csp_wrunq_t));
+  if (wrunq != NULL) {
+    atomic_init(&wrunq->top, 0);
+    atomic_init(&wrunq->bottom, 0);
+  }
+  return wrunq;
+}
+
+/* Push a process to the bottom. It can only be called by the owner. */
+bool csp_wrunq_try_push(csp_wrunq_t *wrunq, csp_proc_t *proc) {
+  int64_t b = atomic_load_explicit(&wrunq->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&wrunq->top, memory_order_acquire);
+  if (b - t >= csp_wrunq_cap) {
+    return false;
+  }
+  atomic_store_explicit(&wrunq->procs[b & csp_wrunq_mask], proc,
+    memory_order_relaxed
+  );
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&wrunq->bottom, b + 1, memory_order_relaxed);
+  return true;
+}
+
+/* Pop a process from the bottom. It can only be called by the owner. */
+bool csp_wrunq_try_pop(csp_wrunq_t *wrunq, csp_proc_t **proc) {
+  int64_t b = atomic_load_explicit(&wrunq->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&wrunq->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t t = atomic_load_explicit(&wrunq->top, memory_order_relaxed);
+
+  if (t > b) {
+    /* The deque is empty. */
+    atomic_store_explicit(&wrunq->bottom, b + 1, memory_order_relaxed);
+    return false;
+  }
+
+  *proc = atomic_load_explicit(&wrunq->procs[b & csp_wrunq_mask],
+    memory_order_relaxed
+  );
+  if (t < b) {
+    return true;
+  }
+
+  /* It's the last one, race with the thieves for it. */
+  bool won = atomic_compare_exchange_strong_explicit(&wrunq->top, &t, t + 1,
+    memory_order_seq_cst, memory_order_relaxed
+  );
+  atomic_store_explicit(&wrunq->bottom, b + 1, memory_order_relaxed);
+  return won;
+}
+
+/* Steal a process from the top. It can be called by any thread. */
+int csp_wrunq_try_steal(csp_wrunq_t *wrunq, csp_proc_t **proc) {
+  int64_t t = atomic_load_explicit(&wrunq->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t b = atomic_load_explicit(&wrunq->bottom, memory_order_acquire);
+  if (t >= b) {
+    return csp_wrunq_failed;
+  }
+
+  csp_proc_t *stolen = atomic_load_explicit(
+    &wrunq->procs[t & csp_wrunq_mask], memory_order_relaxed
+  );
+  if (!atomic_compare_exchange_strong_explicit(&wrunq->top, &t, t + 1,
+      memory_order_seq_cst, memory_order_relaxed)) {
+    return csp_wrunq_missed;
+  }
+  *proc = stolen;
+  return csp_wrunq_ok;
+}
+
+void csp_wrunq_destroy(csp_wrunq_t *wrunq) {
+  free(wrunq);
+}
+
 csp_lrunq_t *csp_lrunq_new() {
   csp_lrunq_t *lrunq = (csp_lrunq_t *)malloc(sizeof(csp_lrunq_t));
   if (lrunq != NULL) {
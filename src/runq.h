@@ -37,6 +37,18 @@ typedef struct csp_proc_s csp_proc_t;
 #define csp_grunq_try_pop    csp_mmrbq_try_pop(proc)
 #define csp_grunq_destroy    csp_mmrbq_destroy(proc)
 
+#define csp_wrunq_cap_exp    8
+#define csp_wrunq_cap        (1 << csp_wrunq_cap_exp)
+#define csp_wrunq_mask       (csp_wrunq_cap - 1)
+#define csp_wrunq_ok         0
+#define csp_wrunq_failed     -1
+#define csp_wrunq_missed     1
+#define csp_wrunq_len(wrunq) ({                                                \
+  int64_t len_ = atomic_load_explicit(&(wrunq)->bottom, memory_order_relaxed) \
+    - atomic_load_explicit(&(wrunq)->top, memory_order_relaxed);               \
+  len_ > 0 ? (size_t)len_ : 0;                                                 \
+})
+
 #define csp_lrunq_ok         0
 #define csp_lrunq_failed     -1
 #define csp_lrunq_missed     1
@@ -55,6 +67,24 @@ typedef struct {
   int64_t poped_times;
 } csp_lrunq_t;
 
+/*
+ * `csp_wrunq_t` is a bounded Chase-Lev work-stealing deque owned by a worker.
+ * Only the owner pushes and pops at the bottom, other workers steal from the
+ * top. See "Correct and Efficient Work-Stealing for Weak Memory Models" (Le et
+ * al., PPoPP 2013) for the memory ordering.
+ */
+typedef struct {
+  _Alignas(64) atomic_int_fast64_t top;
+  _Alignas(64) atomic_int_fast64_t bottom;
+  _Alignas(64) csp_proc_t *_Atomic procs[csp_wrunq_cap];
+} csp_wrunq_t;
+
+csp_wrunq_t *csp_wrunq_new(void);
+bool csp_wrunq_try_push(csp_wrunq_t *wrunq, csp_proc_t *proc);
+bool csp_wrunq_try_pop(csp_wrunq_t *wrunq, csp_proc_t **proc);
+int csp_wrunq_try_steal(csp_wrunq_t *wrunq, csp_proc_t **proc);
+void csp_wrunq_destroy(csp_wrunq_t *wrunq);
+
 csp_lrunq_t *csp_lrunq_new();
 void csp_lrunq_push(csp_lrunq_t *lrunq, csp_proc_t *proc);
 void csp_lrunq_push_front(csp_lrunq_t *lrunq, csp_proc_t *proc);
@@ -1,22 +1,464 @@
 #include "runtime.h"
+#include "corepool.h"
+#include "prof.h"
 #include "scheduler.h"
+#include "timer.h"
+#include "trace.h"
+#include "worker.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern int64_t csp_core_pools_nprocs(void);
+extern void csp_mem_stats(size_t *mapped, size_t *released, size_t *scavenged);
+extern void csp_mem_set_scavenge_age(int64_t nanoseconds);
+extern int64_t csp_mem_scavenge_age(void);
+extern void csp_mem_set_target_rss(size_t bytes);
+
+static const struct {
+    const char *name, *help;
+} runtime_stats_metrics[csp_stats_num] = {
+    [csp_stats_dispatches] = {"dispatches", "Procs dispatched."},
+    [csp_stats_switches] = {"context_switches",
+        "Switches from the procs to the scheduler loop or to another proc."},
+    [csp_stats_steal_attempts] = {"steal_attempts",
+        "Workers tried to steal procs from."},
+    [csp_stats_steals] = {"steals", "Procs stolen from the other workers."},
+    [csp_stats_parks] = {"parks", "Times the worker went to sleep."},
+    [csp_stats_unparks] = {"unparks", "Times the worker was woken up."},
+    [csp_stats_preemptions] = {"preemptions", "Procs preempted."},
+    [csp_stats_global_pushes] = {"global_runq_pushes",
+        "Procs pushed to the global runqs."},
+    [csp_stats_global_pops] = {"global_runq_pops",
+        "Procs popped from the global runqs."},
+    [csp_stats_chan_blocks] = {"chan_blocks", "Procs blocked on channels."},
+    [csp_stats_netpoll_wakes] = {"netpoll_wakes",
+        "Procs woken up by the netpoll."},
+    [csp_stats_timer_fires] = {"timer_fires", "Procs woken up by timers."},
+};
 
 int runtime_num_goroutines() {
-    return csp_global_scheduler ? atomic_load(&csp_global_scheduler->num_procs) : 0;
+    return csp_global_scheduler ? (int)(csp_core_pools_nprocs() +
+        atomic_load(&csp_global_scheduler->num_procs)) : 0;
 }
 
 int runtime_num_workers() {
     return csp_global_scheduler ? csp_global_scheduler->num_workers : 0;
 }
 
+int runtime_num_active_workers() {
+    return csp_global_scheduler ?
+        atomic_load(&csp_global_scheduler->nactive) : 0;
+}
+
+typedef struct {
+    uintptr_t proc;
+    void *func, *wait_on;
+    int64_t wait_since;
+    int32_t site, state;
+    size_t core;
+} runtime_proc_t;
+
+/* What a proc is doing, the ones after `blocked` are the reasons it blocks. */
+enum {
+    runtime_proc_new,
+    runtime_proc_running,
+    runtime_proc_runnable,
+    runtime_proc_syscall,
+    runtime_proc_waiting,
+    runtime_proc_blocked,
+};
+
+static const char *runtime_proc_states[] = {
+    "new", "running", "runnable", "syscall", "wait",
+    [runtime_proc_blocked + csp_trace_reason_chan] = "chan wait",
+    [runtime_proc_blocked + csp_trace_reason_mutex] = "mutex wait",
+    [runtime_proc_blocked + csp_trace_reason_waitgroup] = "waitgroup wait",
+    [runtime_proc_blocked + csp_trace_reason_netpoll] = "netpoll wait",
+    [runtime_proc_blocked + csp_trace_reason_timer] = "sleep",
+    [runtime_proc_blocked + csp_trace_reason_syscall] = "syscall",
+};
+
+static int runtime_proc_state(csp_proc_t *proc) {
+    switch (csp_proc_stat_get(proc)) {
+    case csp_proc_stat_running:
+        return proc->wait_reason == csp_trace_reason_syscall ?
+            runtime_proc_syscall : runtime_proc_running;
+    case csp_proc_stat_runnable:
+    case csp_proc_stat_netpoll_avail:
+    case csp_proc_stat_netpoll_timeout:
+        return runtime_proc_runnable;
+    case csp_proc_stat_blocked:
+    case csp_proc_stat_netpoll_waiting:
+        if (proc->wait_reason >= 0 &&
+            proc->wait_reason <= csp_trace_reason_syscall) {
+            return runtime_proc_blocked + proc->wait_reason;
+        }
+        return runtime_proc_waiting;
+    default:
+        return proc->wait_reason == csp_trace_reason_timer ?
+            runtime_proc_blocked + csp_trace_reason_timer : runtime_proc_new;
+    }
+}
+
+/* Copy the states of the live procs out of the registries of the cores, each
+ * of which is locked only while it's copied. */
+static runtime_proc_t *runtime_procs_snapshot(size_t *len) {
+    runtime_proc_t *procs = NULL;
+    size_t cap = 0, n = 0;
+
+    for (size_t i = 0; i < csp_core_pools.len; i++) {
+        csp_core_pool_t *pool = csp_core_pools.pools[i];
+        for (size_t j = 0; j < pool->cap; j++) {
+            csp_core_t *core = pool->all[j];
+            while (true) {
+                size_t num = 0;
+                csp_scheduler_nopreempt++;
+                csp_soft_mbarr();
+                csp_mutex_lock(&core->live_lock);
+                for (csp_proc_t *p = core->live_procs; p != NULL;
+                     p = p->live_next) {
+                    num++;
+                }
+                bool fits = n + num <= cap;
+                for (csp_proc_t *p = core->live_procs; fits && p != NULL;
+                     p = p->live_next) {
+                    procs[n++] = (runtime_proc_t){
+                        .proc = (uintptr_t)p, .func = p->func,
+                        .wait_on = p->wait_on, .wait_since = p->wait_since,
+                        .site = p->site, .state = runtime_proc_state(p),
+                        .core = core->pid,
+                    };
+                }
+                csp_mutex_unlock(&core->live_lock);
+                csp_soft_mbarr();
+                csp_scheduler_nopreempt--;
+                if (fits) break;
+
+                /* Grow it out of the lock and copy the core again. */
+                runtime_proc_t *grown = (runtime_proc_t *)realloc(procs,
+                    (cap = 2 * (n + num)) * sizeof(runtime_proc_t));
+                if (grown == NULL) {
+                    *len = n;
+                    return procs;
+                }
+                procs = grown;
+            }
+        }
+    }
+    *len = n;
+    return procs;
+}
+
+static int runtime_procs_cmp(const void *a, const void *b) {
+    const runtime_proc_t *x = (const runtime_proc_t *)a;
+    const runtime_proc_t *y = (const runtime_proc_t *)b;
+    if (x->site != y->site) return x->site < y->site ? -1 : 1;
+    if (x->func != y->func) return x->func < y->func ? -1 : 1;
+    if (x->state != y->state) return x->state < y->state ? -1 : 1;
+    return x->wait_since < y->wait_since ? -1 : x->wait_since > y->wait_since;
+}
+
+static void runtime_print_duration(FILE *f, int64_t nanoseconds) {
+    if (nanoseconds < csp_timer_second) {
+        fprintf(f, "%lldms", (long long)(nanoseconds / csp_timer_millisecond));
+    } else if (nanoseconds < csp_timer_minute) {
+        fprintf(f, "%.1fs", (double)nanoseconds / csp_timer_second);
+    } else {
+        fprintf(f, "%lld minutes", (long long)(nanoseconds / csp_timer_minute));
+    }
+}
+
+/* The procs are grouped by the site, the function and the state, the groups
+ * are printed with the longest wait of them. `each` prints every proc too. */
+static void runtime_procs_print(FILE *f, bool each) {
+    size_t len = 0;
+    runtime_proc_t *procs = runtime_procs_snapshot(&len);
+    int64_t now = csp_timer_now();
+
+    qsort(procs, len, sizeof(runtime_proc_t), runtime_procs_cmp);
+    fprintf(f, "  Procs:      %zu live\n", len);
+    for (size_t i = 0, j; i < len; i = j) {
+        for (j = i + 1; j < len && procs[j].site == procs[i].site &&
+             procs[j].func == procs[i].func &&
+             procs[j].state == procs[i].state; j++);
+        fprintf(f, "    %zu %s, site %d, func %p", j - i,
+                runtime_proc_states[procs[i].state], procs[i].site,
+                procs[i].func);
+        if (procs[i].state >= runtime_proc_blocked) {
+            fprintf(f, ", longest ");
+            runtime_print_duration(f, now - procs[i].wait_since);
+        }
+        fprintf(f, "\n");
+    }
+    if (!each) {
+        free(procs);
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        runtime_proc_t *p = &procs[i];
+        fprintf(f, "\nproc %#lx [%s", (unsigned long)p->proc,
+                runtime_proc_states[p->state]);
+        if (p->state >= runtime_proc_blocked) {
+            if (p->state == runtime_proc_blocked + csp_trace_reason_netpoll) {
+                fprintf(f, " on fd %d", (int)(intptr_t)p->wait_on);
+            } else if (p->wait_on != NULL) {
+                fprintf(f, " on %p", p->wait_on);
+            }
+            fprintf(f, ", ");
+            runtime_print_duration(f, now - p->wait_since);
+        }
+        fprintf(f, "]:\n  site %d, func %p, spawned on core %zu\n", p->site,
+                p->func, p->core);
+    }
+    free(procs);
+}
+
+void runtime_dump_procs(int fd) {
+    int copy = dup(fd);
+    FILE *f = copy >= 0 ? fdopen(copy, "w") : NULL;
+    if (f == NULL) {
+        if (copy >= 0) close(copy);
+        return;
+    }
+    fprintf(f, "Runtime Procs:\n");
+    runtime_procs_print(f, true);
+    fclose(f);
+}
+
 void runtime_dump() {
     printf("Runtime Stats:\n");
     printf("  Goroutines: %d\n", runtime_num_goroutines());
-    printf("  Workers:    %d\n", runtime_num_workers());
+    printf("  Workers:    %d/%d active\n", runtime_num_active_workers(),
+           runtime_num_workers());
+    if (csp_global_scheduler) {
+        printf("  Scaling:    %llu grows, %llu shrinks\n",
+               (unsigned long long)atomic_load(&csp_global_scheduler->ngrows),
+               (unsigned long long)atomic_load(&csp_global_scheduler->nshrinks));
+        printf("  Handoffs:   %llu\n",
+               (unsigned long long)atomic_load(&csp_global_scheduler->nhandoffs));
+        runtime_latency_t latency;
+        runtime_sched_latency(&latency);
+        printf("  Latency:    p50 %lldus, p99 %lldus, p999 %lldus, max %lldus\n",
+               (long long)latency.p50 / 1000, (long long)latency.p99 / 1000,
+               (long long)latency.p999 / 1000, (long long)latency.max / 1000);
+    }
+    printf("  Quantum:    %lldus\n", (long long)runtime_preempt_quantum() / 1000);
+    fflush(stdout);
+    runtime_procs_print(stdout, false);
+    fflush(stdout);
+}
+
+void runtime_sched_latency(runtime_latency_t *latency) {
+    *latency = (runtime_latency_t){0};
+    if (!csp_global_scheduler) return;
+
+    csp_hist_t *hist = (csp_hist_t *)calloc(1, sizeof(csp_hist_t));
+    if (hist == NULL) return;
+    for (int i = 0; i < csp_global_scheduler->num_workers; i++) {
+        csp_hist_merge(hist, &csp_global_scheduler->workers[i]->latency);
+    }
+    latency->count = csp_hist_count(hist);
+    if (latency->count > 0) {
+        latency->mean = atomic_load(&hist->sum) / (int64_t)latency->count;
+    }
+    latency->p50 = csp_hist_quantile(hist, 0.5);
+    latency->p99 = csp_hist_quantile(hist, 0.99);
+    latency->p999 = csp_hist_quantile(hist, 0.999);
+    latency->max = atomic_load(&hist->max);
+    free(hist);
+}
+
+void runtime_sched_latency_reset() {
+    if (!csp_global_scheduler) return;
+    for (int i = 0; i < csp_global_scheduler->num_workers; i++) {
+        csp_hist_reset(&csp_global_scheduler->workers[i]->latency);
+    }
+}
+
+static void runtime_metrics_print(FILE *f) {
+    csp_scheduler_t *s = csp_global_scheduler;
+
+    fprintf(f, "# HELP libcsp_goroutines Procs alive.\n"
+            "# TYPE libcsp_goroutines gauge\nlibcsp_goroutines %d\n",
+            runtime_num_goroutines());
+    fprintf(f, "# HELP libcsp_workers Workers allowed to run procs.\n"
+            "# TYPE libcsp_workers gauge\nlibcsp_workers{state=\"active\"} %d\n"
+            "libcsp_workers{state=\"total\"} %d\n",
+            runtime_num_active_workers(), runtime_num_workers());
+
+    runtime_mem_stats_t mem;
+    runtime_mem_stats(&mem);
+    fprintf(f, "# HELP libcsp_heap_bytes Memory of the heaps.\n"
+            "# TYPE libcsp_heap_bytes gauge\n"
+            "libcsp_heap_bytes{state=\"resident\"} %llu\n"
+            "libcsp_heap_bytes{state=\"released\"} %llu\n",
+            (unsigned long long)(mem.mapped - mem.released),
+            (unsigned long long)mem.released);
+    fprintf(f, "# HELP libcsp_heap_scavenged_bytes_total Memory of the heaps "
+            "returned to the OS.\n"
+            "# TYPE libcsp_heap_scavenged_bytes_total counter\n"
+            "libcsp_heap_scavenged_bytes_total %llu\n",
+            (unsigned long long)mem.scavenged);
+    if (s == NULL) return;
+
+    /* The counters of the threads without workers are labeled as "none". */
+    for (int type = 0; type < csp_stats_num; type++) {
+        fprintf(f, "# HELP libcsp_%s_total %s\n# TYPE libcsp_%s_total counter\n",
+                runtime_stats_metrics[type].name,
+                runtime_stats_metrics[type].help,
+                runtime_stats_metrics[type].name);
+        for (int i = 0; i <= s->num_workers; i++) {
+            csp_stats_t *stats = i < s->num_workers ?
+                &s->workers[i]->stats : &s->stats;
+            char worker[16] = "none";
+            if (i < s->num_workers) {
+                snprintf(worker, sizeof(worker), "%d", i);
+            }
+            fprintf(f, "libcsp_%s_total{worker=\"%s\"} %llu\n",
+                    runtime_stats_metrics[type].name, worker,
+                    (unsigned long long)atomic_load_explicit(
+                        &stats->counts[type], memory_order_relaxed));
+        }
+    }
+
+    fprintf(f, "# HELP libcsp_worker_scales_total Times the active workers "
+            "grew or shrank.\n# TYPE libcsp_worker_scales_total counter\n"
+            "libcsp_worker_scales_total{direction=\"grow\"} %llu\n"
+            "libcsp_worker_scales_total{direction=\"shrink\"} %llu\n",
+            (unsigned long long)atomic_load(&s->ngrows),
+            (unsigned long long)atomic_load(&s->nshrinks));
+    fprintf(f, "# HELP libcsp_handoffs_total Workers handed off by blocked "
+            "threads.\n# TYPE libcsp_handoffs_total counter\n"
+            "libcsp_handoffs_total %llu\n",
+            (unsigned long long)atomic_load(&s->nhandoffs));
+
+    runtime_latency_t latency;
+    runtime_sched_latency(&latency);
+    fprintf(f, "# HELP libcsp_sched_latency_seconds Time the sampled procs "
+            "waited from getting runnable to running.\n"
+            "# TYPE libcsp_sched_latency_seconds summary\n"
+            "libcsp_sched_latency_seconds{quantile=\"0.5\"} %.9f\n"
+            "libcsp_sched_latency_seconds{quantile=\"0.99\"} %.9f\n"
+            "libcsp_sched_latency_seconds{quantile=\"0.999\"} %.9f\n"
+            "libcsp_sched_latency_seconds_sum %.9f\n"
+            "libcsp_sched_latency_seconds_count %llu\n",
+            latency.p50 / 1e9, latency.p99 / 1e9, latency.p999 / 1e9,
+            (double)latency.mean * latency.count / 1e9,
+            (unsigned long long)latency.count);
+}
+
+size_t runtime_metrics_write(char *buf, size_t len) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&text, &size);
+    if (f == NULL) return 0;
+    runtime_metrics_print(f);
+    fclose(f);
+
+    if (len > 0) {
+        size_t n = size < len ? size : len - 1;
+        memcpy(buf, text, n);
+        buf[n] = '\0';
+    }
+    free(text);
+    return size;
+}
+
+bool runtime_metrics_write_fd(int fd) {
+    char *text = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&text, &size);
+    if (f == NULL) return false;
+    runtime_metrics_print(f);
+    fclose(f);
+
+    bool ok = true;
+    for (size_t off = 0; off < size;) {
+        ssize_t n = write(fd, text + off, size - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ok = false;
+            break;
+        }
+        off += n;
+    }
+    free(text);
+    return ok;
+}
+
+void runtime_mem_stats(runtime_mem_stats_t *stats) {
+    size_t mapped, released, scavenged;
+    csp_mem_stats(&mapped, &released, &scavenged);
+    stats->mapped = mapped;
+    stats->released = released;
+    stats->scavenged = scavenged;
+}
+
+void runtime_set_scavenge_age(int64_t nanoseconds) {
+    csp_mem_set_scavenge_age(nanoseconds);
+}
+
+int64_t runtime_scavenge_age() {
+    return csp_mem_scavenge_age();
+}
+
+void runtime_set_target_rss(size_t bytes) {
+    csp_mem_set_target_rss(bytes);
+}
+
+void runtime_set_preempt_quantum(int64_t nanoseconds) {
+    if (csp_global_scheduler) csp_scheduler_set_preempt_quantum(nanoseconds);
+}
+
+int64_t runtime_preempt_quantum() {
+    return csp_global_scheduler ?
+        atomic_load(&csp_global_scheduler->preempt_quantum) : 0;
 }
 
 void runtime_trace_enable(bool enable) {
-    // Placeholder
+    csp_trace_enable(enable);
+}
+
+bool runtime_trace_dump(const char *path) {
+    return csp_trace_dump(path);
+}
+
+bool runtime_trace_start(const char *path) {
+    return csp_trace_start(path);
+}
+
+bool runtime_prof_set_rate(int hz) {
+    return csp_prof_set_rate(hz);
+}
+
+int runtime_prof_rate() {
+    return csp_prof_rate();
+}
+
+void runtime_prof_reset() {
+    csp_prof_reset();
+}
+
+static bool runtime_prof_write(int fd, bool (*write)(FILE *f)) {
+    int copy = dup(fd);
+    FILE *f = copy >= 0 ? fdopen(copy, "w") : NULL;
+    if (f == NULL) {
+        if (copy >= 0) close(copy);
+        return false;
+    }
+    bool ok = write(f);
+    return fclose(f) == 0 && ok;
+}
+
+bool runtime_prof_write_folded(int fd) {
+    return runtime_prof_write(fd, csp_prof_write_folded);
+}
+
+bool runtime_prof_write_pprof(int fd) {
+    return runtime_prof_write(fd, csp_prof_write_pprof);
 }
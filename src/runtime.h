@@ -2,6 +2,8 @@
 #define LIBCSP_RUNTIME_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,8 +11,86 @@ extern "C" {
 
 int runtime_num_goroutines();
 int runtime_num_workers();
+/* The workers allowed to run procs, it shrinks when they stay idle and grows
+ * back under sustained backlog up to runtime_num_workers(). */
+int runtime_num_active_workers();
+/* Print the stats of the runtime, and the live procs grouped by where they
+ * were spawned and what they are doing. */
 void runtime_dump();
+/* Print every live proc to `fd`: what it's doing, what it's blocked on and for
+ * how long, where it was spawned. It's done on SIGQUIT too unless the program
+ * handles the signal itself. */
+void runtime_dump_procs(int fd);
+
+/* The nanoseconds procs waited from getting runnable to running, merged from
+ * the histograms of all the workers. One in 8 of the waits is sampled and the
+ * percentiles are within 1/16 of the sampled values. */
+typedef struct {
+    uint64_t count;
+    int64_t mean, p50, p99, p999, max;
+} runtime_latency_t;
+void runtime_sched_latency(runtime_latency_t *latency);
+/* Start the latency histograms over, e.g. at the start of every scrape
+ * interval. */
+void runtime_sched_latency_reset();
+
+/* Render the counters of every worker(dispatches, switches, steals, parks,
+ * preemptions, global runq pushes and pops, channel blocks, netpoll wakes and
+ * timer fires), the gauges and the latencies above in the Prometheus text
+ * format. It's written to `buf` like snprintf() does and the length of the
+ * whole text is returned. */
+size_t runtime_metrics_write(char *buf, size_t len);
+/* Write the metrics to `fd`, e.g. the connection of a scraper. */
+bool runtime_metrics_write_fd(int fd);
+
+/* Record the scheduler events(spawn, run, block, steal, park...) into a ring
+ * of every thread, the last 64K events of each are kept. */
 void runtime_trace_enable(bool enable);
+/* Write the events recorded since the last dump to `path` as a Chrome trace,
+ * which chrome://tracing and ui.perfetto.dev open. */
+bool runtime_trace_dump(const char *path);
+/* Enable tracing and append the events to `path` every 100ms until it's
+ * disabled, which LIBCSP_TRACE=path does at the start too. */
+bool runtime_trace_start(const char *path);
+
+/* Sample the running procs `hz` times per second of the cpu time consumed by
+ * the process, 0 stops sampling. It can be changed at any time, e.g. to profile
+ * the live traffic for a while. The samples are aggregated per worker by the
+ * proc type and the stack until they are reset. The stacks are walked by the
+ * frame pointers, so the code built without them only shows the functions
+ * interrupted. */
+bool runtime_prof_set_rate(int hz);
+int runtime_prof_rate();
+void runtime_prof_reset();
+/* Write the samples to `fd` as folded stacks, one line of
+ * `worker;proc type;outermost frame;...;innermost frame count` per stack,
+ * which flamegraph.pl and speedscope read. */
+bool runtime_prof_write_folded(int fd);
+/* Write the samples to `fd` as a legacy cpu profile of gperftools, which
+ * `pprof <binary> <profile>` reads. */
+bool runtime_prof_write_pprof(int fd);
+
+/* The bytes mapped for the heaps of the procs and the runtime objects, the
+ * ones of them returned to the OS or never touched, and the ones returned by
+ * the scavenger so far. The heaps take about `mapped - released` bytes of the
+ * RSS. */
+typedef struct {
+    uint64_t mapped, released, scavenged;
+} runtime_mem_stats_t;
+void runtime_mem_stats(runtime_mem_stats_t *stats);
+/* The monitor returns the memory free for `nanoseconds` to the OS about every
+ * second, a negative value restores the default 1 minute. The pages are zeroed
+ * on the next touch. */
+void runtime_set_scavenge_age(int64_t nanoseconds);
+int64_t runtime_scavenge_age();
+/* Return the free memory to the OS regardless of how long it has been free
+ * while the heaps take more than `bytes` of the RSS, 0 disables it. */
+void runtime_set_target_rss(size_t bytes);
+
+/* Set how many nanoseconds a proc can run before it is preempted when
+ * LIBCSP_PREEMPT is set, a non-positive value restores the default 10ms. */
+void runtime_set_preempt_quantum(int64_t nanoseconds);
+int64_t runtime_preempt_quantum();
 
 #ifdef __cplusplus
 }
@@ -27,6 +27,10 @@
 #include "csp_sched.h"
 #include "timer.h"
 #include "scheduler.h"
+#include "topology.h"
+#include "trace.h"
+#include "proc_extra.h"
+#include "worker.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -47,6 +51,8 @@ extern bool csp_core_pools_init(void);
 extern bool csp_core_pools_get(size_t pid, csp_core_t **core);
 extern void csp_core_pools_destroy(void);
 extern void csp_core_yield(csp_proc_t *proc, void *anchor);
+extern void csp_core_switch_to(csp_proc_t *from, csp_proc_t *to,
+  pthread_mutex_t *lock, void *anchor);
 extern bool csp_monitor_init(void);
 extern bool csp_netpoll_init(void);
 extern bool csp_timer_heaps_init(void);
@@ -74,20 +80,31 @@ __attribute__((constructor)) static void csp_sched_start() {
   csp_sched_starving_threads = csp_mmrbq_new(core)(csp_exp(csp_sched_np));
   csp_sched_starving_procs = csp_mmrbq_new(core)(csp_exp(csp_sched_np));
 
+  if (!csp_topology_init(csp_sched_np)) {
+    exit(EXIT_FAILURE);
+  }
   csp_core_pools_init();
 #ifndef csp_with_sysmalloc
-  csp_mem_init();
+  if (!csp_mem_init()) {
+    exit(EXIT_FAILURE);
+  }
 #endif
   csp_netpoll_init();
   csp_timer_heaps_init();
   csp_monitor_init();
 
+  const char *trace = getenv("LIBCSP_TRACE");
+  if (trace != NULL && !csp_trace_start(trace)) {
+    perror("Failed to start tracing.");
+  }
+
   if (getenv("LIBCSP_PRODUCTION")) {
       use_new_scheduler = true;
       csp_core_t *main_core;
       csp_core_pools_get(0, &main_core);
       csp_core_init_main(main_core);
-      csp_scheduler_init(csp_sched_np);
+      csp_scheduler_init((size_t)csp_sched_np < csp_max_threads ?
+        csp_sched_np : (int)csp_max_threads);
       return;
   }
 
@@ -116,23 +133,71 @@ csp_proc_t *csp_sched_put_timer(csp_proc_t *proc) {
   return proc;
 }
 
+/* Hand the procs of `from` over to the spare core `to` before the thread of
+ * `from` blocks, the running proc can't be preempted until it's unblocked. */
+bool csp_sched_handoff(csp_core_t *from, csp_core_t *to) {
+  if (use_new_scheduler) {
+    if (!csp_scheduler_handoff(from, to)) {
+      return false;
+    }
+    csp_scheduler_nopreempt++;
+    return true;
+  }
+  /* The cores of the same cpu share the runqs. */
+  return true;
+}
+
+/* Put the proc blocked the thread of `this_core` back to the scheduler. */
+void csp_sched_unblock(csp_core_t *this_core, csp_proc_t *proc) {
+  csp_trace(csp_trace_unblock, proc, 0);
+  proc->wait_reason = -1;
+  if (use_new_scheduler) {
+    proc->nopreempt = csp_scheduler_nopreempt - 1;
+    csp_scheduler_nopreempt = 0;
+    csp_scheduler_preempt_deferred = false;
+    this_core->worker = NULL;
+    atomic_store(&this_core->worker_state, csp_core_worker_owned);
+    csp_scheduler_submit_global(proc);
+    return;
+  }
+  while (!csp_grunq_try_push(this_core->grunq, proc));
+}
+
 csp_proc_t *csp_sched_get(csp_core_t *this_core) {
   if (use_new_scheduler) {
+      csp_worker_stats_add(csp_stats_switches, 1);
       csp_proc_t *old = (csp_proc_t *)this_core->running;
+      if (old) {
+          old->nopreempt = csp_scheduler_nopreempt;
+      }
+      csp_scheduler_nopreempt = 0;
+      csp_scheduler_preempt_deferred = false;
       if (old && csp_proc_stat_get(old) == csp_proc_stat_running) {
-          csp_scheduler_submit(old);
+          csp_scheduler_submit_global(old);
       }
 
-      while (true) {
-          csp_proc_t *p = csp_scheduler_get_work(this_core->pid);
-          if (p) return p;
-
-          pthread_mutex_lock(&csp_global_scheduler->lock);
-          csp_global_scheduler->idle_workers++;
-          pthread_cond_wait(&csp_global_scheduler->cond, &csp_global_scheduler->lock);
-          csp_global_scheduler->idle_workers--;
-          pthread_mutex_unlock(&csp_global_scheduler->lock);
+      /* The worker was handed off by the sysmon while the thread was blocked,
+       * park until another one is handed to this core. */
+      csp_core_worker_state_t owned = csp_core_worker_owned;
+      while (!atomic_compare_exchange_strong(&this_core->worker_state, &owned,
+                                             csp_core_worker_using)) {
+          this_core->worker = NULL;
+          atomic_store(&this_core->worker_state, csp_core_worker_owned);
+          csp_core_park(this_core);
+          owned = csp_core_worker_owned;
+      }
+      csp_worker_t *w = (csp_worker_t *)this_core->worker;
+      if (w != NULL &&
+          atomic_load(&w->preempt_requested) != &csp_sched_preempt_requested) {
+          csp_worker_adopt(w);
       }
+      csp_proc_t *proc = csp_scheduler_wait_work(this_core->pid);
+      atomic_store_explicit(&this_core->worker_state, csp_core_worker_owned,
+                            memory_order_release);
+      csp_scheduler_nopreempt = proc->nopreempt;
+      proc->nopreempt = 0;
+      csp_trace(csp_trace_run, proc, 0);
+      return proc;
   }
 
   int pid, code;
@@ -165,6 +230,7 @@ csp_proc_t *csp_sched_get(csp_core_t *this_core) {
   }
 
 found:
+  csp_trace(csp_trace_run, proc, 0);
   if (running != NULL && csp_proc_nchild_get(running) == 0) {
     csp_lrunq_push(this_core->lrunq, running);
   }
@@ -184,13 +250,73 @@ found:
 
 void csp_sched_yield(void) {
   csp_core_t *this_core = csp_this_core;
+  csp_trace(csp_trace_yield, this_core->running, 0);
   csp_core_yield((csp_proc_t *)this_core->running, &this_core->anchor);
 }
 
+/* Yield the running proc on behalf of the scheduler. */
+void csp_sched_preempt(void) {
+  csp_core_t *this_core = csp_this_core;
+  csp_trace(csp_trace_preempt, this_core->running, 0);
+  csp_worker_stats_add(csp_stats_preemptions, 1);
+  csp_core_yield((csp_proc_t *)this_core->running, &this_core->anchor);
+}
+
+/* Block the running proc on a wait queue of `on` guarded by `lock`, which is
+ * held by the caller and released once the proc is switched out. The proc it
+ * just woke up is switched to directly if there is one. `reason` is the one of
+ * csp_trace_block. */
+void csp_sched_park(pthread_mutex_t *lock, void *on, int reason) {
+  csp_core_t *this_core = csp_this_core;
+  csp_proc_t *from = (csp_proc_t *)this_core->running, *to = NULL;
+
+  csp_trace(csp_trace_block, from, reason);
+  csp_proc_wait_set(from, on, reason);
+
+  if (use_new_scheduler) {
+    to = csp_scheduler_get_next();
+    from->nopreempt = csp_scheduler_nopreempt;
+    csp_scheduler_nopreempt = 0;
+    csp_scheduler_preempt_deferred = false;
+    if (to != NULL) {
+      csp_scheduler_nopreempt = to->nopreempt;
+      to->nopreempt = 0;
+    }
+  }
+  /* `from` may run on another thread as soon as the lock is released, so the
+   * core must not put it back to the scheduler. Switching to the scheduler loop
+   * is counted by csp_sched_get(). */
+  if (to != NULL) {
+    csp_trace(csp_trace_run, to, 0);
+    csp_worker_stats_add(csp_stats_switches, 1);
+  }
+  this_core->running = (struct csp_proc_s *)to;
+  csp_core_switch_to(from, to, lock, &this_core->anchor);
+}
+
+_Thread_local atomic_int csp_sched_preempt_requested = 0;
+
+/* Called by the safepoints in the user code once the preemption of the running
+ * proc is requested. */
+void csp_sched_safepoint(void) {
+  atomic_store_explicit(&csp_sched_preempt_requested, 0, memory_order_relaxed);
+  csp_core_t *this_core = csp_this_core;
+  if (this_core == NULL || this_core->running == NULL) {
+    return;
+  }
+  if (csp_scheduler_nopreempt > 0) {
+    csp_scheduler_preempt_deferred = true;
+    return;
+  }
+  csp_sched_preempt();
+}
+
 void csp_sched_hangup(uint64_t nanoseconds) {
   if (nanoseconds == 0) return;
   csp_core_t *this_core = csp_this_core;
   csp_proc_t *running = (csp_proc_t *)this_core->running;
+  csp_trace(csp_trace_block, running, csp_trace_reason_timer);
+  csp_proc_wait_set(running, NULL, csp_trace_reason_timer);
   csp_proc_stat_set(running, csp_proc_stat_blocked);
   running->timer.when = csp_timer_now() + nanoseconds;
   csp_timer_put(this_core->pid, running);
@@ -198,5 +324,21 @@ void csp_sched_hangup(uint64_t nanoseconds) {
   csp_core_yield(running, &this_core->anchor);
 }
 
+/* Set the priority class of the procs spawned by the running proc from now on
+ * and return the previous one, an invalid class is ignored. Out of the procs
+ * the spawned ones always take the default class, which is returned. */
+int csp_sched_spawn_prio(int prio) {
+  csp_core_t *this_core = csp_this_core;
+  if (this_core == NULL || this_core->running == NULL) {
+    return csp_proc_prio_normal;
+  }
+  csp_proc_t *running = (csp_proc_t *)this_core->running;
+  int old = running->spawn_prio;
+  if (csp_proc_prio_valid(prio)) {
+    running->spawn_prio = prio;
+  }
+  return old;
+}
+
 __attribute__((noinline)) void csp_sched_proc_anchor(bool need_sync) {}
 __attribute__((noinline)) void csp_shced_atomic_incr(atomic_uint_fast64_t *cnt) {}
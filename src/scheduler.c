@@ -1,16 +1,92 @@
 #define _GNU_SOURCE
 #include "scheduler.h"
+#include "common.h"
+#include "futex.h"
 #include "worker.h"
 #include "core.h"
+#include "csp_sched.h"
 #include "proc.h"
 #include "proc_extra.h"
+#include "timer.h"
+#include "topology.h"
+#include "trace.h"
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <ucontext.h>
 #include <unistd.h>
 
+/* Check the global runq first every this number of dispatches. */
+#define csp_scheduler_global_runq_interval 61
+
+/* The default time slice of a proc, see runtime_set_preempt_quantum(). */
+#define csp_scheduler_default_quantum (10 * csp_timer_millisecond)
+
+/* Bounds of the interval the preempter checks the workers at. */
+#define csp_scheduler_preempter_min_sleep (100 * csp_timer_microsecond)
+#define csp_scheduler_preempter_max_sleep (10 * csp_timer_millisecond)
+
+/* A thief only takes the runnext of a worker whose current proc has been
+ * running for longer than this, otherwise it is about to be dispatched. */
+#define csp_scheduler_runnext_steal_after (50 * csp_timer_microsecond)
+
+/* Where csp_scheduler_push() puts a proc. */
+#define csp_scheduler_to_local  0
+#define csp_scheduler_to_global 1
+#define csp_scheduler_to_next   2
+
+/* Rounds an idle worker looks for work before parking, and the pauses
+ * between two rounds. */
+#define csp_scheduler_spin_rounds 32
+#define csp_scheduler_spin_pauses 64
+
+/* Procs are pushed in chunks of this length by csp_scheduler_submit_batch(). */
+#define csp_scheduler_batch_len 64
+
+/* Times to retry stealing from a victim after losing a race with others. */
+#define csp_scheduler_steal_retries 4
+
+/* One in this many procs put to the runqs is timed for the latency histograms,
+ * reading the clock costs as much as the rest of a submission. */
+#define csp_scheduler_latency_period 8
+
+/* Out of every 16 dispatches a worker looks for the high procs first 12 times,
+ * for the normal ones 3 times and for the low ones once, so that none of the
+ * classes can be starved by the others. */
+#define csp_scheduler_weight_high   12
+#define csp_scheduler_weight_normal 3
+#define csp_scheduler_weight_low    1
+#define csp_scheduler_weight_sum                                               \
+    (csp_scheduler_weight_high + csp_scheduler_weight_normal +                 \
+     csp_scheduler_weight_low)
+
+/* A class having procs queued but none of them dispatched for this long is
+ * looked for first regardless of the weights. */
+#define csp_scheduler_prio_age (20 * csp_timer_millisecond)
+
+/* With high procs queued, a worker running a proc of a lower class for longer
+ * than this is preempted instead of waiting for the quantum. */
+#define csp_scheduler_prio_preempt_after (100 * csp_timer_microsecond)
+
+/* The active workers are shrunk if some of them stay parked for a whole window,
+ * and grown by one each time procs stay queued with all of them busy for
+ * `csp_scheduler_grow_after`. */
+#define csp_scheduler_min_active      1
+#define csp_scheduler_shrink_window   (100 * csp_timer_millisecond)
+#define csp_scheduler_grow_after      (2 * csp_timer_millisecond)
+
+/* Values of `parked` of a worker. */
+#define csp_scheduler_parked_none     0
+#define csp_scheduler_parked_idle     1
+#define csp_scheduler_parked_retired  2
+
+/* A worker whose proc has been running for this long while its thread sleeps
+ * in the kernel is taken as blocked in a syscall by the sysmon. */
+#define csp_scheduler_sysmon_after    (1 * csp_timer_millisecond)
+
 csp_scheduler_t *csp_global_scheduler = NULL;
 
 extern size_t csp_cpu_cores;
@@ -18,53 +94,146 @@ extern size_t csp_procs_num;
 extern size_t csp_procs_size[];
 
 extern csp_proc_t *csp_proc_new(int id, bool waited_by_parent);
-extern void csp_sched_yield(void);
+extern void csp_sched_preempt(void);
 extern void csp_core_proc_exit(void);
+extern bool csp_core_pools_get(size_t pid, csp_core_t **core);
+extern void csp_core_pools_put(csp_core_t *core);
 
 extern void csp_async_preempt(void);
 
+_Thread_local int csp_scheduler_nopreempt = 0;
+_Thread_local bool csp_scheduler_preempt_deferred = false;
+
 static void preemption_handler(int sig, siginfo_t *si, void *uc) {
     ucontext_t *ctx = (ucontext_t *)uc;
     if (!csp_this_core || !csp_this_core->running) return;
 
     csp_proc_t *proc = (csp_proc_t *)csp_this_core->running;
-    if (!proc->extra) return;
-    csp_proc_extra_t *extra = (csp_proc_extra_t *)proc->extra;
+    if (!proc->preemptible) return;
+
+    /* Only the code running on the proc's own stack can be preempted, the
+     * scheduler runs on the anchor stack with `running` not updated yet. */
+    uintptr_t sp = (uintptr_t)ctx->uc_mcontext.gregs[REG_RSP];
+    if (sp <= proc->base || sp >= (uintptr_t)proc) return;
+
+    if (csp_scheduler_nopreempt > 0) {
+        csp_scheduler_preempt_deferred = true;
+        return;
+    }
+
+    greg_t old_rip = ctx->uc_mcontext.gregs[REG_RIP];
+    ctx->uc_mcontext.gregs[REG_RSP] -= 8;
+    *(greg_t *)(ctx->uc_mcontext.gregs[REG_RSP]) = old_rip;
+    ctx->uc_mcontext.gregs[REG_RIP] = (greg_t)csp_async_preempt;
+}
+
+/* Called when leaving the last no-preempt region after a preemption signal
+ * arrived inside it. */
+void csp_scheduler_preempt_deferred_yield(void) {
+    csp_scheduler_preempt_deferred = false;
+    csp_proc_t *proc = csp_this_core ? (csp_proc_t *)csp_this_core->running : NULL;
+    if (proc && proc->preemptible) {
+        csp_sched_preempt();
+    }
+}
 
-    if (extra->preemptible && !extra->in_critical_section) {
-        greg_t old_rip = ctx->uc_mcontext.gregs[REG_RIP];
-        ctx->uc_mcontext.gregs[REG_RSP] -= 8;
-        *(greg_t *)(ctx->uc_mcontext.gregs[REG_RSP]) = old_rip;
-        ctx->uc_mcontext.gregs[REG_RIP] = (greg_t)csp_async_preempt;
+static void csp_scheduler_preempt_worker(csp_worker_t *w) {
+    if (csp_global_scheduler->cooperative_preempt) {
+        atomic_int *requested = atomic_load(&w->preempt_requested);
+        if (requested) atomic_store_explicit(requested, 1, memory_order_relaxed);
+    } else if (w->tid) {
+        pthread_kill(w->tid, SIGALRM);
     }
 }
 
+/* Whether the worker runs a proc of a lower class than high for long enough to
+ * be preempted in favor of the queued high ones. */
+static inline bool csp_scheduler_runs_lower(csp_worker_t *w, int64_t start,
+                                            int64_t now) {
+    return start != 0 && now - start >= csp_scheduler_prio_preempt_after &&
+        atomic_load_explicit(&w->running_prio, memory_order_relaxed) >
+        csp_proc_prio_high;
+}
+
+/* Only the workers whose current time slice is longer than the quantum are
+ * asked to preempt, the short-lived procs are never interrupted unless high
+ * procs are waiting. */
 static void *preempter_loop(void *arg) {
     while (!atomic_load(&csp_global_scheduler->stop_preempter)) {
-        usleep(10000); // 10ms
+        int64_t quantum = atomic_load_explicit(
+            &csp_global_scheduler->preempt_quantum, memory_order_relaxed);
+        int64_t sleep = quantum / 2;
+        if (sleep < csp_scheduler_preempter_min_sleep) {
+            sleep = csp_scheduler_preempter_min_sleep;
+        } else if (sleep > csp_scheduler_preempter_max_sleep) {
+            sleep = csp_scheduler_preempter_max_sleep;
+        }
+        usleep(sleep / csp_timer_microsecond);
+
+        int64_t now = csp_timer_now();
+        bool urgent = atomic_load_explicit(
+            &csp_global_scheduler->nqueued[csp_proc_prio_high],
+            memory_order_relaxed) > 0;
         for (int i = 0; i < csp_global_scheduler->num_workers; i++) {
-            if (csp_global_scheduler->workers[i]->tid) {
-                pthread_kill(csp_global_scheduler->workers[i]->tid, SIGALRM);
+            csp_worker_t *w = csp_global_scheduler->workers[i];
+            int64_t start = atomic_load_explicit(&w->slice_start,
+                                                 memory_order_relaxed);
+            if ((start != 0 && now - start >= quantum) ||
+                (urgent && csp_scheduler_runs_lower(w, start, now))) {
+                csp_scheduler_preempt_worker(w);
             }
         }
     }
     return NULL;
 }
 
+static int steal_order_cmp(const void *a, const void *b, void *arg) {
+    const int *key = (const int *)arg;
+    int x = *(const int *)a, y = *(const int *)b;
+    return key[x] - key[y];
+}
+
+/* Build the victim list of worker `id`, closer workers come first and the
+ * ones at the same distance keep the round robin order after `id`. */
+static void csp_scheduler_build_steal_order(csp_worker_t *w, int n) {
+    w->steal_order = (int *)malloc(sizeof(int) * (n > 1 ? n - 1 : 1));
+    w->steal_dist = (int *)malloc(sizeof(int) * (n > 1 ? n - 1 : 1));
+    int *key = (int *)malloc(sizeof(int) * n);
+    if (w->steal_order == NULL || w->steal_dist == NULL || key == NULL) {
+        perror("libcsp failed to alloc steal order.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 1; i < n; i++) {
+        int j = (w->id + i) % n;
+        w->steal_order[i - 1] = j;
+        key[j] = csp_topology_dist(w->id, j) * n + i;
+    }
+    qsort_r(w->steal_order, n - 1, sizeof(int), steal_order_cmp, key);
+    for (int i = 0; i < n - 1; i++) {
+        w->steal_dist[i] = csp_topology_dist(w->id, w->steal_order[i]);
+    }
+    free(key);
+}
+
 void csp_scheduler_init(int num_workers) {
     if (csp_global_scheduler) return;
 
     csp_global_scheduler = (csp_scheduler_t *)calloc(1, sizeof(csp_scheduler_t));
     csp_global_scheduler->num_workers = num_workers;
     csp_global_scheduler->workers = (csp_worker_t **)calloc(num_workers, sizeof(csp_worker_t *));
-    csp_global_scheduler->global_runq = csp_grunq_new(16); // 2^16
-
-    pthread_mutex_init(&csp_global_scheduler->lock, NULL);
-    pthread_cond_init(&csp_global_scheduler->cond, NULL);
+    for (int i = 0; i < csp_proc_prio_num; i++) {
+        csp_global_scheduler->global_runqs[i] = csp_grunq_new(16); // 2^16
+    }
 
     for (int i = 0; i < num_workers; i++) {
         csp_global_scheduler->workers[i] = csp_worker_new(i);
     }
+    for (int i = 0; i < num_workers; i++) {
+        csp_scheduler_build_steal_order(csp_global_scheduler->workers[i],
+                                        num_workers);
+    }
+    atomic_store(&csp_global_scheduler->nactive, num_workers);
     for (int i = 0; i < num_workers; i++) {
         csp_worker_start(csp_global_scheduler->workers[i]);
     }
@@ -75,80 +244,782 @@ void csp_scheduler_init(int num_workers) {
     sigemptyset(&sa.sa_mask);
     sigaction(SIGALRM, &sa, NULL);
 
+    atomic_store(&csp_global_scheduler->preempt_quantum,
+                 csp_scheduler_default_quantum);
     atomic_store(&csp_global_scheduler->stop_preempter, false);
-    if (getenv("LIBCSP_PREEMPT")) {
+    const char *preempt = getenv("LIBCSP_PREEMPT");
+    if (preempt) {
+        /* LIBCSP_PREEMPT=cooperative relies on the safepoints inserted by the
+         * plugin instead of the signals. */
+        csp_global_scheduler->cooperative_preempt = strcmp(preempt, "cooperative") == 0;
+        csp_global_scheduler->preemptive = true;
         pthread_t preempter;
         pthread_create(&preempter, NULL, preempter_loop, NULL);
         pthread_detach(preempter);
     }
 }
 
-void csp_scheduler_submit(csp_proc_t *proc) {
-    sigset_t mask, oldmask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGALRM);
-    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+/* The worker of the current thread, or NULL if it doesn't own one (e.g. the
+ * main thread, the monitor). It may be handed off at any time. */
+static inline csp_worker_t *csp_scheduler_this_worker(void) {
+    csp_core_t *core = csp_this_core;
+    if (core == NULL) return NULL;
+    csp_worker_t *w = (csp_worker_t *)core->worker;
+    return (w != NULL && atomic_load_explicit(&w->core, memory_order_relaxed) ==
+            core) ? w : NULL;
+}
+
+/* Like csp_scheduler_this_worker() but the runq of the worker can be pushed or
+ * popped, it can't be handed off until csp_scheduler_release_worker(). */
+static inline csp_worker_t *csp_scheduler_acquire_worker(void) {
+    csp_core_t *core = csp_this_core;
+    if (core == NULL || core->worker == NULL) return NULL;
+    csp_core_worker_state_t owned = csp_core_worker_owned;
+    if (!atomic_compare_exchange_strong(&core->worker_state, &owned,
+                                        csp_core_worker_using)) {
+        return NULL;
+    }
+    csp_worker_t *w = (csp_worker_t *)core->worker;
+    if (atomic_load_explicit(&w->core, memory_order_relaxed) != core) {
+        atomic_store(&core->worker_state, csp_core_worker_owned);
+        return NULL;
+    }
+    return w;
+}
+
+static inline void csp_scheduler_release_worker(csp_worker_t *w) {
+    if (w != NULL) {
+        atomic_store_explicit(&csp_this_core->worker_state,
+                              csp_core_worker_owned, memory_order_release);
+    }
+}
+
+static inline int csp_scheduler_nactive(void) {
+    return atomic_load_explicit(&csp_global_scheduler->nactive,
+                                memory_order_relaxed);
+}
+
+static _Thread_local uint32_t csp_scheduler_latency_tick;
 
+/* `now` is read once for all the procs sharing it, it's 0 until then. */
+static inline void csp_scheduler_latency_start(csp_proc_t *proc, int64_t *now) {
+    if (++csp_scheduler_latency_tick % csp_scheduler_latency_period == 0) {
+        if (*now == 0) {
+            *now = csp_timer_now();
+        }
+        proc->runnable_at = *now;
+    }
+}
+
+/* `now` is read before the proc is found, which may be after it's pushed. */
+static inline void csp_scheduler_latency_end(csp_worker_t *w, csp_proc_t *proc,
+                                             int64_t now) {
+    if (proc->runnable_at != 0) {
+        csp_hist_record(&w->latency, now > proc->runnable_at ?
+                        now - proc->runnable_at : 0);
+        proc->runnable_at = 0;
+    }
+}
+
+/* Unpark one of the parked active workers if there is any. */
+static bool csp_scheduler_unpark(void) {
+    for (int i = 0, n = csp_scheduler_nactive(); i < n; i++) {
+        csp_worker_t *w = csp_global_scheduler->workers[i];
+        int one = csp_scheduler_parked_idle;
+        if (atomic_load_explicit(&w->parked, memory_order_relaxed) == one &&
+            atomic_compare_exchange_strong(&w->parked, &one,
+                                           csp_scheduler_parked_none)) {
+            atomic_fetch_sub(&csp_global_scheduler->nidle, 1);
+            csp_trace(csp_trace_unpark, NULL, i);
+            csp_futex_wake(&w->parked, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Wake up a parked worker unless some are spinning already, which will find
+ * the new work on their own. The woken worker is counted as spinning. */
+static void csp_scheduler_wakeup(void) {
+    int zero = 0;
+    if (atomic_load_explicit(&csp_global_scheduler->nspinning,
+                             memory_order_relaxed) != 0 ||
+        atomic_load_explicit(&csp_global_scheduler->nidle,
+                             memory_order_relaxed) == 0 ||
+        !atomic_compare_exchange_strong(&csp_global_scheduler->nspinning,
+                                        &zero, 1)) {
+        return;
+    }
+    if (!csp_scheduler_unpark()) {
+        atomic_fetch_sub(&csp_global_scheduler->nspinning, 1);
+    }
+}
+
+/* Wake up at most `n` parked workers no matter how many are spinning, used
+ * when many procs become runnable at once. */
+static void csp_scheduler_wakeup_n(size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (atomic_load_explicit(&csp_global_scheduler->nidle,
+                                 memory_order_relaxed) == 0) {
+            return;
+        }
+        atomic_fetch_add(&csp_global_scheduler->nspinning, 1);
+        if (!csp_scheduler_unpark()) {
+            atomic_fetch_sub(&csp_global_scheduler->nspinning, 1);
+            return;
+        }
+    }
+}
+
+/* A spinning worker found work, if it was the last one spinning, wake up
+ * another one to take over since there may be more. */
+static inline void csp_scheduler_spin_stop(void) {
+    if (atomic_fetch_sub(&csp_global_scheduler->nspinning, 1) == 1) {
+        csp_scheduler_wakeup();
+    }
+}
+
+static inline void csp_scheduler_push_global(int prio, csp_proc_t *proc) {
+    while (!csp_grunq_try_push(csp_global_scheduler->global_runqs[prio], proc)) {
+        usleep(1);
+    }
+    atomic_fetch_add_explicit(&csp_global_scheduler->nqueued[prio], 1,
+                              memory_order_relaxed);
+    csp_worker_stats_add(csp_stats_global_pushes, 1);
+}
+
+static inline bool csp_scheduler_pop_global(int prio, int64_t now,
+                                            csp_proc_t **proc) {
+    if (atomic_load_explicit(&csp_global_scheduler->nqueued[prio],
+                             memory_order_relaxed) <= 0 ||
+        !csp_grunq_try_pop(csp_global_scheduler->global_runqs[prio], proc)) {
+        return false;
+    }
+    atomic_fetch_sub_explicit(&csp_global_scheduler->nqueued[prio], 1,
+                              memory_order_relaxed);
+    atomic_store_explicit(&csp_global_scheduler->prio_dispatched_at[prio], now,
+                          memory_order_relaxed);
+    csp_worker_stats_add(csp_stats_global_pops, 1);
+    return true;
+}
+
+/* A high proc was queued, if no worker is free to take it, preempt the one
+ * running the lowest class for a while. */
+static void csp_scheduler_preempt_lower(void) {
+    if (!csp_global_scheduler->preemptive ||
+        atomic_load_explicit(&csp_global_scheduler->nidle,
+                             memory_order_relaxed) != 0 ||
+        atomic_load_explicit(&csp_global_scheduler->nspinning,
+                             memory_order_relaxed) != 0) {
+        return;
+    }
+    int64_t now = csp_timer_now();
+    csp_worker_t *victim = NULL;
+    int lowest = csp_proc_prio_high;
+    for (int i = 0; i < csp_global_scheduler->num_workers; i++) {
+        csp_worker_t *w = csp_global_scheduler->workers[i];
+        int64_t start = atomic_load_explicit(&w->slice_start,
+                                             memory_order_relaxed);
+        int prio = atomic_load_explicit(&w->running_prio, memory_order_relaxed);
+        if (prio > lowest && csp_scheduler_runs_lower(w, start, now)) {
+            victim = w;
+            lowest = prio;
+        }
+    }
+    if (victim != NULL) {
+        csp_scheduler_preempt_worker(victim);
+    }
+}
+
+/* Only the normal procs are kept in the workers' runqs and runnext, the others
+ * go to the global runq of their class. */
+static void csp_scheduler_push(csp_proc_t *proc, int to) {
+    int prio = proc->prio;
+    csp_worker_t *w = NULL;
+    if (to != csp_scheduler_to_global && prio == csp_proc_prio_normal) {
+        csp_worker_t *next = to == csp_scheduler_to_next ?
+            csp_scheduler_this_worker() : NULL;
+        if (next != NULL) {
+            /* Exchanging runnext needs no ownership, it is run by the new
+             * thread if the worker was handed off. The proc previously in
+             * runnext is kicked out to the runq. */
+            proc = atomic_exchange_explicit(&next->runnext, proc,
+                                            memory_order_acq_rel);
+        }
+        if (proc != NULL) {
+            w = csp_scheduler_acquire_worker();
+        }
+    }
+    if (proc != NULL && (w == NULL || !csp_wrunq_try_push(w->runq, proc))) {
+        csp_scheduler_push_global(prio, proc);
+    }
+    csp_scheduler_release_worker(w);
+    /* Pairs with the fence in csp_scheduler_wait_work(), either we see the
+     * worker going to park or it sees the proc we just pushed. */
+    atomic_thread_fence(memory_order_seq_cst);
+    csp_scheduler_wakeup();
+    if (prio == csp_proc_prio_high) {
+        csp_scheduler_preempt_lower();
+    }
+}
+
+static void csp_scheduler_submit_inner(csp_proc_t *proc, int to) {
     // Block preemption during submission to avoid deadlocks
-    csp_proc_t *self = csp_this_core ? (csp_proc_t *)csp_this_core->running : NULL;
-    csp_proc_extra_t *ex = self ? (csp_proc_extra_t *)self->extra : NULL;
-    if (ex) ex->in_critical_section++;
+    CSP_CRITICAL_START();
 
     uint64_t old_stat = csp_proc_stat_get(proc);
     if (old_stat != csp_proc_stat_runnable) {
+        if (old_stat != csp_proc_stat_none &&
+            old_stat != csp_proc_stat_running) {
+            csp_trace(csp_trace_unblock, proc, 0);
+        }
+        int64_t now = 0;
+        csp_scheduler_latency_start(proc, &now);
         csp_proc_stat_set(proc, csp_proc_stat_runnable);
-        while (!csp_grunq_try_push(csp_global_scheduler->global_runq, proc)) {
-            usleep(1);
+        csp_scheduler_push(proc, to);
+    }
+
+    CSP_CRITICAL_END();
+}
+
+void csp_scheduler_submit(csp_proc_t *proc) {
+    csp_scheduler_submit_inner(proc, csp_scheduler_to_local);
+}
+
+/* Yielded and preempted procs go to the global runq, otherwise the owner would
+ * pop them from the bottom of its runq again right away. */
+void csp_scheduler_submit_global(csp_proc_t *proc) {
+    csp_scheduler_submit_inner(proc, csp_scheduler_to_global);
+}
+
+/* Used by the wake paths of channels and mutexes, the woken proc runs next on
+ * the waker's worker, usually as soon as the waker blocks. */
+void csp_scheduler_submit_next(csp_proc_t *proc) {
+    csp_scheduler_submit_inner(proc, csp_scheduler_to_next);
+}
+
+/* Submit the procs linked by `next` from `start` to `end`, `n` is the length
+ * of the list. They are pushed in chunks and at most one worker is woken up
+ * per proc. */
+void csp_scheduler_submit_batch(csp_proc_t *start, csp_proc_t *end, size_t n) {
+    if (start == NULL || n == 0) return;
+
+    CSP_CRITICAL_START();
+
+    csp_worker_t *w = csp_scheduler_acquire_worker();
+    csp_proc_t *procs[csp_scheduler_batch_len];
+    int64_t now = 0;
+    size_t pushed = 0;
+    bool high = false;
+    csp_proc_t *p = start;
+
+    while (p != NULL) {
+        size_t num = 0;
+        while (p != NULL && num < csp_scheduler_batch_len) {
+            csp_proc_t *next = p == end ? NULL : (csp_proc_t *)p->next;
+            p->next = p->pre = NULL;
+            if (csp_proc_stat_get(p) != csp_proc_stat_runnable) {
+                csp_trace(csp_trace_unblock, p, 0);
+                csp_scheduler_latency_start(p, &now);
+                csp_proc_stat_set(p, csp_proc_stat_runnable);
+                if (p->prio == csp_proc_prio_normal) {
+                    procs[num++] = p;
+                } else {
+                    high |= p->prio == csp_proc_prio_high;
+                    csp_scheduler_push_global(p->prio, p);
+                    pushed++;
+                }
+            }
+            p = next;
         }
-        pthread_mutex_lock(&csp_global_scheduler->lock);
-        if (csp_global_scheduler->idle_workers > 0) {
-            pthread_cond_signal(&csp_global_scheduler->cond);
+        pushed += num;
+
+        /* Fill our own runq first, the rest goes to the global one. */
+        csp_grunq_t *global_runq =
+            csp_global_scheduler->global_runqs[csp_proc_prio_normal];
+        size_t i = 0;
+        while (w != NULL && i < num && csp_wrunq_try_push(w->runq, procs[i])) {
+            i++;
+        }
+        while (i < num) {
+            size_t m = csp_grunq_try_pushm(global_runq, procs + i, num - i) ?
+                num - i : csp_grunq_try_push(global_runq, procs[i]);
+            if (m == 0) {
+                usleep(1);
+                continue;
+            }
+            atomic_fetch_add_explicit(
+                &csp_global_scheduler->nqueued[csp_proc_prio_normal], m,
+                memory_order_relaxed);
+            csp_worker_stats_add(csp_stats_global_pushes, m);
+            i += m;
         }
-        pthread_mutex_unlock(&csp_global_scheduler->lock);
+    }
+    csp_scheduler_release_worker(w);
+
+    /* Pairs with the fence in csp_scheduler_wait_work(). */
+    atomic_thread_fence(memory_order_seq_cst);
+    /* A worker submitting the batch runs one of the procs itself later. */
+    csp_scheduler_wakeup_n(w != NULL && pushed > 0 ? pushed - 1 : pushed);
+    csp_scheduler_wakeup();
+    if (high) {
+        csp_scheduler_preempt_lower();
     }
 
-    if (ex) ex->in_critical_section--;
-    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    CSP_CRITICAL_END();
 }
 
-csp_proc_t *csp_scheduler_get_work(int worker_id) {
-    sigset_t mask, oldmask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGALRM);
-    pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+/* The class a worker looks for first, picked by the weights unless one of the
+ * lower classes has been waiting for too long. */
+static inline int csp_scheduler_prio_first(uint64_t tick, int64_t now) {
+    for (int prio = csp_proc_prio_low; prio > csp_proc_prio_high; prio--) {
+        if (atomic_load_explicit(&csp_global_scheduler->nqueued[prio],
+                                 memory_order_relaxed) > 0 &&
+            now - atomic_load_explicit(
+                &csp_global_scheduler->prio_dispatched_at[prio],
+                memory_order_relaxed) > csp_scheduler_prio_age) {
+            return prio;
+        }
+    }
+    uint64_t slot = tick % csp_scheduler_weight_sum;
+    if (slot < csp_scheduler_weight_high) {
+        return csp_proc_prio_high;
+    }
+    return slot < csp_scheduler_weight_high + csp_scheduler_weight_normal ?
+        csp_proc_prio_normal : csp_proc_prio_low;
+}
 
+/* Look for a normal proc in the worker's runnext, its runq and the global
+ * runq, `inherit` is set if it shares the current time slice. */
+static inline csp_proc_t *csp_scheduler_get_normal(csp_worker_t *w,
+                                                   uint64_t tick, int64_t now,
+                                                   bool *inherit) {
     csp_proc_t *proc = NULL;
-    uint64_t expected;
 
-    if (csp_grunq_try_pop(csp_global_scheduler->global_runq, &proc)) {
-        goto found;
+    /* Check the global runq once in a while so that it can't be starved by
+     * procs spawning each other locally. */
+    if (tick % csp_scheduler_global_runq_interval == 0 &&
+        csp_scheduler_pop_global(csp_proc_prio_normal, now, &proc)) {
+        return proc;
     }
-    for (int i = 0; i < csp_global_scheduler->num_workers; i++) {
-        int target = (worker_id + i + 1) % csp_global_scheduler->num_workers;
-        csp_worker_t *tw = csp_global_scheduler->workers[target];
-        if (csp_lrunq_try_pop_front(tw->core->lrunq, &proc) == csp_lrunq_ok) {
+    int64_t slice_start = atomic_load_explicit(&w->slice_start,
+                                               memory_order_relaxed);
+    int64_t quantum = atomic_load_explicit(
+        &csp_global_scheduler->preempt_quantum, memory_order_relaxed);
+    if (now - slice_start < quantum &&
+        (proc = atomic_exchange_explicit(&w->runnext, NULL,
+                                         memory_order_acquire)) != NULL) {
+        *inherit = true;
+        return proc;
+    }
+    if (csp_wrunq_try_pop(w->runq, &proc) ||
+        csp_scheduler_pop_global(csp_proc_prio_normal, now, &proc)) {
+        return proc;
+    }
+    /* The slice is used up but there is nothing else to run. */
+    return atomic_exchange_explicit(&w->runnext, NULL, memory_order_acquire);
+}
+
+/* Runs on the anchor stack of the worker, which the preemption handler
+ * never interrupts. */
+csp_proc_t *csp_scheduler_get_work(int worker_id) {
+    csp_worker_t *w = csp_global_scheduler->workers[worker_id];
+    int n = csp_global_scheduler->num_workers;
+    uint64_t tick = atomic_load_explicit(&w->schedtick, memory_order_relaxed);
+    int64_t now = csp_timer_now();
+    bool inherit = false;
+    csp_proc_t *proc = NULL;
+    uint64_t expected;
+
+    /* The first class picked, then the others from the highest one. */
+    int first = csp_scheduler_prio_first(tick, now);
+    for (int i = -1; i < csp_proc_prio_num; i++) {
+        int prio = i < 0 ? first : i;
+        if (i >= 0 && prio == first) continue;
+        if (prio == csp_proc_prio_normal) {
+            if ((proc = csp_scheduler_get_normal(w, tick, now, &inherit))) {
+                goto found;
+            }
+        } else if (csp_scheduler_pop_global(prio, now, &proc)) {
             goto found;
         }
     }
+
+    /* Steal from the others, the closer ones first. Within the same distance
+     * start from a different victim each time. */
+    for (int lo = 0, hi; lo < n - 1; lo = hi) {
+        for (hi = lo + 1;
+             hi < n - 1 && w->steal_dist[hi] == w->steal_dist[lo]; hi++);
+        for (int i = 0; i < hi - lo; i++) {
+            csp_worker_t *victim = csp_global_scheduler->workers[
+                w->steal_order[lo + (tick + i) % (hi - lo)]];
+            csp_stats_add(&w->stats, csp_stats_steal_attempts, 1);
+            for (int retry = 0; retry < csp_scheduler_steal_retries; retry++) {
+                int code = csp_wrunq_try_steal(victim->runq, &proc);
+                if (code == csp_wrunq_ok) {
+                    csp_trace(csp_trace_steal, proc, victim->id);
+                    csp_stats_add(&w->stats, csp_stats_steals, 1);
+                    goto found;
+                }
+                if (code == csp_wrunq_failed) break;
+            }
+            int64_t at = atomic_load_explicit(&victim->dispatched_at,
+                                              memory_order_relaxed);
+            if (now - at > csp_scheduler_runnext_steal_after &&
+                atomic_load_explicit(&victim->runnext, memory_order_relaxed) &&
+                (proc = atomic_exchange_explicit(&victim->runnext, NULL,
+                                                 memory_order_acquire)) != NULL) {
+                csp_trace(csp_trace_steal, proc, victim->id);
+                csp_stats_add(&w->stats, csp_stats_steals, 1);
+                goto found;
+            }
+        }
+    }
     return NULL;
 
 found:
+    atomic_store_explicit(&w->schedtick, tick + 1, memory_order_relaxed);
+    atomic_store_explicit(&w->dispatched_at, now, memory_order_relaxed);
+    if (!inherit) {
+        atomic_store_explicit(&w->slice_start, now, memory_order_relaxed);
+    }
+    atomic_store_explicit(&w->running_prio, proc->prio, memory_order_relaxed);
+    csp_scheduler_latency_end(w, proc, now);
+    csp_stats_add(&w->stats, csp_stats_dispatches, 1);
     expected = csp_proc_stat_runnable;
     if (!csp_proc_stat_cas(proc, expected, csp_proc_stat_running)) {
-        // Already picked by someone else? (Should not happen with grunq/lrunq exclusive pop)
+        // Already picked by someone else? (Should not happen with grunq/wrunq exclusive pop)
         // But better be safe.
-        pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
         return NULL;
     }
-    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
     return proc;
 }
 
-csp_proc_t *csp_proc_create(int stack_id, void (*func)(void *), void *arg) {
-    csp_proc_t *proc = csp_proc_new(stack_id, false);
+/* The fast path of csp_scheduler_wait_work() taken by the procs blocking right
+ * after waking another one up: the proc in runnext of the worker is returned if
+ * it may share the time slice and nothing else is due on the worker, otherwise
+ * NULL and the caller goes through the scheduling loop of its core. */
+csp_proc_t *csp_scheduler_get_next(void) {
+    csp_worker_t *w = csp_scheduler_acquire_worker();
+    if (w == NULL) {
+        return NULL;
+    }
+    csp_proc_t *proc = NULL;
+    uint64_t tick = atomic_load_explicit(&w->schedtick, memory_order_relaxed);
+    int64_t now = csp_timer_now();
+    int64_t slice_start = atomic_load_explicit(&w->slice_start,
+                                               memory_order_relaxed);
+    int64_t quantum = atomic_load_explicit(
+        &csp_global_scheduler->preempt_quantum, memory_order_relaxed);
+
+    /* The worker moved to this thread has to be adopted by the loop first. */
+    if (tick % csp_scheduler_global_runq_interval != 0 &&
+        now - slice_start < quantum &&
+        atomic_load_explicit(&w->preempt_requested, memory_order_relaxed) ==
+            &csp_sched_preempt_requested &&
+        atomic_load_explicit(
+            &csp_global_scheduler->nqueued[csp_proc_prio_high],
+            memory_order_relaxed) == 0 &&
+        atomic_load_explicit(
+            &csp_global_scheduler->nqueued[csp_proc_prio_low],
+            memory_order_relaxed) == 0 &&
+        atomic_load_explicit(&w->runnext, memory_order_relaxed) != NULL &&
+        (proc = atomic_exchange_explicit(&w->runnext, NULL,
+                                         memory_order_acquire)) != NULL) {
+        atomic_store_explicit(&w->schedtick, tick + 1, memory_order_relaxed);
+        atomic_store_explicit(&w->dispatched_at, now, memory_order_relaxed);
+        atomic_store_explicit(&w->running_prio, proc->prio,
+                              memory_order_relaxed);
+        csp_scheduler_latency_end(w, proc, now);
+        csp_stats_add(&w->stats, csp_stats_dispatches, 1);
+        csp_proc_stat_set(proc, csp_proc_stat_running);
+    }
+    csp_scheduler_release_worker(w);
+    return proc;
+}
+
+/* Park the worker as long as it is out of the active ones, the procs it owns
+ * are handed over to the others first. */
+static void csp_scheduler_retire(csp_worker_t *w) {
+    csp_proc_t *proc;
+    bool moved = false;
+
+    if ((proc = atomic_exchange_explicit(&w->runnext, NULL,
+                                         memory_order_acquire)) != NULL) {
+        csp_scheduler_push_global(csp_proc_prio_normal, proc);
+        moved = true;
+    }
+    while (csp_wrunq_try_pop(w->runq, &proc)) {
+        csp_scheduler_push_global(csp_proc_prio_normal, proc);
+        moved = true;
+    }
+    if (moved) {
+        atomic_thread_fence(memory_order_seq_cst);
+        csp_scheduler_wakeup();
+    }
+
+    while (w->id >= csp_scheduler_nactive()) {
+        atomic_store(&w->parked, csp_scheduler_parked_retired);
+        /* Pairs with the fence in csp_scheduler_scale(). */
+        atomic_thread_fence(memory_order_seq_cst);
+        if (w->id < csp_scheduler_nactive()) {
+            atomic_store(&w->parked, csp_scheduler_parked_none);
+            break;
+        }
+        csp_stats_add(&w->stats, csp_stats_parks, 1);
+        while (atomic_load(&w->parked) == csp_scheduler_parked_retired) {
+            csp_futex_wait(&w->parked, csp_scheduler_parked_retired);
+        }
+        csp_stats_add(&w->stats, csp_stats_unparks, 1);
+    }
+}
+
+/* Called by a worker having nothing to run, it spins for a while looking for
+ * work and parks on its futex word if there is still none. */
+csp_proc_t *csp_scheduler_wait_work(int worker_id) {
+    csp_worker_t *w = csp_global_scheduler->workers[worker_id];
+    bool spinning = false;
+    csp_proc_t *proc;
+
+    if (worker_id < csp_scheduler_nactive() &&
+        (proc = csp_scheduler_get_work(worker_id)) != NULL) {
+        return proc;
+    }
+    /* Nothing runs on this worker for now, don't preempt it. */
+    atomic_store_explicit(&w->slice_start, 0, memory_order_relaxed);
+
+    while (true) {
+        if (worker_id >= csp_scheduler_nactive()) {
+            if (spinning) {
+                csp_scheduler_spin_stop();
+                spinning = false;
+            }
+            csp_scheduler_retire(w);
+        }
+        for (int i = 0; i < csp_scheduler_spin_rounds; i++) {
+            if ((proc = csp_scheduler_get_work(worker_id)) != NULL) {
+                if (spinning) csp_scheduler_spin_stop();
+                return proc;
+            }
+            /* Spinning is limited to half of the busy workers like Go does,
+             * so that they don't burn the cpus the busy ones need. */
+            if (!spinning) {
+                int busy = csp_scheduler_nactive() -
+                    atomic_load(&csp_global_scheduler->nidle);
+                if (2 * atomic_load(&csp_global_scheduler->nspinning) >= busy) {
+                    break;
+                }
+                atomic_fetch_add(&csp_global_scheduler->nspinning, 1);
+                spinning = true;
+            }
+            for (int j = 0; j < csp_scheduler_spin_pauses; j++) {
+                csp_cpu_relax();
+            }
+        }
+
+        atomic_store(&w->parked, csp_scheduler_parked_idle);
+        atomic_fetch_add(&csp_global_scheduler->nidle, 1);
+        if (spinning) {
+            atomic_fetch_sub(&csp_global_scheduler->nspinning, 1);
+            spinning = false;
+        }
+        /* Pairs with the fence in csp_scheduler_push(). */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        /* Retired meanwhile, pairs with the fence in csp_scheduler_scale(). */
+        bool retired = worker_id >= csp_scheduler_nactive();
+        if (retired || (proc = csp_scheduler_get_work(worker_id)) != NULL) {
+            int one = csp_scheduler_parked_idle;
+            if (atomic_compare_exchange_strong(&w->parked, &one,
+                                               csp_scheduler_parked_none)) {
+                atomic_fetch_sub(&csp_global_scheduler->nidle, 1);
+            } else {
+                /* Someone woke us up meanwhile and counted us as spinning. */
+                csp_scheduler_spin_stop();
+            }
+            if (retired) continue;
+            return proc;
+        }
+        csp_trace(csp_trace_park, NULL, worker_id);
+        csp_stats_add(&w->stats, csp_stats_parks, 1);
+        while (atomic_load(&w->parked) == csp_scheduler_parked_idle) {
+            csp_futex_wait(&w->parked, csp_scheduler_parked_idle);
+        }
+        csp_stats_add(&w->stats, csp_stats_unparks, 1);
+        spinning = true;
+    }
+}
+
+/* Called by the monitor periodically to adjust the number of active workers
+ * between csp_scheduler_min_active and `num_workers`. */
+void csp_scheduler_scale(int64_t now) {
+    csp_scheduler_t *s = csp_global_scheduler;
+    int nactive = csp_scheduler_nactive();
+    int nidle = atomic_load(&s->nidle);
+
+    if (s->scale.window_start == 0 || nidle < s->scale.min_idle) {
+        s->scale.min_idle = nidle;
+    }
+    if (s->scale.window_start == 0) {
+        s->scale.window_start = now;
+    }
+
+    /* Some of the active workers have never been needed in the window, retire
+     * half of them. The parked ones among the retired are woken up to move to
+     * the retired state. */
+    if (now - s->scale.window_start >= csp_scheduler_shrink_window) {
+        int target = nactive - (s->scale.min_idle + 1) / 2;
+        if (target < csp_scheduler_min_active) {
+            target = csp_scheduler_min_active;
+        }
+        s->scale.window_start = now;
+        s->scale.min_idle = nidle;
+        if (target < nactive) {
+            atomic_store(&s->nactive, target);
+            atomic_fetch_add(&s->nshrinks, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            for (int i = target; i < nactive; i++) {
+                csp_worker_t *w = s->workers[i];
+                int one = csp_scheduler_parked_idle;
+                if (atomic_compare_exchange_strong(&w->parked, &one,
+                                                   csp_scheduler_parked_none)) {
+                    /* It is counted as spinning like the ones unparked. */
+                    atomic_fetch_add(&s->nspinning, 1);
+                    atomic_fetch_sub(&s->nidle, 1);
+                    csp_futex_wake(&w->parked, 1);
+                }
+            }
+            return;
+        }
+    }
+
+    /* Procs are waiting while all the active workers are busy. */
+    size_t backlog = 0;
+    for (int i = 0; i < csp_proc_prio_num; i++) {
+        backlog += atomic_load_explicit(&s->nqueued[i], memory_order_relaxed);
+    }
+    for (int i = 0; i < nactive; i++) {
+        backlog += csp_wrunq_len(s->workers[i]->runq);
+    }
+    if (nactive >= s->num_workers || nidle > 0 || backlog == 0 ||
+        atomic_load(&s->nspinning) > 0) {
+        s->scale.backlog_since = 0;
+        return;
+    }
+    if (s->scale.backlog_since == 0) {
+        s->scale.backlog_since = now;
+        return;
+    }
+    if (now - s->scale.backlog_since < csp_scheduler_grow_after) {
+        return;
+    }
+
+    s->scale.backlog_since = 0;
+    s->scale.window_start = now;
+    s->scale.min_idle = 0;
+    csp_worker_t *w = s->workers[nactive];
+    atomic_store(&s->nactive, nactive + 1);
+    atomic_fetch_add(&s->ngrows, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    int two = csp_scheduler_parked_retired;
+    if (atomic_compare_exchange_strong(&w->parked, &two,
+                                       csp_scheduler_parked_none)) {
+        csp_futex_wake(&w->parked, 1);
+    }
+}
+
+/* Hand the worker of `from` over to the spare core `to`, which fails if the
+ * thread of `from` is using it. Otherwise the thread finds the worker lost the
+ * next time it schedules. */
+bool csp_scheduler_handoff(csp_core_t *from, csp_core_t *to) {
+    csp_core_worker_state_t owned = csp_core_worker_owned;
+    if (!atomic_compare_exchange_strong(&from->worker_state, &owned,
+                                        csp_core_worker_lost)) {
+        return false;
+    }
+    csp_worker_t *w = (csp_worker_t *)from->worker;
+    if (w == NULL || atomic_load(&w->core) != from) {
+        atomic_store(&from->worker_state, csp_core_worker_owned);
+        return false;
+    }
+    /* Not preempted until the new thread dispatches a proc. */
+    atomic_store(&w->ktid, 0);
+    atomic_store_explicit(&w->slice_start, 0, memory_order_relaxed);
+    to->worker = w;
+    atomic_store(&w->core, to);
+    atomic_fetch_add(&csp_global_scheduler->nhandoffs, 1);
+    return true;
+}
+
+/* Whether the thread is sleeping in the kernel, read from the state following
+ * the command name in /proc. */
+static bool csp_scheduler_thread_blocked(int ktid) {
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", ktid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return false;
+    buf[n] = '\0';
+
+    char *p = strrchr(buf, ')');
+    return p != NULL && p[1] == ' ' && (p[2] == 'S' || p[2] == 'D');
+}
+
+/* Called by the monitor periodically, the workers whose threads are blocked in
+ * syscalls outside of csp_block() are handed off to spare cores if there are
+ * procs waiting for them. */
+void csp_scheduler_sysmon(int64_t now) {
+    csp_scheduler_t *s = csp_global_scheduler;
+    bool queued = false;
+    if (atomic_load(&s->nidle) == 0) {
+        for (int i = 0; i < csp_proc_prio_num; i++) {
+            queued |= atomic_load_explicit(&s->nqueued[i],
+                                           memory_order_relaxed) > 0;
+        }
+    }
+
+    for (int i = 0, n = csp_scheduler_nactive(); i < n; i++) {
+        csp_worker_t *w = s->workers[i];
+        int ktid = atomic_load(&w->ktid);
+        int64_t start = atomic_load_explicit(&w->slice_start,
+                                             memory_order_relaxed);
+        int64_t at = atomic_load_explicit(&w->dispatched_at,
+                                          memory_order_relaxed);
+        if (ktid == 0 || start == 0 || now - at < csp_scheduler_sysmon_after ||
+            (!queued && csp_wrunq_len(w->runq) == 0 &&
+             atomic_load_explicit(&w->runnext, memory_order_relaxed) == NULL) ||
+            !csp_scheduler_thread_blocked(ktid)) {
+            continue;
+        }
+
+        csp_core_t *from = atomic_load(&w->core), *to;
+        if (!csp_core_pools_get(from->pid, &to)) {
+            continue;
+        }
+        if (!csp_scheduler_handoff(from, to)) {
+            csp_core_pools_put(to);
+            continue;
+        }
+        if (!csp_core_resume(to)) {
+            perror("Failed to start thread.");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void csp_scheduler_set_preempt_quantum(int64_t quantum) {
+    if (quantum <= 0) quantum = csp_scheduler_default_quantum;
+    atomic_store(&csp_global_scheduler->preempt_quantum, quantum);
+}
+
+static csp_proc_t *csp_proc_spawn(csp_proc_t *proc, void (*func)(void *),
+                                  void *arg) {
     proc->registers.caller_saved.rdi = (uintptr_t)arg;
-    proc->extra = csp_proc_extra_new();
-    ((csp_proc_extra_t *)proc->extra)->preemptible = true;
+    proc->preemptible = true;
+    proc->func = (void *)func;
+    csp_trace(csp_trace_spawn, proc, proc->prio);
 
     uintptr_t *stack = (uintptr_t *)proc->rbp;
     *(--stack) = (uintptr_t)csp_core_proc_exit;
@@ -158,3 +1029,28 @@ csp_proc_t *csp_proc_create(int stack_id, void (*func)(void *), void *arg) {
     csp_scheduler_submit(proc);
     return proc;
 }
+
+/* The stack is taken from the cache of the current core, which the spawner
+ * must not leave in the middle. */
+static inline csp_proc_t *csp_proc_alloc(int stack_id) {
+    CSP_CRITICAL_START();
+    csp_proc_t *proc = csp_proc_new(stack_id, false);
+    CSP_CRITICAL_END();
+    return proc;
+}
+
+/* The new proc inherits the spawn priority of the running one. */
+csp_proc_t *csp_proc_create(int stack_id, void (*func)(void *), void *arg) {
+    return csp_proc_spawn(csp_proc_alloc(stack_id), func, arg);
+}
+
+/* Spawn a proc of the priority class `prio`(csp_proc_prio_*), an invalid one
+ * is ignored and the class is inherited like csp_proc_create(). */
+csp_proc_t *csp_proc_create_prio(int prio, int stack_id,
+                                 void (*func)(void *), void *arg) {
+    csp_proc_t *proc = csp_proc_alloc(stack_id);
+    if (csp_proc_prio_valid(prio)) {
+        proc->prio = proc->spawn_prio = prio;
+    }
+    return csp_proc_spawn(proc, func, arg);
+}
@@ -4,22 +4,65 @@
 #include "platform.h"
 #include "proc.h"
 #include "runq.h"
+#include "stats.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+struct csp_core_s;
+
 typedef struct csp_scheduler_s {
     int num_workers;
     struct csp_worker_s **workers;
-    csp_grunq_t *global_runq;
+    /* One global runq per priority class. The normal procs are usually kept
+     * in the workers' runqs, the others always go to the global ones. */
+    csp_grunq_t *global_runqs[csp_proc_prio_num];
+    /* Number of procs exited on the threads without cores(e.g. the monitor),
+     * the others are counted by the cores. See runtime_num_goroutines(). */
     _Alignas(64) atomic_int num_procs;
-    _Alignas(64) pthread_mutex_t lock;
-    pthread_cond_t cond;
-    _Alignas(64) int idle_workers;
+
+    /* Number of workers looking for work without being parked, submitters
+     * don't wake anyone up while some are spinning. */
+    _Alignas(64) atomic_int nspinning;
+
+    /* Number of parked workers. */
+    _Alignas(64) atomic_int nidle;
+
+    /* Only the workers whose ids are less than `nactive` run procs, the others
+     * are retired and parked until the load grows, see csp_scheduler_scale(). */
+    _Alignas(64) atomic_int nactive;
+    atomic_uint_fast64_t ngrows, nshrinks;
+
+    /* Number of workers handed off to spare cores by blocked threads. */
+    atomic_uint_fast64_t nhandoffs;
+
+    /* The states of csp_scheduler_scale(), only accessed by the monitor. */
+    struct {
+        int64_t window_start, backlog_since;
+        int min_idle;
+    } scale;
+
+    /* Number of procs in each of the global runqs, and when a proc of each
+     * class was dispatched last time which is used to age the starving ones. */
+    _Alignas(64) atomic_int nqueued[csp_proc_prio_num];
+    atomic_int_fast64_t prio_dispatched_at[csp_proc_prio_num];
+
+    /* Nanoseconds a proc can run before it is preempted, procs taken from a
+     * worker's runnext in a row share it. */
+    atomic_int_fast64_t preempt_quantum;
 
     pthread_t preempter_tid;
     atomic_bool stop_preempter;
+    /* Whether the preempter runs, see LIBCSP_PREEMPT. */
+    bool preemptive;
+    /* Whether the preempter sets the workers' csp_sched_preempt_requested
+     * rather than signaling them. */
+    bool cooperative_preempt;
+
+    /* The counters of the threads without workers, see
+     * csp_worker_stats_add(). */
+    csp_stats_t stats;
 } csp_scheduler_t;
 
 extern csp_scheduler_t *csp_global_scheduler;
@@ -27,9 +70,20 @@ extern csp_scheduler_t *csp_global_scheduler;
 void csp_scheduler_init(int num_workers);
 void csp_scheduler_stop(void);
 void csp_scheduler_submit(csp_proc_t *proc);
+void csp_scheduler_submit_global(csp_proc_t *proc);
+void csp_scheduler_submit_next(csp_proc_t *proc);
+void csp_scheduler_submit_batch(csp_proc_t *start, csp_proc_t *end, size_t n);
 csp_proc_t *csp_scheduler_get_work(int worker_id);
+csp_proc_t *csp_scheduler_wait_work(int worker_id);
+csp_proc_t *csp_scheduler_get_next(void);
+void csp_scheduler_set_preempt_quantum(int64_t quantum);
+void csp_scheduler_scale(int64_t now);
+bool csp_scheduler_handoff(struct csp_core_s *from, struct csp_core_s *to);
+void csp_scheduler_sysmon(int64_t now);
 
 csp_proc_t *csp_proc_create(int stack_id, void (*func)(void *), void *arg);
+csp_proc_t *csp_proc_create_prio(int prio, int stack_id,
+                                 void (*func)(void *), void *arg);
 
 #ifdef __cplusplus
 }
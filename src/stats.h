@@ -0,0 +1,60 @@
+#ifndef LIBCSP_STATS_H
+#define LIBCSP_STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The counters kept by every worker, see runtime_metrics_write(). */
+typedef enum {
+    /* Procs picked by the worker to run. */
+    csp_stats_dispatches,
+    /* Procs switched out by yielding, being preempted, blocking or exiting. */
+    csp_stats_switches,
+    /* Runqs and runnexts of the other workers tried by the thieves, and the
+     * tries which got a proc. */
+    csp_stats_steal_attempts,
+    csp_stats_steals,
+    /* Times the worker or the spare cores went to sleep without any work, and
+     * the times they were woken up. */
+    csp_stats_parks,
+    csp_stats_unparks,
+    /* Procs yielded on behalf of the scheduler. */
+    csp_stats_preemptions,
+    csp_stats_global_pushes,
+    csp_stats_global_pops,
+    /* Procs blocked on channels. */
+    csp_stats_chan_blocks,
+    /* Procs woken up by the netpoll and by their timers. */
+    csp_stats_netpoll_wakes,
+    csp_stats_timer_fires,
+    csp_stats_num,
+} csp_stats_type_t;
+
+/* It's kept in cache lines of its own since the owner writes it on every
+ * switch. */
+typedef struct {
+    _Alignas(64) atomic_uint_fast64_t counts[csp_stats_num];
+} csp_stats_t;
+
+/* Only the owner of `stats` may call it, the counters are read by anyone. */
+static inline void csp_stats_add(csp_stats_t *stats, int type, uint64_t n) {
+    atomic_store_explicit(&stats->counts[type],
+        atomic_load_explicit(&stats->counts[type], memory_order_relaxed) + n,
+        memory_order_relaxed);
+}
+
+/* For the counters shared by several threads. */
+static inline void csp_stats_add_shared(csp_stats_t *stats, int type,
+                                        uint64_t n) {
+    atomic_fetch_add_explicit(&stats->counts[type], n, memory_order_relaxed);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
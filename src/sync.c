@@ -3,10 +3,11 @@
 #include "core.h"
 #include "scheduler.h"
 #include "proc_extra.h"
+#include "trace.h"
 #include <stdlib.h>
 #include <stdio.h>
 
-extern void csp_core_yield(csp_proc_t *proc, void *anchor);
+extern void csp_sched_park(pthread_mutex_t *lock, void *on, int reason);
 
 void csp_sync_mutex_init(csp_sync_mutex_t *mutex) {
     mutex->locked = 0;
@@ -35,8 +36,7 @@ void csp_sync_mutex_lock(csp_sync_mutex_t *mutex) {
         } else {
             mutex->waiters_head = mutex->waiters_tail = (struct csp_proc_s *)self;
         }
-        pthread_mutex_unlock(&mutex->lock);
-        csp_core_yield(self, &csp_this_core->anchor);
+        csp_sched_park(&mutex->lock, mutex, csp_trace_reason_mutex);
         CSP_CRITICAL_END();
     } else {
         while (mutex->locked) {
@@ -56,7 +56,7 @@ void csp_sync_mutex_unlock(csp_sync_mutex_t *mutex) {
         mutex->waiters_head = (struct csp_proc_s *)proc->next;
         if (!mutex->waiters_head) mutex->waiters_tail = NULL;
         pthread_mutex_unlock(&mutex->lock);
-        csp_scheduler_submit(proc);
+        csp_scheduler_submit_next(proc);
     } else {
         mutex->locked = 0;
         pthread_cond_signal(&mutex->cond);
@@ -81,15 +81,16 @@ void csp_sync_waitgroup_add(csp_sync_waitgroup_t *wg, int delta) {
     }
     if (val == 0) {
         pthread_mutex_lock(&wg->lock);
-        csp_proc_t *q = (csp_proc_t *)wg->waiters_head;
+        csp_proc_t *start = (csp_proc_t *)wg->waiters_head;
+        csp_proc_t *end = (csp_proc_t *)wg->waiters_tail;
         wg->waiters_head = wg->waiters_tail = NULL;
         pthread_cond_broadcast(&wg->cond);
         pthread_mutex_unlock(&wg->lock);
-        while (q) {
-            csp_proc_t *next = (csp_proc_t *)q->next;
-            csp_scheduler_submit(q);
-            q = next;
+        size_t n = 0;
+        for (csp_proc_t *p = start; p; p = (csp_proc_t *)p->next) {
+            n++;
         }
+        csp_scheduler_submit_batch(start, end, n);
     }
     CSP_CRITICAL_END();
 }
@@ -118,8 +119,7 @@ void csp_sync_waitgroup_wait(csp_sync_waitgroup_t *wg) {
         } else {
             wg->waiters_head = wg->waiters_tail = (struct csp_proc_s *)self;
         }
-        pthread_mutex_unlock(&wg->lock);
-        csp_core_yield(self, &csp_this_core->anchor);
+        csp_sched_park(&wg->lock, wg, csp_trace_reason_waitgroup);
         CSP_CRITICAL_END();
     } else {
         while (atomic_load(&wg->counter) > 0) {
@@ -24,6 +24,7 @@
 #include "chan.h"
 #include "scheduler.h"
 #include "csp_sched.h"
+#include "worker.h"
 
 #define csp_timer_getclock() ({                                                \
   uint32_t high, low;                                                          \
@@ -144,6 +145,8 @@ static int csp_timer_heap_get(csp_timer_heap_t *heap, csp_proc_t **start, csp_pr
 
 struct { int len; csp_timer_heap_t *heaps; } csp_timer_heaps;
 
+atomic_int_fast64_t csp_timer_coarse;
+
 bool csp_timer_heaps_init(void) {
   csp_timer_heaps.heaps = (csp_timer_heap_t *)malloc(sizeof(csp_timer_heap_t) * csp_sched_np);
   if (csp_timer_heaps.heaps == NULL) return false;
@@ -177,6 +180,9 @@ int csp_timer_poll(csp_proc_t **start, csp_proc_t **end) {
       total += n;
     }
   }
+  if (total > 0) {
+    csp_worker_stats_add(csp_stats_timer_fires, total);
+  }
   return total;
 }
 
@@ -196,6 +202,9 @@ bool csp_timer_cancel(csp_timer_t timer) {
 csp_proc void csp_timer_anchor(csp_timer_time_t when) {}
 
 // PRODUCTION EXTENSIONS
+extern void *csp_mem_obj_alloc(size_t size);
+extern void csp_mem_obj_free(void *obj);
+
 typedef struct {
     csp_gochan_t *ch;
     csp_timer_duration_t duration;
@@ -214,21 +223,21 @@ static void timer_task(void *arg) {
         }
         if (!ta->periodic) break;
     }
-    if (!ta->periodic) free(ta);
+    if (!ta->periodic) csp_mem_obj_free(ta);
 }
 
 csp_gochan_t *csp_time_after(csp_timer_duration_t d) {
     csp_gochan_t *ch = csp_gochan_new(1);
-    timer_task_arg_t *ta = (timer_task_arg_t *)malloc(sizeof(timer_task_arg_t));
+    timer_task_arg_t *ta = (timer_task_arg_t *)csp_mem_obj_alloc(sizeof(timer_task_arg_t));
     ta->ch = ch; ta->duration = d; ta->periodic = false;
     csp_proc_create(0, timer_task, ta);
     return ch;
 }
 
 csp_ticker_t *csp_ticker_new(csp_timer_duration_t d) {
-    csp_ticker_t *ticker = (csp_ticker_t *)malloc(sizeof(csp_ticker_t));
+    csp_ticker_t *ticker = (csp_ticker_t *)csp_mem_obj_alloc(sizeof(csp_ticker_t));
     ticker->ch = csp_gochan_new(1);
-    timer_task_arg_t *ta = (timer_task_arg_t *)malloc(sizeof(timer_task_arg_t));
+    timer_task_arg_t *ta = (timer_task_arg_t *)csp_mem_obj_alloc(sizeof(timer_task_arg_t));
     ta->ch = ticker->ch;
     ta->duration = d;
     ta->periodic = true;
@@ -21,6 +21,11 @@ extern "C" {
   (csp_timer_time_t)(ts.tv_sec * csp_timer_second + ts.tv_nsec);               \
 })                                                                             \
 
+/* The time updated by the monitor every 10ms at most, reading it costs much
+ * less than csp_timer_now(). */
+#define csp_timer_coarse_now()                                                 \
+  atomic_load_explicit(&csp_timer_coarse, memory_order_relaxed)
+
 #define csp_timer_at(when, task) ({                                            \
   csp_soft_mbarr();                                                            \
   csp_timer_t timer;                                                           \
@@ -39,6 +44,8 @@ typedef int64_t csp_timer_time_t;
 typedef int64_t csp_timer_duration_t;
 typedef struct { csp_proc_t *ctx; int64_t token; } csp_timer_t;
 
+extern atomic_int_fast64_t csp_timer_coarse;
+
 bool csp_timer_cancel(csp_timer_t timer);
 void csp_timer_anchor(csp_timer_time_t when);
 
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "platform.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include "topology.h"
+
+#define csp_topology_sys_cpu  "/sys/devices/system/cpu"
+
+/* The memory policy of `mbind`, we don't depend on libnuma. */
+#define csp_topology_mpol_preferred 1
+
+typedef struct {
+  /* The logical cpu id. */
+  int id;
+
+  /* The physical core which is unique across the packages. */
+  int core;
+
+  /* The order of this cpu among the SMT siblings of its core. */
+  int smt;
+
+  /* The id of the last level cache, i.e. the first cpu sharing it. */
+  int llc;
+
+  /* The NUMA node. */
+  int node;
+
+  /* The ranks of the core in its LLC and of the LLC in its node. */
+  int core_rank, llc_rank;
+
+  /* Whether it is the first cpu of its LLC. */
+  bool llc_first;
+} csp_topology_cpu_t;
+
+static struct {
+  csp_topology_affinity_t affinity;
+
+  /* The cpus we are allowed to run on. */
+  size_t ncpus;
+  csp_topology_cpu_t *cpus;
+
+  /* The index in `cpus` of the cpu of every pid. */
+  size_t np;
+  size_t *pid_cpus;
+
+  /* The number of NUMA nodes seen. */
+  int nnodes;
+} csp_topology;
+
+static int csp_topology_read_int(const char *path, int dflt) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return dflt;
+  }
+  int val;
+  if (fscanf(file, "%d", &val) != 1) {
+    val = dflt;
+  }
+  fclose(file);
+  return val;
+}
+
+/* The node of a cpu is the `nodeN` entry in its sysfs directory. */
+static int csp_topology_read_node(int cpu) {
+  char path[128];
+  snprintf(path, sizeof(path), csp_topology_sys_cpu "/cpu%d", cpu);
+
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return 0;
+  }
+  int node = 0;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) == 0 &&
+        sscanf(ent->d_name + 4, "%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+/* The LLC is the cache index of the highest level, we identify it by the first
+ * cpu in its `shared_cpu_list`. */
+static int csp_topology_read_llc(int cpu) {
+  char path[128];
+  int llc = 0, max_level = -1;
+
+  for (int i = 0; ; i++) {
+    snprintf(path, sizeof(path),
+      csp_topology_sys_cpu "/cpu%d/cache/index%d/level", cpu, i);
+    int level = csp_topology_read_int(path, -1);
+    if (level < 0) {
+      break;
+    }
+    if (level > max_level) {
+      snprintf(path, sizeof(path),
+        csp_topology_sys_cpu "/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+      max_level = level;
+      llc = csp_topology_read_int(path, 0);
+    }
+  }
+  return llc;
+}
+
+static int csp_topology_cmp_compact(const void *a, const void *b) {
+  const csp_topology_cpu_t *x = a, *y = b;
+  if (x->node != y->node) return x->node - y->node;
+  if (x->llc != y->llc)   return x->llc - y->llc;
+  if (x->smt != y->smt)   return x->smt - y->smt;
+  if (x->core != y->core) return x->core - y->core;
+  return x->id - y->id;
+}
+
+static int csp_topology_cmp_scatter(const void *a, const void *b) {
+  const csp_topology_cpu_t *x = a, *y = b;
+  if (x->smt != y->smt)             return x->smt - y->smt;
+  if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+  if (x->llc_rank != y->llc_rank)   return x->llc_rank - y->llc_rank;
+  if (x->node != y->node)           return x->node - y->node;
+  return x->id - y->id;
+}
+
+static void csp_topology_read_cpus(cpu_set_t *allowed) {
+  csp_topology_cpu_t *cpus = csp_topology.cpus;
+  char path[128];
+  size_t n = 0;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, allowed)) {
+      continue;
+    }
+    snprintf(path, sizeof(path),
+      csp_topology_sys_cpu "/cpu%d/topology/physical_package_id", cpu);
+    int package = csp_topology_read_int(path, 0);
+    snprintf(path, sizeof(path),
+      csp_topology_sys_cpu "/cpu%d/topology/core_id", cpu);
+    int core = csp_topology_read_int(path, cpu);
+
+    cpus[n].id = cpu;
+    cpus[n].core = (package << 16) | core;
+    cpus[n].llc = csp_topology_read_llc(cpu);
+    cpus[n].node = csp_topology_read_node(cpu);
+    if (cpus[n].node + 1 > csp_topology.nnodes) {
+      csp_topology.nnodes = cpus[n].node + 1;
+    }
+    n++;
+  }
+  csp_topology.ncpus = n;
+
+  /* The ranks are used by the scatter policy. They are counted among the
+   * first cpus of the distinct cores and LLCs, the cpus are few enough. */
+  for (size_t i = 0; i < n; i++) {
+    cpus[i].smt = cpus[i].core_rank = cpus[i].llc_rank = 0;
+    cpus[i].llc_first = true;
+    for (size_t j = 0; j < n; j++) {
+      if (cpus[j].core == cpus[i].core && cpus[j].id < cpus[i].id) {
+        cpus[i].smt++;
+      }
+      if (cpus[j].llc == cpus[i].llc && cpus[j].id < cpus[i].id) {
+        cpus[i].llc_first = false;
+      }
+    }
+  }
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < n; j++) {
+      if (cpus[j].smt != 0) {
+        continue;
+      }
+      if (cpus[j].llc == cpus[i].llc && cpus[j].core < cpus[i].core) {
+        cpus[i].core_rank++;
+      }
+      if (cpus[j].node == cpus[i].node && cpus[j].llc < cpus[i].llc &&
+          cpus[j].llc_first) {
+        cpus[i].llc_rank++;
+      }
+    }
+  }
+}
+
+bool csp_topology_init(size_t np) {
+  const char *affinity = getenv("LIBCSP_AFFINITY");
+  if (affinity == NULL || strcmp(affinity, "compact") == 0) {
+    csp_topology.affinity = csp_topology_affinity_compact;
+  } else if (strcmp(affinity, "scatter") == 0) {
+    csp_topology.affinity = csp_topology_affinity_scatter;
+  } else if (strcmp(affinity, "none") == 0) {
+    csp_topology.affinity = csp_topology_affinity_none;
+  } else {
+    fprintf(stderr, "libcsp: unknown LIBCSP_AFFINITY %s.\n", affinity);
+    return false;
+  }
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+
+  csp_topology.cpus = (csp_topology_cpu_t *)malloc(
+    sizeof(csp_topology_cpu_t) * CPU_COUNT(&allowed)
+  );
+  csp_topology.pid_cpus = (size_t *)malloc(sizeof(size_t) * np);
+  if (csp_topology.cpus == NULL || csp_topology.pid_cpus == NULL) {
+    csp_topology_destroy();
+    return false;
+  }
+
+  csp_topology_read_cpus(&allowed);
+  qsort(csp_topology.cpus, csp_topology.ncpus, sizeof(csp_topology_cpu_t),
+    csp_topology.affinity == csp_topology_affinity_scatter ?
+    csp_topology_cmp_scatter : csp_topology_cmp_compact);
+
+  /* There may be less allowed cpus than pids. */
+  csp_topology.np = np;
+  for (size_t pid = 0; pid < np; pid++) {
+    csp_topology.pid_cpus[pid] = pid % csp_topology.ncpus;
+  }
+  return true;
+}
+
+csp_topology_affinity_t csp_topology_affinity(void) {
+  return csp_topology.affinity;
+}
+
+int csp_topology_cpu(size_t pid) {
+  if (csp_topology.np == 0) {
+    return -1;
+  }
+  return csp_topology.cpus[csp_topology.pid_cpus[pid % csp_topology.np]].id;
+}
+
+int csp_topology_node(size_t pid) {
+  if (csp_topology.np == 0) {
+    return -1;
+  }
+  return csp_topology.cpus[csp_topology.pid_cpus[pid % csp_topology.np]].node;
+}
+
+int csp_topology_dist(size_t a, size_t b) {
+  if (csp_topology.np == 0) {
+    return csp_topology_dist_remote;
+  }
+  csp_topology_cpu_t
+    *x = &csp_topology.cpus[csp_topology.pid_cpus[a % csp_topology.np]],
+    *y = &csp_topology.cpus[csp_topology.pid_cpus[b % csp_topology.np]];
+
+  if (x->id == y->id)     return csp_topology_dist_same;
+  if (x->core == y->core) return csp_topology_dist_sibling;
+  if (x->llc == y->llc)   return csp_topology_dist_llc;
+  if (x->node == y->node) return csp_topology_dist_node;
+  return csp_topology_dist_remote;
+}
+
+/* All the threads of a pid(i.e. its worker or legacy cores) share its cpu. */
+void csp_topology_pin(pthread_t tid, size_t pid) {
+  if (csp_topology.affinity == csp_topology_affinity_none ||
+      csp_topology.np == 0) {
+    return;
+  }
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(csp_topology_cpu(pid), &cpuset);
+  pthread_setaffinity_np(tid, sizeof(cpuset), &cpuset);
+}
+
+/* Prefer the memory of `node` for the range, it is only a hint so failures
+ * are ignored. */
+void csp_topology_bind(void *addr, size_t len, int node) {
+  if (csp_topology.nnodes <= 1 || node < 0 ||
+      csp_topology.affinity == csp_topology_affinity_none) {
+    return;
+  }
+  unsigned long mask[16] = {0};
+  if ((size_t)node >= sizeof(mask) * 8) {
+    return;
+  }
+  mask[node / (sizeof(unsigned long) * 8)] |=
+    1UL << (node % (sizeof(unsigned long) * 8));
+  syscall(SYS_mbind, addr, len, csp_topology_mpol_preferred, mask,
+    sizeof(mask) * 8, 0);
+}
+
+void csp_topology_destroy(void) {
+  free(csp_topology.cpus);
+  free(csp_topology.pid_cpus);
+  csp_topology.cpus = NULL;
+  csp_topology.pid_cpus = NULL;
+  csp_topology.ncpus = csp_topology.np = 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef LIBCSP_TOPOLOGY_H
+#define LIBCSP_TOPOLOGY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* How the threads of each pid are pinned, set by `LIBCSP_AFFINITY`. */
+typedef enum {
+  /* Don't pin any thread. */
+  csp_topology_affinity_none,
+
+  /* Fill the physical cores of a LLC first, then the LLCs of a NUMA node, then
+   * the next node. It is the default. */
+  csp_topology_affinity_compact,
+
+  /* Spread the pids across the NUMA nodes and the LLCs of each node. */
+  csp_topology_affinity_scatter
+} csp_topology_affinity_t;
+
+/* Distances between the cpus of two pids, from near to far. */
+#define csp_topology_dist_same     0
+#define csp_topology_dist_sibling  1
+#define csp_topology_dist_llc      2
+#define csp_topology_dist_node     3
+#define csp_topology_dist_remote   4
+
+bool csp_topology_init(size_t np);
+csp_topology_affinity_t csp_topology_affinity(void);
+int csp_topology_cpu(size_t pid);
+int csp_topology_node(size_t pid);
+int csp_topology_dist(size_t a, size_t b);
+void csp_topology_pin(pthread_t tid, size_t pid);
+void csp_topology_bind(void *addr, size_t len, int node);
+void csp_topology_destroy(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,332 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "trace.h"
+#include "core.h"
+#include "proc_extra.h"
+#include "timer.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+/* Events kept by every thread, the oldest ones are overwritten once the ring
+ * is full, so the last ones are always there to be dumped. */
+#define csp_trace_buf_len       (1 << 16)
+
+/* Events copied from a ring at a time when writing them. */
+#define csp_trace_chunk_len     256
+
+/* How often the continuous writer drains the rings. */
+#define csp_trace_flush_usecs   100000
+
+/* The TSC is calibrated against the monotonic clock over at least this. */
+#define csp_trace_calib_nsecs   (10 * csp_timer_millisecond)
+
+/* The ring of a thread. It's written by its thread only without any lock,
+ * the readers copy the events and drop the ones overwritten meanwhile. */
+typedef struct csp_trace_buf_s {
+    struct csp_trace_buf_s *next;
+    int id;
+    pid_t ktid;
+    int cpu;
+
+    /* Where the readers stopped, guarded by csp_trace_writer.mutex. */
+    uint64_t read;
+    /* Whether the thread name was written to the continuous output. */
+    bool named;
+
+    _Alignas(64) atomic_uint_fast64_t head;
+    csp_trace_event_t events[csp_trace_buf_len];
+} csp_trace_buf_t;
+
+atomic_bool csp_trace_on = false;
+
+static _Thread_local csp_trace_buf_t *csp_trace_buf;
+
+static struct {
+    pthread_mutex_t mutex;
+    csp_trace_buf_t *_Atomic bufs;
+    int nbufs;
+
+    /* The TSC and the time tracing was first enabled, the rate is measured
+     * from them when writing. */
+    uint64_t tsc0;
+    int64_t ns0;
+
+    /* The continuous output and its writer thread. */
+    FILE *out;
+    pthread_t writer;
+    bool writing;
+    uint64_t lost;
+} csp_trace_writer = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static const char *csp_trace_names[] = {
+    "spawn", "run", "block", "unblock", "yield", "preempt", "exit", "steal",
+    "park", "unpark",
+};
+
+static const char *csp_trace_reasons[] = {
+    "chan", "mutex", "waitgroup", "netpoll", "timer", "syscall",
+};
+
+static int64_t csp_trace_mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * csp_timer_second + ts.tv_nsec;
+}
+
+static csp_trace_buf_t *csp_trace_buf_new(void) {
+    csp_trace_buf_t *buf = (csp_trace_buf_t *)calloc(1, sizeof(*buf));
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf->ktid = (pid_t)syscall(SYS_gettid);
+    buf->cpu = csp_this_core != NULL ? (int)csp_this_core->pid : -1;
+
+    pthread_mutex_lock(&csp_trace_writer.mutex);
+    buf->id = csp_trace_writer.nbufs++;
+    buf->next = atomic_load(&csp_trace_writer.bufs);
+    atomic_store(&csp_trace_writer.bufs, buf);
+    pthread_mutex_unlock(&csp_trace_writer.mutex);
+    return csp_trace_buf = buf;
+}
+
+/* The running proc must not be moved to another thread while it writes the
+ * ring of this one, there is no need to yield for a preemption deferred here
+ * either. */
+void csp_trace_emit(int type, const void *proc, int32_t arg) {
+    csp_scheduler_nopreempt++;
+    csp_soft_mbarr();
+
+    csp_trace_buf_t *buf = csp_trace_buf;
+    if (csp_likely(buf != NULL) || (buf = csp_trace_buf_new()) != NULL) {
+        uint64_t head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+        csp_trace_event_t *event = &buf->events[head & (csp_trace_buf_len - 1)];
+        event->ts = __rdtsc();
+        event->proc = (uintptr_t)proc;
+        event->arg = arg;
+        event->type = (uint32_t)type;
+        atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+    }
+
+    csp_soft_mbarr();
+    csp_scheduler_nopreempt--;
+}
+
+void csp_trace_enable(bool enable) {
+    pthread_mutex_lock(&csp_trace_writer.mutex);
+    if (enable && csp_trace_writer.ns0 == 0) {
+        csp_trace_writer.tsc0 = __rdtsc();
+        csp_trace_writer.ns0 = csp_trace_mono_now();
+    }
+    atomic_store(&csp_trace_on, enable);
+    pthread_mutex_unlock(&csp_trace_writer.mutex);
+}
+
+/* TSC ticks per microsecond. */
+static double csp_trace_tsc_rate(void) {
+    int64_t elapsed;
+    while ((elapsed = csp_trace_mono_now() - csp_trace_writer.ns0) <
+           csp_trace_calib_nsecs) {
+        usleep((csp_trace_calib_nsecs - elapsed) / csp_timer_microsecond + 1);
+    }
+    return (double)(__rdtsc() - csp_trace_writer.tsc0) * 1000 / elapsed;
+}
+
+static void csp_trace_write_name(FILE *f, csp_trace_buf_t *buf) {
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+            "\"args\":{\"name\":\"thread %d (cpu %d)\"}},\n",
+            buf->id, (int)buf->ktid, buf->cpu);
+}
+
+static void csp_trace_write_event(FILE *f, csp_trace_buf_t *buf,
+                                  csp_trace_event_t *event, double rate) {
+    double ts = event->ts > csp_trace_writer.tsc0 ?
+        (double)(event->ts - csp_trace_writer.tsc0) / rate : 0;
+    const char *name = event->type < sizeof(csp_trace_names) / sizeof(char *) ?
+        csp_trace_names[event->type] : "unknown";
+
+    switch (event->type) {
+    case csp_trace_run:
+        fprintf(f, "{\"name\":\"proc %#lx\",\"ph\":\"B\",\"ts\":%.3f,"
+                "\"pid\":1,\"tid\":%d},\n", (unsigned long)event->proc, ts,
+                buf->id);
+        break;
+    case csp_trace_block:
+        fprintf(f, "{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"end\":\"block\",\"reason\":\"%s\"}},\n", ts,
+                buf->id, event->arg >= 0 && event->arg <
+                (int32_t)(sizeof(csp_trace_reasons) / sizeof(char *)) ?
+                csp_trace_reasons[event->arg] : "unknown");
+        break;
+    case csp_trace_yield:
+    case csp_trace_preempt:
+    case csp_trace_exit:
+        fprintf(f, "{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"end\":\"%s\"}},\n", ts, buf->id, name);
+        break;
+    default:
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                "\"pid\":1,\"tid\":%d,\"args\":{\"proc\":\"%#lx\",\"arg\":%d}},\n",
+                name, ts, buf->id, (unsigned long)event->proc, (int)event->arg);
+    }
+}
+
+/* Write the events of `buf` not read yet, the ones overwritten before they
+ * are copied are counted as lost. */
+static void csp_trace_drain(FILE *f, csp_trace_buf_t *buf, double rate) {
+    csp_trace_event_t chunk[csp_trace_chunk_len];
+    uint64_t head = atomic_load_explicit(&buf->head, memory_order_acquire);
+    uint64_t from = buf->read;
+
+    if (head - from > csp_trace_buf_len) {
+        csp_trace_writer.lost += head - from - csp_trace_buf_len;
+        from = head - csp_trace_buf_len;
+    }
+    while (from < head) {
+        size_t n = head - from < csp_trace_chunk_len ?
+            head - from : csp_trace_chunk_len;
+        for (size_t i = 0; i < n; i++) {
+            chunk[i] = buf->events[(from + i) & (csp_trace_buf_len - 1)];
+        }
+        /* The slot of event `i` is reused by the one `csp_trace_buf_len` after
+         * it, which may be being written while the head is one behind it. */
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t now = atomic_load_explicit(&buf->head, memory_order_relaxed);
+        for (size_t i = 0; i < n; i++) {
+            if (from + i + csp_trace_buf_len > now) {
+                csp_trace_write_event(f, buf, &chunk[i], rate);
+            } else {
+                csp_trace_writer.lost++;
+            }
+        }
+        from += n;
+    }
+    buf->read = head;
+}
+
+/* Write the events recorded since the last dump to `path`, in the JSON format
+ * of the Chrome trace viewer which Perfetto opens as well. */
+bool csp_trace_dump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&csp_trace_writer.mutex);
+    double rate = csp_trace_tsc_rate();
+    fprintf(f, "[\n");
+    for (csp_trace_buf_t *buf = atomic_load(&csp_trace_writer.bufs);
+         buf != NULL; buf = buf->next) {
+        csp_trace_write_name(f, buf);
+        csp_trace_drain(f, buf, rate);
+    }
+    fprintf(f, "{\"name\":\"lost\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"events\":%llu}}\n]\n",
+            (unsigned long long)csp_trace_writer.lost);
+    pthread_mutex_unlock(&csp_trace_writer.mutex);
+    return fclose(f) == 0;
+}
+
+static void csp_trace_flush(void) {
+    FILE *f = csp_trace_writer.out;
+    double rate = csp_trace_tsc_rate();
+    for (csp_trace_buf_t *buf = atomic_load(&csp_trace_writer.bufs);
+         buf != NULL; buf = buf->next) {
+        if (!buf->named) {
+            csp_trace_write_name(f, buf);
+            buf->named = true;
+        }
+        csp_trace_drain(f, buf, rate);
+    }
+    fflush(f);
+}
+
+/* The closing bracket is optional in the array format, so the output can be
+ * read even if the process dies before this. */
+static void csp_trace_finish(void) {
+    csp_trace_flush();
+    fprintf(csp_trace_writer.out, "{\"name\":\"lost\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"events\":%llu}}\n]\n",
+            (unsigned long long)csp_trace_writer.lost);
+    fclose(csp_trace_writer.out);
+    csp_trace_writer.out = NULL;
+    csp_trace_writer.writing = false;
+}
+
+static void *csp_trace_writer_loop(void *data) {
+    while (true) {
+        usleep(csp_trace_flush_usecs);
+        pthread_mutex_lock(&csp_trace_writer.mutex);
+        bool writing = csp_trace_writer.writing;
+        if (writing) {
+            if (atomic_load(&csp_trace_on)) {
+                csp_trace_flush();
+            } else {
+                csp_trace_finish();
+                writing = false;
+            }
+        }
+        pthread_mutex_unlock(&csp_trace_writer.mutex);
+        if (!writing) {
+            return NULL;
+        }
+    }
+}
+
+/* Write the rest of the events if the process exits while they are written
+ * continuously. */
+static void csp_trace_atexit(void) {
+    pthread_mutex_lock(&csp_trace_writer.mutex);
+    atomic_store(&csp_trace_on, false);
+    if (csp_trace_writer.writing) {
+        csp_trace_finish();
+    }
+    pthread_mutex_unlock(&csp_trace_writer.mutex);
+}
+
+/* Enable tracing and write the events to `path` continuously until it's
+ * disabled. */
+bool csp_trace_start(const char *path) {
+    pthread_mutex_lock(&csp_trace_writer.mutex);
+    if (csp_trace_writer.writing) {
+        pthread_mutex_unlock(&csp_trace_writer.mutex);
+        return false;
+    }
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        pthread_mutex_unlock(&csp_trace_writer.mutex);
+        return false;
+    }
+    fprintf(f, "[\n");
+    csp_trace_writer.out = f;
+    csp_trace_writer.writing = true;
+    static bool registered = false;
+    if (!registered) {
+        atexit(csp_trace_atexit);
+        registered = true;
+    }
+    for (csp_trace_buf_t *buf = atomic_load(&csp_trace_writer.bufs);
+         buf != NULL; buf = buf->next) {
+        buf->named = false;
+        buf->read = atomic_load(&buf->head);
+    }
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr) != 0 ||
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+        pthread_create(&csp_trace_writer.writer, &attr, csp_trace_writer_loop,
+                       NULL) != 0) {
+        fclose(f);
+        csp_trace_writer.out = NULL;
+        csp_trace_writer.writing = false;
+        pthread_mutex_unlock(&csp_trace_writer.mutex);
+        return false;
+    }
+    pthread_attr_destroy(&attr);
+    pthread_mutex_unlock(&csp_trace_writer.mutex);
+
+    csp_trace_enable(true);
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef LIBCSP_TRACE_H
+#define LIBCSP_TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The events recorded by the tracer. `run` starts a slice of the proc on the
+ * thread, which ends with `block`, `yield`, `preempt` or `exit`. */
+typedef enum {
+    csp_trace_spawn,
+    csp_trace_run,
+    csp_trace_block,
+    csp_trace_unblock,
+    csp_trace_yield,
+    csp_trace_preempt,
+    csp_trace_exit,
+    csp_trace_steal,
+    csp_trace_park,
+    csp_trace_unpark,
+} csp_trace_type_t;
+
+/* The argument of csp_trace_block. */
+typedef enum {
+    csp_trace_reason_chan,
+    csp_trace_reason_mutex,
+    csp_trace_reason_waitgroup,
+    csp_trace_reason_netpoll,
+    csp_trace_reason_timer,
+    csp_trace_reason_syscall,
+} csp_trace_reason_t;
+
+typedef struct {
+    /* The TSC of the cpu when the event happened. */
+    uint64_t ts;
+    /* The proc the event is about, 0 if there is none. */
+    uint64_t proc;
+    /* The reason of csp_trace_block, the victim of csp_trace_steal, the worker
+     * of csp_trace_park and csp_trace_unpark(-1 for a spare core), the class
+     * of csp_trace_spawn. */
+    int32_t arg;
+    uint32_t type;
+} csp_trace_event_t;
+
+extern atomic_bool csp_trace_on;
+
+void csp_trace_emit(int type, const void *proc, int32_t arg);
+void csp_trace_enable(bool enable);
+bool csp_trace_dump(const char *path);
+bool csp_trace_start(const char *path);
+
+/* Costs a load and a branch while the tracer is off. */
+#define csp_trace(type, proc, arg) do {                                        \
+    if (csp_unlikely(atomic_load_explicit(&csp_trace_on,                       \
+                                          memory_order_relaxed))) {            \
+        csp_trace_emit((type), (proc), (arg));                                 \
+    }                                                                          \
+} while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
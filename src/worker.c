@@ -2,9 +2,12 @@
 #include "worker.h"
 #include "scheduler.h"
 #include "core.h"
+#include "csp_sched.h"
+#include "topology.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 
 extern void csp_core_init_main(csp_core_t *core);
 extern void *csp_core_run(void *data);
@@ -13,6 +16,11 @@ extern csp_core_t *csp_core_pool_get(size_t pid);
 csp_worker_t *csp_worker_new(int id) {
     csp_worker_t *worker = (csp_worker_t *)calloc(1, sizeof(csp_worker_t));
     worker->id = id;
+    worker->runq = csp_wrunq_new();
+    if (worker->runq == NULL) {
+        perror("libcsp failed to alloc worker runq.");
+        exit(EXIT_FAILURE);
+    }
     worker->core = csp_core_pool_get(id);
     worker->core->worker = worker;
     return worker;
@@ -20,10 +28,19 @@ csp_worker_t *csp_worker_new(int id) {
 
 void csp_worker_start(csp_worker_t *worker) {
     pthread_create(&worker->tid, NULL, csp_worker_loop, worker);
+    csp_topology_pin(worker->tid, worker->id);
+}
+
+/* Make the current thread the one the worker runs on. */
+void csp_worker_adopt(csp_worker_t *worker) {
+    worker->tid = pthread_self();
+    atomic_store(&worker->ktid, (int)syscall(SYS_gettid));
+    atomic_store(&worker->preempt_requested, &csp_sched_preempt_requested);
 }
 
 void *csp_worker_loop(void *arg) {
     csp_worker_t *worker = (csp_worker_t *)arg;
+    csp_worker_adopt(worker);
     csp_core_run(worker->core);
     return NULL;
 }
@@ -3,6 +3,11 @@
 
 #include "platform.h"
 #include "core.h"
+#include "hist.h"
+#include "proc_extra.h"
+#include "runq.h"
+#include "scheduler.h"
+#include "stats.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -10,12 +15,83 @@ extern "C" {
 
 typedef struct csp_worker_s {
     int id;
+
+    /* The thread running the worker and its kernel id, which change once the
+     * worker is handed off to a spare core, see csp_scheduler_handoff(). The
+     * kernel id is 0 until the new thread adopts the worker. */
     pthread_t tid;
-    csp_core_t *core;
+    atomic_int ktid;
+    csp_core_t *_Atomic core;
+
+    /* The futex word this worker sleeps on when there is nothing to run, it is
+     * 1 while parked and reset to 0 by the one who wakes it up. */
+    _Alignas(64) atomic_int parked;
+
+    /* The csp_sched_preempt_requested of the worker thread, checked by the
+     * safepoints in the user code. */
+    _Atomic(atomic_int *) preempt_requested;
+
+    /* Runnable procs owned by this worker, stolen by others when idle. */
+    csp_wrunq_t *runq;
+
+    /* A proc woken by the one running on this worker, which runs before the
+     * procs in `runq` to keep the data they share in this cpu's cache. */
+    csp_proc_t *_Atomic runnext;
+
+    /* Number of procs dispatched by this worker. */
+    atomic_uint_fast64_t schedtick;
+
+    /* When the last proc was dispatched, read by the thieves to tell whether
+     * `runnext` would wait for long. */
+    atomic_int_fast64_t dispatched_at;
+
+    /* When the current time slice started, procs taken from `runnext` inherit
+     * it instead of starting a new one. It is 0 while the worker is idle, the
+     * preempter only interrupts the worker once it gets older than the
+     * quantum. */
+    atomic_int_fast64_t slice_start;
+
+    /* Priority class of the proc dispatched last time. */
+    atomic_int running_prio;
+
+    /* The other workers sorted by their topology distance to this one, the
+     * thieves try the closer ones first. Workers at the same distance are
+     * visited from a rotating start. */
+    int *steal_order;
+    int *steal_dist;
+
+    /* Nanoseconds the procs dispatched by this worker waited in the runqs,
+     * only recorded by the thread owning the worker. */
+    csp_hist_t latency;
+
+    /* Written by the thread owning the worker only. */
+    csp_stats_t stats;
 } csp_worker_t;
 
+/* Count an event on the worker of the current thread, or on the counters
+ * shared by the threads owning none(e.g. the monitor, the blocked ones). The
+ * running proc must not be moved to another thread between reading and
+ * writing the counter. */
+static inline void csp_worker_stats_add(int type, uint64_t n) {
+    csp_scheduler_nopreempt++;
+    csp_soft_mbarr();
+
+    csp_core_t *core = csp_this_core;
+    csp_worker_t *w = core != NULL ? (csp_worker_t *)core->worker : NULL;
+    if (csp_likely(w != NULL &&
+                   atomic_load_explicit(&w->core, memory_order_relaxed) == core)) {
+        csp_stats_add(&w->stats, type, n);
+    } else if (csp_global_scheduler != NULL) {
+        csp_stats_add_shared(&csp_global_scheduler->stats, type, n);
+    }
+
+    csp_soft_mbarr();
+    csp_scheduler_nopreempt--;
+}
+
 csp_worker_t *csp_worker_new(int id);
 void csp_worker_start(csp_worker_t *worker);
+void csp_worker_adopt(csp_worker_t *worker);
 void *csp_worker_loop(void *arg);
 
 #ifdef __cplusplus
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/cond.h"
+
+#define ROUNDS 1000
+
+csp_cond_t cond;
+atomic_int ready;
+int64_t cpu_used;
+
+int64_t cpu_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * csp_timer_second + ts.tv_nsec;
+}
+
+void *sleeper(void *arg) {
+  int64_t start = cpu_now();
+  csp_cond_before_wait(&cond);
+  assert(csp_cond_wait(&cond) == csp_cond_signal_deep_sleep);
+  cpu_used = cpu_now() - start;
+  return NULL;
+}
+
+void *waiter(void *arg) {
+  for (int i = 0; i < ROUNDS; i++) {
+    atomic_store(&ready, i + 1);
+    int signal = csp_cond_wait(&cond);
+    assert(signal == (i % 2 == 0 ? csp_cond_signal_proc_avail :
+      csp_cond_signal_deep_sleep));
+  }
+  return NULL;
+}
+
+/* The signal sent before the wait isn't lost. */
+void test_signal_first(void) {
+  csp_cond_init(&cond);
+  csp_cond_signal(&cond, csp_cond_signal_proc_avail);
+  assert(csp_cond_wait(&cond) == csp_cond_signal_proc_avail);
+  assert(atomic_load(&cond.stat) == csp_cond_signal_none);
+}
+
+/* The waiter sleeps in the kernel rather than burning the cpu. */
+void test_sleep(void) {
+  pthread_t tid;
+  csp_cond_init(&cond);
+  assert(pthread_create(&tid, NULL, sleeper, NULL) == 0);
+  usleep(200000);
+  csp_cond_signal(&cond, csp_cond_signal_deep_sleep);
+  assert(pthread_join(tid, NULL) == 0);
+  assert(cpu_used < 50 * csp_timer_millisecond);
+}
+
+/* Every wait gets the signal paired with it. */
+void test_pairs(void) {
+  pthread_t tid;
+  csp_cond_init(&cond);
+  atomic_store(&ready, 0);
+  assert(pthread_create(&tid, NULL, waiter, NULL) == 0);
+  for (int i = 0; i < ROUNDS; i++) {
+    while (atomic_load(&ready) != i + 1);
+    if (i % 7 == 0) {
+      usleep(100);
+    }
+    csp_cond_signal(&cond, i % 2 == 0 ? csp_cond_signal_proc_avail :
+      csp_cond_signal_deep_sleep);
+  }
+  assert(pthread_join(tid, NULL) == 0);
+}
+
+int main(void) {
+  test_signal_first();
+  test_sleep();
+  test_pairs();
+}
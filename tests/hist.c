@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020, Yanhui Shi <lime.syh at gmail dot com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include "../src/hist.h"
+
+csp_hist_t hist;
+
+/* Every value falls into the bucket whose range it's in, and the ranges are
+ * contiguous. */
+void test_buckets(void) {
+  for (int i = 0; i < csp_hist_sub_len; i++) {
+    assert(csp_hist_bucket(i) == i);
+    assert(csp_hist_bucket_max(i) == i);
+  }
+  assert(csp_hist_bucket(-1) == 0);
+  for (int i = 1; i < csp_hist_len - 1; i++) {
+    int64_t lo = csp_hist_bucket_max(i - 1) + 1, hi = csp_hist_bucket_max(i);
+    assert(lo <= hi);
+    assert(csp_hist_bucket(lo) == i);
+    assert(csp_hist_bucket(hi) == i);
+    /* The width of a bucket is at most 1/16 of its values. */
+    assert((hi - lo + 1) * csp_hist_sub_len <= lo || lo < csp_hist_sub_len * 2);
+  }
+  assert(csp_hist_bucket(INT64_MAX) == csp_hist_len - 1);
+}
+
+/* The quantiles are within the error of the buckets. */
+void test_quantiles(void) {
+  csp_hist_reset(&hist);
+  assert(csp_hist_quantile(&hist, 0.5) == 0);
+  for (int64_t i = 1; i <= 100000; i++) {
+    csp_hist_record(&hist, i * 1000);
+  }
+  assert(csp_hist_count(&hist) == 100000);
+  int64_t p50 = csp_hist_quantile(&hist, 0.5);
+  int64_t p99 = csp_hist_quantile(&hist, 0.99);
+  int64_t p999 = csp_hist_quantile(&hist, 0.999);
+  assert(p50 >= 50000000 && p50 <= 50000000 + 50000000 / 16);
+  assert(p99 >= 99000000 && p99 <= 99000000 + 99000000 / 16);
+  assert(p999 >= 99900000 && p999 <= 100000000);
+  assert(csp_hist_quantile(&hist, 1) == 100000000);
+  assert(atomic_load(&hist.max) == 100000000);
+}
+
+/* The merged histogram has the counters of both. */
+void test_merge(void) {
+  csp_hist_t other = {0}, merged = {0};
+  csp_hist_reset(&hist);
+  for (int i = 0; i < 99; i++) {
+    csp_hist_record(&hist, 10);
+  }
+  csp_hist_record(&other, 1000000);
+  csp_hist_merge(&merged, &hist);
+  csp_hist_merge(&merged, &other);
+  assert(csp_hist_count(&merged) == 100);
+  assert(atomic_load(&merged.sum) == 99 * 10 + 1000000);
+  assert(csp_hist_quantile(&merged, 0.5) == 10);
+  assert(csp_hist_quantile(&merged, 0.999) == 1000000);
+}
+
+int main(void) {
+  test_buckets();
+  test_quantiles();
+  test_merge();
+}
@@ -20,6 +20,9 @@
 
 int csp_sched_np = 1;
 _Thread_local csp_core_t *csp_this_core = &(csp_core_t){.pid = 0};
+_Thread_local int csp_scheduler_nopreempt;
+_Thread_local bool csp_scheduler_preempt_deferred;
+void csp_scheduler_preempt_deferred_yield(void) {}
 void csp_sched_yield(void) {}
 
 void test_meta_index(void) {
@@ -269,6 +272,302 @@ void test_tree_node(void) {
   csp_rbtree_destroy(heap.tree, heap.all_nodes);
 }
 
+void test_span_list(void) {
+  assert(csp_mem_span_nclasses == 1024);
+  assert(csp_mem_span_nwords == 16);
+
+  csp_mem_heap_t heap = {.start = 0, .tree = csp_rbtree_new()};
+  memset(&heap.cache_nodes, 0, sizeof(heap.cache_nodes));
+  memset(&heap.spans, 0, sizeof(heap.spans));
+  memset(&heap.span_bits, 0, sizeof(heap.span_bits));
+  memset(&heap.span_words, 0, sizeof(heap.span_words));
+  heap.metas[0] = csp_mem_meta_new(0);
+
+  int npages[] = {3, 5, 5, 70, 2000};
+  csp_mem_span_t *spans[5];
+  for (int i = 0; i < 5; i++) {
+    spans[i] = csp_mem_meta_span_by_l1l2(&heap, 0, (i + 1) * 4096);
+    csp_mem_span_npages_set(spans[i], npages[i]);
+    csp_mem_heap_put_span(&heap, spans[i]);
+  }
+  assert(heap.spans[0][3] == spans[0] && heap.spans[0][5] == spans[2]);
+  assert(heap.tails[5] == spans[1]);
+  assert(heap.span_bits[0][0] == ((1 << 3) | (1 << 5)));
+  assert(heap.span_bits[0][1] == (uint64_t)1 << 6);
+  assert(heap.span_words[0] == 0x03);
+
+  /* The smallest fitting span is found, in the tree for the large ones. */
+  assert(csp_mem_heap_find_span(&heap, 1) == spans[0]);
+  assert(csp_mem_heap_find_span(&heap, 3) == spans[0]);
+  assert(csp_mem_heap_find_span(&heap, 4) == spans[2]);
+  assert(csp_mem_heap_find_span(&heap, 6) == spans[3]);
+  assert(csp_mem_heap_find_span(&heap, 71) == spans[4]);
+  assert(csp_mem_heap_find_span(&heap, 1024) == spans[4]);
+  assert(csp_mem_heap_find_span(&heap, 2001) == NULL);
+
+  /* The bits are cleared with the lists emptied. */
+  assert(csp_mem_heap_del_span(&heap, spans[2]) == spans[1]);
+  assert(heap.spans[0][5] == spans[1] && heap.tails[5] == spans[1]);
+  assert(csp_mem_heap_del_span(&heap, spans[1]) == NULL);
+  assert(heap.span_bits[0][0] == (1 << 3));
+  assert(csp_mem_heap_find_span(&heap, 4) == spans[3]);
+  assert(csp_mem_heap_del_span(&heap, spans[3]) == NULL);
+  assert(heap.span_words[0] == 0x01);
+  assert(csp_mem_heap_find_span(&heap, 4) == spans[4]);
+  csp_mem_heap_del_span(&heap, spans[4]);
+  assert(csp_mem_heap_find_span(&heap, 4) == NULL);
+  csp_mem_heap_del_span(&heap, spans[0]);
+  assert(heap.span_words[0] == 0 && heap.spans[0][3] == NULL);
+  assert(heap.tails[3] == NULL);
+  for (int i = 0; i < 5; i++) {
+    assert(csp_mem_meta_index_is_zero(spans[i]->fp_pre));
+    assert(csp_mem_meta_index_is_zero(spans[i]->fp_next));
+  }
+
+  csp_mem_meta_destroy(heap.metas[0]);
+  csp_rbtree_destroy(heap.tree, heap.all_nodes);
+}
+
+void test_coalesce(void) {
+  assert(csp_mem_init());
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+  csp_mem_span_t *first = csp_mem_heap_find_span(heap, 1);
+  int n = csp_mem_span_npages_get(first);
+
+  void *a = csp_mem_alloc(0, 1 << 12);
+  void *b = csp_mem_alloc(0, 2 << 12);
+  void *c = csp_mem_alloc(0, 3 << 12);
+  assert((uintptr_t)b == (uintptr_t)a + (1 << 12));
+  assert((uintptr_t)c == (uintptr_t)b + (2 << 12));
+  assert(csp_mem_span_npages_get(csp_mem_heap_find_span(heap, 1)) == n - 6);
+
+  /* The span is merged with the free ones at both sides. */
+  csp_mem_free(a);
+  assert(heap->spans[0][1] == first);
+  csp_mem_free(c);
+  assert(heap->span_words[0] == (uint64_t)1);
+  csp_mem_span_t *span = csp_mem_heap_find_span(heap, 2);
+  assert(span == csp_mem_meta_span_by_addr(heap, c));
+  assert(csp_mem_span_npages_get(span) == n - 3);
+  csp_mem_free(b);
+  assert(heap->span_words[0] == 0);
+  assert(csp_mem_heap_find_span(heap, 1) == first);
+  assert(csp_mem_span_npages_get(first) == n);
+  assert(csp_mem_meta_index_is_zero(first->mt_next));
+
+  csp_mem_destroy();
+}
+
+void test_scavenge(void) {
+  assert(csp_mem_init());
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+  size_t mapped, released, scavenged;
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(mapped == csp_mem_arena_size);
+  assert(released == mapped - csp_mem_page_size && scavenged == 0);
+
+  /* Keep the ones around free from merging into one span. */
+  void *objs[7];
+  for (int i = 0; i < 7; i++) {
+    objs[i] = csp_mem_alloc(0, 4 << 12);
+    memset(objs[i], 0xff, 4 << 12);
+  }
+  csp_mem_scavenge(1000000L * csp_mem_scavenge_default_age);
+  csp_mem_free(objs[1]);
+  csp_mem_free(objs[3]);
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(released == mapped - csp_mem_page_size - (28 << 12));
+  assert(csp_mem_heap_class_below(heap, csp_mem_span_nclasses) == 4);
+  assert(csp_mem_heap_class_below(heap, 5) == 4);
+  assert(csp_mem_heap_class_below(heap, 4) == 0);
+
+  /* The spans are released once they are old enough. */
+  csp_mem_scavenge(1000000L * csp_mem_scavenge_default_age * 2 - 1000000);
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(scavenged == 0);
+  csp_mem_scavenge(1000000L * csp_mem_scavenge_default_age * 2);
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(scavenged == 8 << 12);
+  assert(released == mapped - csp_mem_page_size - (20 << 12));
+  assert(heap->span_words[0] == 0);
+
+  /* The oldest one is released first. */
+  csp_mem_span_t *span = heap->spans[1][4];
+  assert(span == csp_mem_meta_span_by_addr(heap, objs[3]) && span->released);
+  span = csp_mem_meta_span_by_index(heap, span->fp_next);
+  assert(span == csp_mem_meta_span_by_addr(heap, objs[1]) && span->released);
+
+  unsigned char vec[4];
+  assert(mincore(objs[3], 4 << 12, vec) == 0);
+  assert((vec[0] & 1) == 0);
+
+  /* The resident spans are taken first, and the released ones are zeroed. */
+  csp_mem_free(objs[5]);
+  assert(csp_mem_alloc(0, 4 << 12) == objs[5]);
+  void *obj = csp_mem_alloc(0, 4 << 12);
+  assert(obj == objs[3]);
+  assert(((uint64_t *)obj)[0] == 0);
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(released == mapped - csp_mem_page_size - (24 << 12));
+
+  /* The young ones are released too above the target, the first one with the
+   * released one merged. */
+  csp_mem_free(objs[0]);
+  csp_mem_set_target_rss(1);
+  csp_mem_scavenge(1000000L * csp_mem_scavenge_default_age * 2);
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(scavenged == 16 << 12);
+  csp_mem_set_target_rss(0);
+
+  /* A large span is released a batch at a time, and it's whole again once all
+   * of it is released. */
+  void *big = csp_mem_alloc(0, 1024 << 12);
+  memset(big, 0xff, 1024 << 12);
+  csp_mem_free(big);
+  span = csp_mem_meta_span_by_addr(heap, big);
+  int npages = csp_mem_span_npages_get(span);
+  assert(!span->released && npages > csp_mem_scavenge_batch);
+  size_t last = scavenged;
+  csp_mem_scavenge(1000000L * csp_mem_scavenge_default_age * 3);
+  assert(span->released && csp_mem_span_npages_get(span) == npages);
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(scavenged == last + ((size_t)npages << 12));
+
+  csp_mem_set_scavenge_age(0);
+  assert(csp_mem_scavenge_age() == 0);
+  csp_mem_set_scavenge_age(-1);
+  assert(csp_mem_scavenge_age() == csp_mem_scavenge_default_age * 1000000L);
+
+  csp_mem_destroy();
+}
+
+void test_hugepages(void) {
+  setenv("LIBCSP_HUGEPAGES", "bogus", 1);
+  assert(!csp_mem_init());
+  setenv("LIBCSP_HUGEPAGES", "thp", 1);
+  assert(csp_mem_init());
+  assert(csp_mem.huge == csp_mem_huge_thp);
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+
+  /* The objects allocated at once are carved from one span, and they are freed
+   * one by one. */
+  void *objs[16];
+  csp_mem_allocm(0, 2 << 12, objs, 16);
+  for (int i = 1; i < 16; i++) {
+    assert((uintptr_t)objs[i] == (uintptr_t)objs[i - 1] + (2 << 12));
+    csp_mem_span_t *span = csp_mem_meta_span_by_addr(heap, objs[i]);
+    assert(csp_mem_span_npages_get(span) == 2);
+    assert(csp_mem_meta_taken_bit_by_index(heap, span->index));
+  }
+  csp_mem_free(objs[3]);
+  assert(csp_mem_alloc(0, 2 << 12) == objs[3]);
+  csp_mem_free(objs[5]);
+
+  /* Only the whole huge pages of the free spans are released, and only they
+   * are counted. */
+  void *big = csp_mem_alloc(0, 6 << 20);
+  memset(big, 0xff, 6 << 20);
+  csp_mem_free(big);
+  csp_mem_set_scavenge_age(0);
+  csp_mem_scavenge(0);
+  assert(heap->span_words[0] != 0);
+
+  uintptr_t huge = ((uintptr_t)big + csp_mem_huge_page_mask) &
+    ~csp_mem_huge_page_mask;
+  unsigned char vec[1];
+  assert(mincore(big, 1 << 12, vec) == 0 && (vec[0] & 1) == 1);
+  assert(mincore((void *)huge, 1 << 12, vec) == 0 && (vec[0] & 1) == 0);
+
+  size_t mapped, released, scavenged;
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(scavenged == (uintptr_t)objs[0] - csp_mem_page_size +
+    csp_mem_arena_size - huge);
+  assert(released == scavenged);
+
+  /* The spans in the lists are released too if they have whole huge pages. */
+  void *mid = csp_mem_alloc(0, 1000 << 12);
+  assert(mid == big);
+  csp_mem_alloc(0, 8 << 12);
+  memset(mid, 0xff, 1000 << 12);
+  csp_mem_free(mid);
+  csp_mem_scavenge(0);
+  csp_mem_set_scavenge_age(-1);
+
+  /* The edge after the whole huge page is cut off and stays resident. */
+  csp_mem_span_t *span = csp_mem_meta_span_by_addr(heap, mid);
+  assert(span->released && csp_mem_span_npages_get(span) ==
+    (huge + csp_mem_huge_page_size - (uintptr_t)mid) >> 12);
+  assert(span->kept == (huge - (uintptr_t)mid) >> 12);
+  assert(mincore(mid, 1 << 12, vec) == 0 && (vec[0] & 1) == 1);
+  assert(mincore((void *)huge, 1 << 12, vec) == 0 && (vec[0] & 1) == 0);
+  size_t last = scavenged;
+  csp_mem_stats(&mapped, &released, &scavenged);
+  assert(scavenged == last + (512 << 12));
+
+  unsetenv("LIBCSP_HUGEPAGES");
+  csp_mem_destroy();
+}
+
+void test_slab(void) {
+  assert(csp_mem_slab_class(0) == 0);
+  assert(csp_mem_slab_class(16) == 0);
+  assert(csp_mem_slab_class(17) == 1);
+  assert(csp_mem_slab_class(128) == 7);
+  assert(csp_mem_slab_class(129) == 8);
+  assert(csp_mem_slab_class(384) == 10);
+  assert(csp_mem_slab_class(512) == 11);
+  for (int i = 1; i <= csp_mem_slab_max; i++) {
+    assert(csp_mem_slab_sizes[csp_mem_slab_class(i)] >= i);
+  }
+
+  assert(csp_mem_init());
+  csp_mem_heap_t *heap = &csp_mem.heaps[0];
+
+  /* The objects are zeroed and never page aligned. */
+  int cap = csp_mem_slab_cap(0);
+  void *objs[2 * cap];
+  for (int i = 0; i < 2 * cap; i++) {
+    objs[i] = csp_mem_obj_alloc(16);
+    assert(csp_mem_slab_is_obj(objs[i]));
+    assert(((uint64_t *)objs[i])[0] == 0 && ((uint64_t *)objs[i])[1] == 0);
+    memset(objs[i], 0xff, 16);
+    assert(csp_mem_slab_by_obj(objs[i])->klass == 0);
+  }
+  assert(heap->slabs[0] == NULL);
+  assert(csp_mem_slab_by_obj(objs[0]) != csp_mem_slab_by_obj(objs[cap]));
+
+  /* The slabs freed up are returned to the heap except the last one. */
+  for (int i = 0; i < 2 * cap; i++) {
+    csp_mem_obj_free(objs[i]);
+  }
+  assert(heap->slabs[0] != NULL);
+  assert(heap->slabs[0]->next == NULL && heap->slabs[0]->pre == NULL);
+  assert(heap->slabs[0]->nfree == cap);
+  void *obj = csp_mem_obj_alloc(10);
+  assert(csp_mem_slab_by_obj(obj) == heap->slabs[0]);
+  assert(((uint64_t *)obj)[0] == 0);
+  csp_mem_obj_free(obj);
+
+  /* The objects freed by other cores are returned through the mailboxes. */
+  obj = csp_mem_obj_alloc(64);
+  csp_mem_slab_t *slab = csp_mem_slab_by_obj(obj);
+  assert(slab->klass == 3 && slab->nfree == csp_mem_slab_cap(3) - 1);
+  csp_core_t *core = csp_this_core;
+  csp_this_core = NULL;
+  csp_mem_obj_free(obj);
+  csp_this_core = core;
+  assert(slab->nfree == csp_mem_slab_cap(3) - 1);
+  assert(csp_mem_heap_drain(heap));
+  assert(slab->nfree == csp_mem_slab_cap(3));
+
+  /* The large ones take whole pages. */
+  obj = csp_mem_obj_alloc(csp_mem_slab_max + 1);
+  assert(!csp_mem_slab_is_obj(obj));
+  csp_mem_obj_free(obj);
+
+  csp_mem_destroy();
+}
+
 int main(void) {
   test_page();
   test_span();
@@ -278,5 +577,10 @@ int main(void) {
   test_heap();
   test_arena();
   test_tree_node();
+  test_span_list();
+  test_coalesce();
+  test_scavenge();
+  test_hugepages();
   test_meta();
+  test_slab();
 }
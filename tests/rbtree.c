@@ -122,7 +122,9 @@ void test_rbtree_in_order(void) {
   for (int i = 0; i < max_num; i++) {
     csp_rbtree_node_t *node = csp_rbtree_find(tree, i);
     assert(node);
-    csp_rbtree_delete(tree, node);
+    /* The node holds the successor if it's returned. */
+    csp_rbtree_node_t *moved = csp_rbtree_delete(tree, node);
+    assert(moved == NULL || (moved == node && node->key > i));
     csp_rbtree_verify(tree);
 
     assert(csp_rbtree_find(tree, i) == NULL);
@@ -159,7 +161,8 @@ void test_rbtree_in_random(void) {
     if (node == NULL) {
       continue;
     }
-    csp_rbtree_delete(tree, node);
+    csp_rbtree_node_t *moved = csp_rbtree_delete(tree, node);
+    assert(moved == NULL || (moved == node && node->key > i));
     csp_rbtree_verify(tree);
     assert(csp_rbtree_find(tree, i) == NULL);
   }
@@ -185,7 +188,8 @@ void test_rbtree_in_random1(void) {
       if (node == NULL) {
         continue;
       }
-      csp_rbtree_delete(tree, node);
+      csp_rbtree_node_t *moved = csp_rbtree_delete(tree, node);
+      assert(moved == NULL || (moved == node && node->key > i));
       csp_rbtree_verify(tree);
       assert(csp_rbtree_find(tree, i) == NULL);
     }
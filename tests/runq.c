@@ -27,13 +27,20 @@ size_t csp_procs_size[] = {4096};
 
 void csp_sched_yield(void) {}
 
+/* Referenced by proc.c, the production scheduler isn't linked here. */
+csp_scheduler_t *csp_global_scheduler = NULL;
+void csp_preempt_helper(uintptr_t sp) {}
+_Thread_local int csp_scheduler_nopreempt;
+_Thread_local bool csp_scheduler_preempt_deferred;
+void csp_scheduler_preempt_deferred_yield(void) {}
+
 void test_lrunq(void) {
   size_t cap_exp = 3, cap = 1 << cap_exp;
   csp_proc_t *proc = NULL;
 
   csp_lrunq_t *runq = csp_lrunq_new();
   assert(csp_lrunq_len(runq) == 0);
-  assert(!csp_lrunq_try_pop_front(runq, &proc));
+  assert(csp_lrunq_try_pop_front(runq, &proc) == csp_lrunq_failed);
 
   csp_proc_t *proc1 = csp_proc_new(0, false);
   csp_proc_t *proc2 = csp_proc_new(0, false);
@@ -44,10 +51,10 @@ void test_lrunq(void) {
   csp_lrunq_push(runq, proc3);
 
   /* Test the order of poped processes. */
-  assert(csp_lrunq_try_pop_front(runq, &proc) && proc == proc1);
-  assert(csp_lrunq_try_pop_front(runq, &proc) && proc == proc2);
-  assert(csp_lrunq_try_pop_front(runq, &proc) && proc == proc3);
-  assert(!csp_lrunq_try_pop_front(runq, &proc));
+  assert(csp_lrunq_try_pop_front(runq, &proc) == csp_lrunq_ok && proc == proc1);
+  assert(csp_lrunq_try_pop_front(runq, &proc) == csp_lrunq_ok && proc == proc2);
+  assert(csp_lrunq_try_pop_front(runq, &proc) == csp_lrunq_ok && proc == proc3);
+  assert(csp_lrunq_try_pop_front(runq, &proc) == csp_lrunq_failed);
 
   csp_proc_destroy(proc1);
   csp_proc_destroy(proc2);
@@ -77,7 +84,74 @@ void test_grunq(void) {
   csp_grunq_destroy(grunq);
 }
 
+#define csp_wrunq_test_stealers 3
+#define csp_wrunq_test_procs    100000
+
+static csp_wrunq_t *wrunq_shared;
+static atomic_int_fast64_t wrunq_taken[csp_wrunq_test_procs];
+static atomic_bool wrunq_done;
+
+static void *wrunq_stealer(void *arg) {
+  csp_proc_t *proc;
+  while (!atomic_load(&wrunq_done) || csp_wrunq_len(wrunq_shared) > 0) {
+    if (csp_wrunq_try_steal(wrunq_shared, &proc) == csp_wrunq_ok) {
+      atomic_fetch_add(&wrunq_taken[(int64_t)proc - 1], 1);
+    }
+  }
+  return NULL;
+}
+
+void test_wrunq(void) {
+  csp_proc_t *proc = NULL;
+
+  csp_wrunq_t *wrunq = csp_wrunq_new();
+  assert(csp_wrunq_len(wrunq) == 0);
+  assert(!csp_wrunq_try_pop(wrunq, &proc));
+  assert(csp_wrunq_try_steal(wrunq, &proc) == csp_wrunq_failed);
+
+  for (int64_t i = 1; i <= csp_wrunq_cap; i++) {
+    assert(csp_wrunq_try_push(wrunq, (csp_proc_t *)i));
+  }
+  assert(!csp_wrunq_try_push(wrunq, (csp_proc_t *)-1));
+  assert(csp_wrunq_len(wrunq) == csp_wrunq_cap);
+
+  /* The owner takes from the bottom and the thieves from the top. */
+  assert(csp_wrunq_try_pop(wrunq, &proc) && (int64_t)proc == csp_wrunq_cap);
+  assert(csp_wrunq_try_steal(wrunq, &proc) == csp_wrunq_ok &&
+      (int64_t)proc == 1);
+  while (csp_wrunq_try_pop(wrunq, &proc));
+  assert(csp_wrunq_len(wrunq) == 0);
+  assert(csp_wrunq_try_steal(wrunq, &proc) == csp_wrunq_failed);
+
+  /* Every pushed proc must be taken exactly once under contention. */
+  wrunq_shared = wrunq;
+  pthread_t stealers[csp_wrunq_test_stealers];
+  for (int i = 0; i < csp_wrunq_test_stealers; i++) {
+    pthread_create(&stealers[i], NULL, wrunq_stealer, NULL);
+  }
+  for (int64_t i = 1; i <= csp_wrunq_test_procs; i++) {
+    while (!csp_wrunq_try_push(wrunq, (csp_proc_t *)i)) {
+      if (csp_wrunq_try_pop(wrunq, &proc)) {
+        atomic_fetch_add(&wrunq_taken[(int64_t)proc - 1], 1);
+      }
+    }
+    if (i % 3 == 0 && csp_wrunq_try_pop(wrunq, &proc)) {
+      atomic_fetch_add(&wrunq_taken[(int64_t)proc - 1], 1);
+    }
+  }
+  atomic_store(&wrunq_done, true);
+  for (int i = 0; i < csp_wrunq_test_stealers; i++) {
+    pthread_join(stealers[i], NULL);
+  }
+  for (int64_t i = 0; i < csp_wrunq_test_procs; i++) {
+    assert(atomic_load(&wrunq_taken[i]) == 1);
+  }
+
+  csp_wrunq_destroy(wrunq);
+}
+
 int main(void) {
   test_lrunq();
   test_grunq();
+  test_wrunq();
 }
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define BLOCK_USECS 200000
+
+atomic_bool stop = false;
+atomic_int ticks = 0;
+atomic_int blocked_done = 0;
+volatile int ticks_in_block = -1;
+volatile int ticks_in_syscall = -1;
+
+void ticker(void *arg) {
+    while (!atomic_load(&stop)) {
+        atomic_fetch_add(&ticks, 1);
+        csp_sched_yield();
+    }
+}
+
+/* The thread is handed off to a spare one when entering csp_block(). */
+void block(void *arg) {
+    int before = atomic_load(&ticks);
+    csp_block({ usleep(BLOCK_USECS); });
+    ticks_in_block = atomic_load(&ticks) - before;
+    atomic_fetch_add(&blocked_done, 1);
+}
+
+/* The sysmon finds the thread stuck in the syscall and hands it off. */
+void syscall_proc(void *arg) {
+    int before = atomic_load(&ticks);
+    usleep(BLOCK_USECS);
+    ticks_in_syscall = atomic_load(&ticks) - before;
+    atomic_fetch_add(&blocked_done, 1);
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    csp_proc_create(0, ticker, NULL);
+    csp_proc_create(0, block, NULL);
+    while (atomic_load(&blocked_done) < 1) {
+        usleep(10000);
+    }
+    csp_proc_create(0, syscall_proc, NULL);
+    while (atomic_load(&blocked_done) < 2) {
+        usleep(10000);
+    }
+    atomic_store(&stop, true);
+
+    printf("Ticks while blocked: %d in csp_block, %d in the syscall\n",
+           ticks_in_block, ticks_in_syscall);
+    if (ticks_in_block <= 0) {
+        printf("FAILED: the procs stalled in csp_block.\n");
+        return 1;
+    }
+    if (ticks_in_syscall <= 0) {
+        printf("FAILED: the procs stalled in the syscall.\n");
+        return 1;
+    }
+    printf("SUCCESS: Blocking handoff worked.\n"); fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+#include "chan.h"
+#include "runtime.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define ROUNDS 1000
+
+csp_gochan_t *ch;
+atomic_int done = 0;
+
+void sender(void *arg) {
+    for (long i = 0; i < ROUNDS; i++) {
+        csp_gochan_send(ch, (void *)i);
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+void receiver(void *arg) {
+    for (long i = 0; i < ROUNDS; i++) {
+        csp_gochan_recv(ch, NULL);
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+/* The sum of the samples of `metric` over all the workers. */
+unsigned long long total(const char *text, const char *metric) {
+    unsigned long long sum = 0;
+    size_t len = strlen(metric);
+    for (const char *line = text; line != NULL && *line != '\0';
+         line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (strncmp(line, metric, len) == 0 && line[len] == '{') {
+            sum += strtoull(strchr(line, ' ') + 1, NULL, 10);
+        }
+    }
+    return sum;
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    ch = csp_gochan_new(0);
+    csp_proc_create(0, receiver, NULL);
+    csp_proc_create(0, sender, NULL);
+    while (atomic_load(&done) < 2) {
+        usleep(10000);
+    }
+
+    size_t len = runtime_metrics_write(NULL, 0);
+    char *text = malloc(len + 1);
+    if (runtime_metrics_write(text, len + 1) != len || strlen(text) != len) {
+        printf("FAILED: the metrics were not written.\n");
+        return 1;
+    }
+    unsigned long long blocks = total(text, "libcsp_chan_blocks_total");
+    unsigned long long dispatches = total(text, "libcsp_dispatches_total");
+    unsigned long long switches = total(text, "libcsp_context_switches_total");
+    printf("Chan blocks: %llu, dispatches: %llu, switches: %llu\n", blocks,
+           dispatches, switches);
+    if (blocks < ROUNDS || dispatches < blocks || switches < blocks ||
+        strstr(text, "# TYPE libcsp_dispatches_total counter\n") == NULL ||
+        strstr(text, "libcsp_sched_latency_seconds_count ") == NULL) {
+        printf("FAILED: the counters are wrong.\n");
+        return 1;
+    }
+    free(text);
+    printf("SUCCESS: Metrics worked.\n"); fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+#include "timer.h"
+
+/* LIBCSP_PRODUCTION=1 LIBCSP_PREEMPT=cooperative must be set in environment.
+ *
+ * This file isn't built with the plugin, so the safepoint it would insert at
+ * the loop back edge of loop1 is written by hand. */
+#define SAFEPOINT() do { \
+    if (__builtin_expect(csp_sched_preempt_requested, 0)) csp_sched_safepoint(); \
+} while (0)
+
+volatile int counter1 = 0;
+volatile int loop2_done = 0;
+volatile int loop2_ticks_meanwhile = 0;
+
+void loop1(void *arg) {
+    printf("Loop 1 started\n"); fflush(stdout);
+    while (counter1 < 100000000) {
+        counter1++;
+        if (counter1 % 10000000 == 0) {
+            printf("Loop 1: %d\n", counter1); fflush(stdout);
+        }
+        SAFEPOINT();
+    }
+    printf("Loop 1 finished\n"); fflush(stdout);
+}
+
+void loop2(void *arg) {
+    printf("Loop 2 started\n"); fflush(stdout);
+    for (int i = 0; i < 10; i++) {
+        printf("Loop 2 tick: %d\n", i); fflush(stdout);
+        if (counter1 > 0 && counter1 < 100000000) loop2_ticks_meanwhile++;
+        csp_hangup(50 * csp_timer_millisecond);
+    }
+    printf("Loop 2 finished\n"); fflush(stdout);
+    loop2_done = 1;
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+    csp_scheduler_init(1);
+
+    csp_proc_create(0, loop1, NULL);
+    csp_proc_create(0, loop2, NULL);
+
+    while (!loop2_done) {
+        usleep(100000);
+    }
+    if (loop2_ticks_meanwhile < 2) {
+        printf("FAILED: loop1 was never preempted.\n");
+        return 1;
+    }
+    printf("SUCCESS: Cooperative preemption worked.\n"); fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define NLOW    64
+#define ROUNDS  200
+
+atomic_int low_done = 0;
+atomic_int high_done = 0;
+volatile int low_done_before_high = -1;
+volatile int child_prio = -1;
+
+static void spin(void) {
+    for (volatile int i = 0; i < 10000; i++);
+}
+
+void low(void *arg) {
+    for (int i = 0; i < ROUNDS; i++) {
+        spin();
+        csp_sched_yield();
+    }
+    atomic_fetch_add(&low_done, 1);
+}
+
+void child(void *arg) {
+    child_prio = ((csp_proc_t *)csp_this_core->running)->prio;
+    atomic_fetch_add(&high_done, 1);
+}
+
+void high(void *arg) {
+    for (int i = 0; i < ROUNDS; i++) {
+        spin();
+        csp_sched_yield();
+    }
+    low_done_before_high = atomic_load(&low_done);
+    /* Spawned without a class, it inherits the high one. */
+    csp_proc_create(0, child, NULL);
+    atomic_fetch_add(&high_done, 1);
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    for (int i = 0; i < NLOW; i++) {
+        csp_proc_create_prio(csp_prio_low, 0, low, NULL);
+    }
+    csp_proc_create_prio(csp_prio_high, 0, high, NULL);
+
+    while (atomic_load(&low_done) < NLOW || atomic_load(&high_done) < 2) {
+        usleep(10000);
+    }
+    printf("Low procs done before the high one: %d/%d\n",
+           low_done_before_high, NLOW);
+    if (low_done_before_high > NLOW / 2) {
+        printf("FAILED: the high proc was starved.\n");
+        return 1;
+    }
+    if (child_prio != csp_prio_high) {
+        printf("FAILED: the child got class %d.\n", child_prio);
+        return 1;
+    }
+    printf("SUCCESS: Priority classes worked.\n"); fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+#include "chan.h"
+#include "runtime.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define BLOCKED 8
+
+csp_gochan_t *ch;
+atomic_int started = 0;
+
+void receiver(void *arg) {
+    atomic_fetch_add(&started, 1);
+    csp_gochan_recv(ch, NULL);
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    ch = csp_gochan_new(0);
+    for (int i = 0; i < BLOCKED; i++) {
+        csp_proc_create(0, receiver, NULL);
+    }
+    while (atomic_load(&started) < BLOCKED) {
+        usleep(10000);
+    }
+    usleep(50000);
+
+    char path[] = "/tmp/test_procs.XXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    runtime_dump_procs(fd);
+    size_t len = lseek(fd, 0, SEEK_CUR);
+    char *text = calloc(len + 1, 1);
+    if (pread(fd, text, len, 0) != (ssize_t)len) {
+        printf("FAILED: the procs were not dumped.\n");
+        return 1;
+    }
+    close(fd);
+    printf("%s", text);
+
+    int waiting = 0;
+    for (char *p = text; (p = strstr(p, "[chan wait on ")) != NULL; p++) {
+        waiting++;
+    }
+    if (waiting != BLOCKED || strstr(text, " live\n") == NULL) {
+        printf("FAILED: %d procs are waiting on the chan.\n", waiting);
+        return 1;
+    }
+
+    for (int i = 0; i < BLOCKED; i++) {
+        csp_gochan_send(ch, NULL);
+    }
+    free(text);
+    printf("SUCCESS: Procs dumped.\n"); fflush(stdout);
+    return 0;
+}
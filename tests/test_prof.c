@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+#include "runtime.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define BURNERS 4
+#define HZ 1000
+
+atomic_int done = 0;
+atomic_bool stop = false;
+volatile uint64_t sink;
+
+int64_t cpu_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void burner(void *arg) {
+    uint64_t x = 1;
+    while (!atomic_load(&stop)) {
+        for (int i = 0; i < 1000; i++) {
+            x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        }
+        csp_yield();
+    }
+    sink = x;
+    atomic_fetch_add(&done, 1);
+}
+
+/* Read what `write` wrote to a temporary file. */
+char *read_back(bool (*write)(int fd), size_t *len) {
+    char path[] = "/tmp/test_prof.XXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    if (!write(fd)) {
+        return NULL;
+    }
+    *len = lseek(fd, 0, SEEK_CUR);
+    char *text = calloc(*len + 1, 1);
+    if (pread(fd, text, *len, 0) != (ssize_t)*len) {
+        return NULL;
+    }
+    close(fd);
+    return text;
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    if (!runtime_prof_set_rate(HZ) || runtime_prof_rate() != HZ) {
+        printf("FAILED: the profiler was not started.\n");
+        return 1;
+    }
+    int64_t start = cpu_now();
+    for (int i = 0; i < BURNERS; i++) {
+        csp_proc_create(0, burner, NULL);
+    }
+    while (cpu_now() - start < 400000000) {
+        usleep(10000);
+    }
+    atomic_store(&stop, true);
+    while (atomic_load(&done) < BURNERS) {
+        usleep(10000);
+    }
+    runtime_prof_set_rate(0);
+
+    size_t len;
+    char *text = read_back(runtime_prof_write_folded, &len);
+    if (text == NULL) {
+        printf("FAILED: the samples were not written.\n");
+        return 1;
+    }
+    unsigned long long samples = 0, in_procs = 0;
+    for (char *line = text, *end; *line != '\0'; line = end + 1) {
+        end = strchr(line, '\n');
+        *end = '\0';
+        unsigned long long count = strtoull(strrchr(line, ' ') + 1, NULL, 10);
+        if (strncmp(line, "worker ", 7) != 0 &&
+            strncmp(line, "no worker", 9) != 0) {
+            printf("FAILED: bad line %s\n", line);
+            return 1;
+        }
+        samples += count;
+        if (strstr(line, ";proc ") != NULL) {
+            in_procs += count;
+        }
+    }
+    printf("Samples: %llu, in the procs: %llu\n", samples, in_procs);
+    /* The burners spent about 400ms of cpu time, which is 400 samples at
+     * 1000Hz, but the kernel takes them at its tick rate at most. */
+    if (in_procs < 20 || in_procs > samples) {
+        printf("FAILED: the procs were not sampled.\n");
+        return 1;
+    }
+    free(text);
+
+    text = read_back(runtime_prof_write_pprof, &len);
+    uintptr_t header[] = {0, 3, 0, 1000000 / HZ, 0};
+    if (text == NULL || len < sizeof(header) ||
+        memcmp(text, header, sizeof(header)) != 0) {
+        printf("FAILED: the profile was not written.\n");
+        return 1;
+    }
+    free(text);
+
+    runtime_prof_reset();
+    text = read_back(runtime_prof_write_folded, &len);
+    if (text == NULL || len != 0) {
+        printf("FAILED: the samples were not reset.\n");
+        return 1;
+    }
+    free(text);
+    printf("SUCCESS: Procs profiled.\n"); fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+#include "chan.h"
+#include "runtime.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define SPIKE 20000
+
+csp_gochan_t *ch;
+atomic_int started = 0, exited = 0;
+
+void waiter(void *arg) {
+    atomic_fetch_add(&started, 1);
+    csp_gochan_recv(ch, NULL);
+    atomic_fetch_add(&exited, 1);
+}
+
+uint64_t resident(void) {
+    runtime_mem_stats_t stats;
+    runtime_mem_stats(&stats);
+    return stats.mapped - stats.released;
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    ch = csp_gochan_new(0);
+    uint64_t before = resident();
+    for (int i = 0; i < SPIKE; i++) {
+        csp_proc_create(0, waiter, NULL);
+    }
+    while (atomic_load(&started) < SPIKE) {
+        usleep(10000);
+    }
+    usleep(50000);
+    for (int i = 0; i < SPIKE; i++) {
+        csp_gochan_send(ch, NULL);
+    }
+    while (atomic_load(&exited) < SPIKE) {
+        usleep(10000);
+    }
+    uint64_t peak = resident();
+    printf("Resident: %llu before, %llu after the spike\n",
+           (unsigned long long)before, (unsigned long long)peak);
+
+    runtime_set_scavenge_age(0);
+    uint64_t now = peak;
+    for (int i = 0; i < 300 && now > peak / 2; i++) {
+        usleep(10000);
+        now = resident();
+    }
+    runtime_mem_stats_t stats;
+    runtime_mem_stats(&stats);
+    printf("Resident: %llu after scavenging %llu\n", (unsigned long long)now,
+           (unsigned long long)stats.scavenged);
+    if (now > peak / 2 || stats.scavenged == 0) {
+        printf("FAILED: the memory was not returned.\n");
+        return 1;
+    }
+
+    /* The released memory is reused. */
+    atomic_store(&started, 0);
+    atomic_store(&exited, 0);
+    for (int i = 0; i < 100; i++) {
+        csp_proc_create(0, waiter, NULL);
+    }
+    while (atomic_load(&started) < 100) {
+        usleep(10000);
+    }
+    usleep(50000);
+    for (int i = 0; i < 100; i++) {
+        csp_gochan_send(ch, NULL);
+    }
+    while (atomic_load(&exited) < 100) {
+        usleep(10000);
+    }
+    printf("SUCCESS: Memory scavenged.\n"); fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "csp.h"
+#include "scheduler.h"
+#include "chan.h"
+#include "sync.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define NPAIRS  8
+#define ROUNDS  20000
+#define NLOCKERS 8
+
+typedef struct {
+    csp_gochan_t *ping, *pong;
+} pair_t;
+
+pair_t pairs[NPAIRS];
+csp_sync_mutex_t mutex;
+long counter = 0;
+atomic_int done = 0;
+atomic_int bad = 0;
+
+/* The receiver blocked on `ping` is woken by the sender, which then blocks on
+ * `pong` and switches to it directly. */
+void ping(void *arg) {
+    pair_t *p = (pair_t *)arg;
+    for (long i = 0; i < ROUNDS; i++) {
+        csp_gochan_send(p->ping, (void *)i);
+        if ((long)csp_gochan_recv(p->pong, NULL) != i + 1) {
+            atomic_fetch_add(&bad, 1);
+        }
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+void pong(void *arg) {
+    pair_t *p = (pair_t *)arg;
+    for (long i = 0; i < ROUNDS; i++) {
+        long v = (long)csp_gochan_recv(p->ping, NULL);
+        csp_gochan_send(p->pong, (void *)(v + 1));
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+void locker(void *arg) {
+    for (int i = 0; i < ROUNDS; i++) {
+        csp_sync_mutex_lock(&mutex);
+        counter++;
+        csp_sync_mutex_unlock(&mutex);
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    csp_sync_mutex_init(&mutex);
+    for (int i = 0; i < NPAIRS; i++) {
+        pairs[i].ping = csp_gochan_new(0);
+        pairs[i].pong = csp_gochan_new(0);
+        csp_proc_create(0, pong, &pairs[i]);
+        csp_proc_create(0, ping, &pairs[i]);
+    }
+    for (int i = 0; i < NLOCKERS; i++) {
+        csp_proc_create(0, locker, NULL);
+    }
+    while (atomic_load(&done) < 2 * NPAIRS + NLOCKERS) {
+        usleep(10000);
+    }
+
+    printf("Bad replies: %d, counter: %ld/%d\n", atomic_load(&bad), counter,
+           NLOCKERS * ROUNDS);
+    if (atomic_load(&bad) != 0 || counter != NLOCKERS * ROUNDS) {
+        printf("FAILED: the procs woke up with wrong states.\n");
+        return 1;
+    }
+    printf("SUCCESS: Direct switches worked.\n"); fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "csp.h"
+#include "scheduler.h"
+#include "chan.h"
+#include "runtime.h"
+
+/* LIBCSP_PRODUCTION=1 must be set in environment. */
+
+#define ROUNDS 1000
+#define TRACE_PATH "/tmp/libcsp_test_trace.json"
+
+csp_gochan_t *ping, *pong;
+atomic_int done = 0;
+
+void pinger(void *arg) {
+    for (long i = 0; i < ROUNDS; i++) {
+        csp_gochan_send(ping, (void *)i);
+        csp_gochan_recv(pong, NULL);
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+void ponger(void *arg) {
+    for (long i = 0; i < ROUNDS; i++) {
+        csp_gochan_send(pong, csp_gochan_recv(ping, NULL));
+    }
+    atomic_fetch_add(&done, 1);
+}
+
+int main() {
+    printf("Main started\n"); fflush(stdout);
+
+    ping = csp_gochan_new(0);
+    pong = csp_gochan_new(0);
+    runtime_trace_enable(true);
+    csp_proc_create(0, ponger, NULL);
+    csp_proc_create(0, pinger, NULL);
+    while (atomic_load(&done) < 2) {
+        usleep(10000);
+    }
+    runtime_trace_enable(false);
+
+    if (!runtime_trace_dump(TRACE_PATH)) {
+        printf("FAILED: the trace was not written.\n");
+        return 1;
+    }
+    FILE *f = fopen(TRACE_PATH, "r");
+    char line[512];
+    int runs = 0, blocks = 0, spawns = 0;
+    bool closed = false;
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+        runs += strstr(line, "\"ph\":\"B\"") != NULL;
+        blocks += strstr(line, "\"reason\":\"chan\"") != NULL;
+        spawns += strstr(line, "\"name\":\"spawn\"") != NULL;
+        closed = strcmp(line, "]\n") == 0;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    unlink(TRACE_PATH);
+
+    printf("Events: %d runs, %d blocks on chans, %d spawns\n", runs, blocks,
+           spawns);
+    if (runs < ROUNDS || blocks < ROUNDS || spawns < 2 || !closed) {
+        printf("FAILED: the events are missing from the trace.\n");
+        return 1;
+    }
+    printf("SUCCESS: Tracing worked.\n"); fflush(stdout);
+    return 0;
+}